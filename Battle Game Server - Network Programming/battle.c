@@ -3,55 +3,1001 @@
  * This is the server for a text-based battle game, communicating over 
  * the network with clients and listening either for chatter from a client
  * _or_ for a new connection.
+ *
+ * All sockets are non-blocking. On Linux the server waits for them with
+ * epoll, edge-triggered, so each wakeup costs only the sockets that are
+ * ready and there is no limit on the number of clients beyond the open
+ * file limit. Elsewhere, when built with -DUSE_SELECT, or if epoll cannot
+ * be set up, it falls back to select, which is limited to FD_SETSIZE
+ * descriptors. Either way a ready socket is read until it would block.
+ * Where the kernel supports it, io_uring is used before either: accepts
+ * and receives are multishot, into buffers provided to the kernel, and
+ * each client's output goes out as one chain of linked sends, so a pass
+ * of the event loop costs a single io_uring_enter. BATTLE_BACKEND=epoll
+ * or BATTLE_BACKEND=select in the environment skips the better ones.
+ *
+ * Output never blocks: cwrite queues it on the client, and at the end of
+ * each pass of the event loop everything queued is sent with one writev
+ * per client. What the socket does not take waits until it is writable.
+ * A client that lets its queue grow past OUT_SOFT_MARK misses broadcasts,
+ * and one that lets it grow past OUT_HIGH_WATER is dropped.
+ *
+ * A broadcast is built once, into a refcounted message that the output
+ * queue of every client it goes to points at. Broadcasts are queued for at
+ * most FANOUT_BATCH clients per pass, and the event loop does not wait for
+ * events while some are left, so a crowd joining at once does not hold up
+ * the matches being played.
+ *
+ * The server runs one shard per core (or as many as given on the command
+ * line). A shard is a thread with its own listening socket on PORT, shared
+ * through SO_REUSEPORT so the kernel spreads connections across them, its
+ * own event loop, clients and waiting queue, and its own random numbers.
+ * A match is always played within one shard: a player with nobody to play
+ * on their shard is handed to a shard that has someone waiting. Shards
+ * only talk through their inboxes, which also carry broadcasts.
  */
 
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <pthread.h>
 #include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#if defined(__linux__) && !defined(USE_SELECT)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <stdint.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT //headers new enough for multishot receive
+#define USE_URING
+#endif
+#endif
+#endif
+#endif
+
 #include "battle.h"
 
-/* Initializes the pseudo-random number generator */
+/* All the shards, and the one run by the calling thread */
+static struct shard *shards;
+static int nshards;
+static __thread struct shard *self;
+
+/* Backends not to try, from BATTLE_BACKEND */
+static int skip_uring, skip_epoll;
+
+/* Initializes the pseudo-random number generator of each shard */
 void initialize_number_generator(void){
-  srand((unsigned) time(NULL));
+  int i;
+  for (i = 0; i < nshards; i++)
+    shards[i].seed = ((unsigned) time(NULL) ^ (i + 1) * 2654435761u) | 1; //never 0
 }
 
-int main(void) {
-    int clientfd, maxfd, nready;
-    struct client *p;
-    struct client *head = NULL;
-    socklen_t len;
-    struct sockaddr_in q; //socket address structure
-    fd_set allset;
-    fd_set rset; //read set
+/* Returns the next number from the shard's own generator (xorshift), so
+ * threads never contend on the state behind rand() */
+static unsigned int shard_rand(void) {
+    unsigned int x = self->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return self->seed = x;
+}
 
+/* Raises the open file limit as far as it goes, so idle players are not
+ * turned away at the default of 1024 */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* Runs the event loop of shard arg in the calling thread, forever */
+static void *run_shard(void *arg) {
+    self = arg;
+#ifdef USE_URING
+    if (!skip_uring)
+        uring_loop(self->listenfd, &self->head); //only returns if io_uring cannot be used
+#endif
+#ifdef USE_EPOLL
+    if (!skip_epoll)
+        epoll_loop(self->listenfd, &self->head); //only returns if epoll cannot be used
+#endif
+    select_loop(self->listenfd, &self->head);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char *backend = getenv("BATTLE_BACKEND");
     int i;
 
+    skip_uring = backend && (strcmp(backend, "epoll") == 0 || strcmp(backend, "select") == 0);
+    skip_epoll = backend && strcmp(backend, "select") == 0;
+
+    //one shard per core, unless told otherwise
+    nshards = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nshards < 1)
+        nshards = 1;
+    if (nshards > MAX_SHARDS)
+        nshards = MAX_SHARDS;
+#ifndef SO_REUSEPORT
+    nshards = 1; //no way to share the port
+#endif
+    if ((shards = calloc(nshards, sizeof(struct shard))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
     initialize_number_generator(); 
-    int listenfd = bindandlisten();
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
+    raise_fd_limit();
+    //a client that disconnects makes writev fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < nshards; i++) {
+        shards[i].id = i;
+        shards[i].epfd = -1;
+        shards[i].listenfd = bindandlisten(nshards > 1);
+        pthread_mutex_init(&shards[i].lock, NULL);
+        if (grow_clients(&shards[i]) == -1) //the first clients are ready before any connect
+            exit(1);
+        shards[i].fanout_budget = FANOUT_BATCH;
+        if (pipe(shards[i].wakefd) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        if (set_nonblocking(shards[i].wakefd[0]) == -1 || set_nonblocking(shards[i].wakefd[1]) == -1)
+            exit(1);
+    }
+    printf("serving on port %d with %d shard%s\n", PORT, nshards, nshards > 1 ? "s" : "");
+    for (i = 1; i < nshards; i++) {
+        if ((errno = pthread_create(&shards[i].thread, NULL, run_shard, &shards[i])) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    run_shard(&shards[0]);
+    return 0;
+}
+
+/* Makes fd non-blocking. Returns -1 on error */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Accepts one pending connection on the non-blocking socket listenfd,
+ * prompts the client for a name and adds it to the list. Returns the new
+ * client, or NULL once there are no more connections waiting. With select,
+ * a connection whose fd does not fit in an fd_set is closed again.
+ **/
+static struct client *accept_client(int listenfd, struct client **top, int maxfd) {
+    struct sockaddr_in q; //socket address structure
+    socklen_t len;
+    int clientfd;
+
+    while (1) {
+        len = sizeof(q);
+        //returns new fd which refers to TCP connection with client
+        //reads & writes happen on this new fd returned by accept
+        if ((clientfd = accept(listenfd, (struct sockaddr *)&q, &len)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept"); //out of descriptors: try again on the next wakeup
+            return NULL;
+        }
+        if ((maxfd > 0 && clientfd >= maxfd) || set_nonblocking(clientfd) == -1) {
+            fprintf(stderr, "too many clients, dropping connection from %s\n", inet_ntoa(q.sin_addr));
+            close(clientfd);
+            continue;
+        }
+        return new_client(top, clientfd, q.sin_addr);
+    }
+}
+
+/* Adds a client for the socket clientfd, connected from addr, and prompts
+ * it for a name */
+static struct client *new_client(struct client **top, int clientfd, struct in_addr addr) {
+    printf("connection from %s\n", inet_ntoa(addr));
+    struct client *p = addclient(top, clientfd, addr);
+    cwrite(p, "What is your name? ", 19); //prompt for their name
+    return p;
+}
+
+/* Handles everything client p has sent so far. A client that quits is
+ * closed, and dropped at the end of the pass. With hangup set the peer has
+ * shut down its side, so its socket is read up to the end of the stream
+ * rather than stopping at a short read: under edge-triggered epoll no
+ * further event would come for it. */
+static void serve_client(struct client *p, struct client **top, int hangup) {
+    int result = 0;
+    while (!p->closing && ((result = handleclient(p, top)) == 0 || (result == 1 && hangup)))
+        ;
+    if (result == -1)
+        closeclient(p);
+}
+
+/* Id of a shard with a player waiting for an opponent, or -1. A player
+ * with nobody to play on their own shard is handed to that shard. */
+static int lobby = -1;
+
+/* Takes the shard advertised in the lobby, if it is another one, so that
+ * no other player is sent there for the same waiting player. Returns its
+ * id, or -1. */
+static int claim_lobby(void) {
+    int to = __atomic_load_n(&lobby, __ATOMIC_ACQUIRE);
+    if (to < 0 || to == self->id || !__atomic_compare_exchange_n(&lobby, &to, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return -1;
+    return to;
+}
+
+/* Advertises this shard in the lobby while it has players waiting, and
+ * takes it out when it has none */
+static void update_lobby(void) {
+    int waiting = self->waiting.head != NULL;
+    int expected = waiting ? -1 : self->id;
+    if (nshards > 1 && __atomic_load_n(&lobby, __ATOMIC_RELAXED) == expected)
+        __atomic_compare_exchange_n(&lobby, &expected, waiting ? self->id : -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* Wakes shard to up to look at its inbox */
+static void wake_shard(struct shard *to) {
+    //a full pipe already holds a wakeup, so a failed write loses nothing
+    if (write(to->wakefd[1], "", 1) == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("write");
+}
+
+/**
+ * Hands client p, which has nobody to play here, to shard p->handoff. The
+ * client leaves this shard entirely and is matched by the other one.
+ **/
+static void handoff(struct client **top, struct client *p) {
+    unlinkclient(top, p);
+#ifdef USE_EPOLL
+    if (self->epfd >= 0)
+        epoll_ctl(self->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+#endif
+#ifdef USE_URING
+    if (p->inflight > 0) { //sent on once the kernel is done with it
+        p->moving = 1;
+        uring_cancel(self->ring, p);
+        return;
+    }
+#endif
+    send_to_shard(p);
+}
+
+/* Puts client p in the inbox of shard p->handoff */
+static void send_to_shard(struct client *p) {
+    struct shard *to = &shards[p->handoff];
+    pthread_mutex_lock(&to->lock);
+    p->next = to->arrivals;
+    to->arrivals = p;
+    pthread_mutex_unlock(&to->lock);
+    wake_shard(to);
+}
+
+/* Reverses a list of clients linked through next, and returns its head */
+static struct client *reverse_clients(struct client *p) {
+    struct client *prev = NULL, *next;
+    for (; p; p = next) {
+        next = p->next;
+        p->next = prev;
+        prev = p;
+    }
+    return prev;
+}
+
+/* Reverses a list of broadcasts, and returns its head */
+static struct fanout *reverse_fanout(struct fanout *f) {
+    struct fanout *prev = NULL, *next;
+    for (; f; f = next) {
+        next = f->next;
+        f->next = prev;
+        prev = f;
+    }
+    return prev;
+}
+
+/**
+ * Empties the inbox of this shard: takes in the clients other shards
+ * handed over, and passes on their broadcasts to the clients here.
+ **/
+static void read_inbox(struct client **top) {
+    struct client *p, *arrivals;
+    struct fanout *f, *fanout;
+    char drain[64];
+
+    while (read(self->wakefd[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&self->lock);
+    arrivals = self->arrivals;
+    fanout = self->inbox_fanout;
+    self->arrivals = NULL;
+    self->inbox_fanout = NULL;
+    pthread_mutex_unlock(&self->lock);
+    arrivals = reverse_clients(arrivals); //both were pushed newest first
+    fanout = reverse_fanout(fanout);
+
+    while ((f = fanout) != NULL) {
+        fanout = f->next;
+        queue_fanout(f);
+    }
+    while ((p = arrivals) != NULL) {
+        arrivals = p->next;
+        p->handoff = -1;
+        linkclient(top, p);
+        if (watch_client(p) == -1) {
+            closeclient(p);
+            continue;
+        }
+        if (p->outhead)
+            add_pending(p); //output the other shard did not get to send
+        if (p->inbuf > 0)
+            process_input(p, top); //input the other shard did not get to
+        match_player(p);
+    }
+}
+
+/* Adds player p to the end of the waiting queue */
+static void wait_for_opponent(struct client *p) {
+    struct waitqueue *waiting = &self->waiting;
+    p->wait_next = NULL;
+    p->wait_prev = waiting->tail;
+    if (waiting->tail)
+        waiting->tail->wait_next = p;
+    else
+        waiting->head = p;
+    waiting->tail = p;
+}
+
+/* Takes player p out of the waiting queue, if it is there */
+static void stop_waiting(struct client *p) {
+    struct waitqueue *waiting = &self->waiting;
+    if (p->wait_prev == NULL && waiting->head != p)
+        return;
+    if (p->wait_prev)
+        p->wait_prev->wait_next = p->wait_next;
+    else
+        waiting->head = p->wait_next;
+    if (p->wait_next)
+        p->wait_next->wait_prev = p->wait_prev;
+    else
+        waiting->tail = p->wait_prev;
+    p->wait_next = p->wait_prev = NULL;
+}
+
+/* Adds p to the clients to flush, drop or hand off at the end of the pass */
+static void add_pending(struct client *p) {
+    if (p->pending >= 0)
+        return;
+    if (self->npending == self->maxpending) {
+        self->maxpending = self->maxpending ? self->maxpending * 2 : 64;
+        if ((self->pending = realloc(self->pending, self->maxpending * sizeof(struct client *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    p->pending = self->npending;
+    self->pending[self->npending++] = p;
+}
+
+/* Marks client p to be dropped at the end of the pass. Until then, p stays
+ * in the list but is not read from or written to. */
+static void closeclient(struct client *p) {
+    p->closing = 1;
+    stop_waiting(p); //nobody is matched with a client about to go
+    add_pending(p);
+}
+
+/**
+ * Queues the next batch of broadcasts, then flushes every client written
+ * to in this pass of the event loop, drops those that quit or cannot be
+ * written to, and hands off those with nobody to play here. Dropping a
+ * client writes to others, who are flushed in the same call.
+ **/
+static void flush_pending(struct client **top) {
+    struct client *p;
+    int i;
+    run_fanout();
+    self->fanout_budget = FANOUT_BATCH; //for the next pass
+    for (i = 0; i < self->npending; i++) {
+        if ((p = self->pending[i]) == NULL)
+            continue;
+        p->pending = -1;
+        if (!p->closing && flushclient(p) == -1)
+            p->closing = 1;
+        if (p->closing)
+            dropclient(top, p);
+        else if (p->handoff >= 0)
+            handoff(top, p);
+    }
+    self->npending = 0;
+    update_lobby();
+}
+
+/* Tells the others that client p quit, removes it and closes its socket */
+static void dropclient(struct client **top, struct client *p) {
+    char outbuf[512];
+    struct client *opp = p->last_opponent;
+    if (p->engaged & (p->last_move != 'n')) { //If player p was previously in a match with another player
+        snprintf(outbuf, 49 + strlen(p->name), "--%s dropped. You win!\n\nAwaiting next opponent...\n", p->name);
+        cwrite(opp, outbuf, strlen(outbuf));
+        /* Clear all memory of the match for the opposing player */
+        opp->last_opponent = NULL; 
+        opp->last_opponent_id = 0;
+        opp->active = 0;
+        opp->engaged = 0;
+        opp->last_move = 0;
+        opp->inbuf = 0;
+    }
+    //other clients may still name p as their last opponent, even on another
+    //shard. Matching compares ids, so p's struct can be reused right away.
+    if (p->last_move != 'n'){
+        snprintf(outbuf, 13 + strlen(p->name), "**%s leaves**\n", p->name);
+        broadcast(p->id, outbuf, strlen(outbuf));
+    }
+    printf("Disconnect from %s\n", inet_ntoa(p->ipaddr)); //20
+    *top = removeclient(*top, p);
+}
+
+#ifdef USE_EPOLL
+#define MAX_EVENTS 64
+
+/**
+ * Event loop using epoll. Each socket is registered edge-triggered, for
+ * reading and writing, with its client as the event data (NULL for the
+ * listening socket, the shard for its inbox). Returns only if epoll cannot
+ * be set up.
+ **/
+static void epoll_loop(int listenfd, struct client **top) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct client *p;
+    int epfd, n, i;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(epfd);
+        return;
+    }
+    ev.data.ptr = self;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, self->wakefd[0], &ev) == -1) {
+        perror("epoll_ctl");
+        close(epfd);
+        return;
+    }
+    self->epfd = epfd;
+    while (1) {
+        //only look for events while broadcasts are left to queue
+        if ((n = epoll_wait(epfd, events, MAX_EVENTS, self->fanout ? 0 : -1)) == -1) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                //edge-triggered: take every connection that is waiting
+                while ((p = accept_client(listenfd, top, 0)) != NULL) {
+                    if (watch_client(p) == -1)
+                        closeclient(p);
+                }
+                continue;
+            }
+            if (events[i].data.ptr == self) {
+                read_inbox(top);
+                continue;
+            }
+            //clients are only freed by flush_pending, so p is still there
+            p = events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && !p->closing && flushclient(p) == -1)
+                closeclient(p);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                serve_client(p, top, (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0);
+        }
+        flush_pending(top);
+    }
+}
+#endif
+
+#ifdef USE_URING
+/* Size of the submission queue, and the receive buffers given to the kernel */
+#define URING_ENTRIES 1024
+#define URING_BUFS 1024
+#define URING_BUFSIZE 2048
+#define URING_GROUP 0
+
+/* The low bits of the user_data of a request say what it is for; the rest
+ * is its client, if it has one */
+#define UD_RECV 0
+#define UD_SEND 1
+#define UD_ACCEPT 2
+#define UD_WAKE 3
+#define UD_NONE 4
+#define UD_TAGS 7
+
+/* An io_uring instance: its queues, mapped from the kernel, and the buffers
+ * it receives into */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;          // entries not submitted yet
+    char *bufs;               // URING_BUFS buffers of URING_BUFSIZE bytes
+    int oneshot_accept;       // 1 if the kernel has no multishot accept
+    int oneshot_recv;         // 1 if the kernel has no multishot receive
+    int accept_stalled;       // 1 if accepting stopped for lack of fds
+};
+
+/**
+ * Sets up an io_uring with every operation the server uses. Returns NULL,
+ * after saying why, if the kernel cannot do that.
+ **/
+static struct uring *uring_init(void) {
+    int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD,
+                  IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL };
+    struct io_uring_params params;
+    struct io_uring_probe *probe = NULL;
+    struct io_uring_sqe *sqe;
+    struct uring *r = NULL;
+    void *rings = MAP_FAILED, *sqes = MAP_FAILED;
+    size_t size = 0, cqsize;
+    int fd, i;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4; //room for multishot completions
+    if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) == -1) {
+        perror("io_uring_setup");
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        goto fail;
+    }
+    probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if (probe == NULL || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1) {
+        perror("io_uring_register");
+        goto fail;
+    }
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            fprintf(stderr, "io_uring: operation %d not supported\n", ops[i]);
+            goto fail;
+        }
+    }
+
+    size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqsize > size)
+        size = cqsize;
+    rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+    if ((r = calloc(1, sizeof(*r))) == NULL || (r->bufs = malloc(URING_BUFS * URING_BUFSIZE)) == NULL) {
+        perror("malloc");
+        goto fail;
+    }
+    free(probe);
+    r->fd = fd;
+    r->sq_head = (unsigned *)((char *)rings + params.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)rings + params.sq_off.tail);
+    r->sq_array = (unsigned *)((char *)rings + params.sq_off.array);
+    r->sq_mask = *(unsigned *)((char *)rings + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sqes = sqes;
+    r->cq_head = (unsigned *)((char *)rings + params.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)rings + params.cq_off.tail);
+    r->cq_mask = *(unsigned *)((char *)rings + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)rings + params.cq_off.cqes);
+
+    //hand all the buffers to the kernel
+    sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = URING_BUFS;
+    sqe->addr = (uintptr_t)r->bufs;
+    sqe->len = URING_BUFSIZE;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = UD_NONE;
+    return r;
+
+fail:
+    if (r != NULL)
+        free(r);
+    if (sqes != MAP_FAILED)
+        munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+    if (rings != MAP_FAILED)
+        munmap(rings, size);
+    free(probe);
+    close(fd);
+    return NULL;
+}
+
+/* Returns a cleared submission queue entry, submitting those queued first
+ * if the queue is full */
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned tail, i;
+
+    uring_reserve(r, 1);
+    tail = *r->sq_tail;
+    i = tail & r->sq_mask;
+    sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[i] = i;
+    //the kernel only looks at the queue in io_uring_enter, so the entry
+    //can be filled in after it is added
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+/* Makes room for n more entries in the submission queue */
+static void uring_reserve(struct uring *r, unsigned n) {
+    while (*r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + n > r->sq_entries) {
+        if (uring_enter(r, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+    }
+}
+
+/* Submits the queued entries and, if wait is 1, waits for a completion.
+ * Returns -1 on error. */
+static int uring_enter(struct uring *r, int wait) {
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n == -1)
+        return -1;
+    r->queued -= n;
+    return 0;
+}
+
+/* Starts accepting connections on listenfd */
+static void uring_accept(struct uring *r, int listenfd) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = r->oneshot_accept ? 0 : IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD_ACCEPT;
+}
+
+/* Starts receiving from client p into the provided buffers */
+static void uring_recv(struct uring *r, struct client *p) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = p->fd;
+    sqe->len = 0; //as much as a buffer holds
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->ioprio = r->oneshot_recv ? 0 : IORING_RECV_MULTISHOT;
+    sqe->user_data = (uintptr_t)p | UD_RECV;
+    p->inflight++;
+}
+
+/* Gives receive buffer bid back to the kernel */
+static void uring_provide(struct uring *r, int bid) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (uintptr_t)(r->bufs + bid * URING_BUFSIZE);
+    sqe->len = URING_BUFSIZE;
+    sqe->buf_group = URING_GROUP;
+    sqe->off = bid;
+    sqe->user_data = UD_NONE;
+}
+
+/* Waits for the inbox pipe fd to be written to */
+static void uring_wake(struct uring *r, int fd) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UD_WAKE;
+}
+
+/* Cancels the receive of client p. Its sends are left to finish. */
+static void uring_cancel(struct uring *r, struct client *p) {
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)p | UD_RECV;
+    sqe->user_data = UD_NONE;
+}
+
+/**
+ * Sends the output queued for client p as one chain of linked sends, a
+ * chunk each, so they go out in order. Does nothing while a chain is in
+ * flight; what was queued since is sent once it completes. Returns 0.
+ **/
+static int uring_flush(struct uring *r, struct client *p) {
+    struct io_uring_sqe *sqe;
+    struct outchunk *c;
+    int n;
+
+    if (p->sending > 0)
+        return 0;
+    for (c = p->outhead, n = 0; c != NULL && n < OUT_IOV; c = c->next)
+        n++;
+    uring_reserve(r, n); //a chain must be submitted in one go
+    p->sendnext = p->outhead;
+    for (c = p->outhead; n > 0; c = c->next, n--) {
+        sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = p->fd;
+        sqe->addr = (uintptr_t)(chunk_data(c) + c->start);
+        sqe->len = c->end - c->start;
+        //a short send would break the chain and leave a gap in the output
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (n > 1)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (uintptr_t)p | UD_SEND;
+        c->sending = 1;
+        p->sending++;
+        p->inflight++;
+    }
+    return 0;
+}
+
+/* Handles a connection accepted by io_uring */
+static void uring_accepted(struct uring *r, struct io_uring_cqe *cqe, struct client **top) {
+    struct sockaddr_in q;
+    socklen_t len = sizeof(q);
+    struct client *p;
+
+    if (cqe->res >= 0) {
+        if (getpeername(cqe->res, (struct sockaddr *)&q, &len) == -1)
+            memset(&q, 0, sizeof(q));
+        p = new_client(top, cqe->res, q.sin_addr);
+        watch_client(p);
+    } else if (cqe->res == -EINVAL && !r->oneshot_accept) {
+        r->oneshot_accept = 1;
+    } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+        //try again at the end of the next pass, not straight away
+        r->accept_stalled = 1;
+        return;
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+        errno = -cqe->res;
+        perror("accept");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_accept(r, self->listenfd);
+}
+
+/* Copies n bytes received for client p into its buffer, as much at a time
+ * as fits, and handles them */
+static void take_input(struct client *p, char *data, int n, struct client **top) {
+    int room;
+    while (n > 0 && !p->closing) {
+        room = sizeof(p->buf) - 1 - p->inbuf;
+        if (room > n)
+            room = n;
+        memcpy(p->buf + p->inbuf, data, room);
+        p->inbuf += room;
+        data += room;
+        n -= room;
+        process_input(p, top);
+    }
+}
+
+/* Handles data, end of file or an error received for client p */
+static void uring_received(struct uring *r, struct client *p, struct io_uring_cqe *cqe, struct client **top) {
+    int gone = p->retired || p->moving, bid, n;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !gone) {
+            take_input(p, r->bufs + bid * URING_BUFSIZE, cqe->res, top);
+        } else if (cqe->res > 0 && p->moving) { //left for the next shard
+            n = sizeof(p->buf) - 1 - p->inbuf;
+            if (n > cqe->res)
+                n = cqe->res;
+            memcpy(p->buf + p->inbuf, r->bufs + bid * URING_BUFSIZE, n);
+            p->inbuf += n;
+        }
+        uring_provide(r, bid);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) //still receiving
+        return;
+    p->inflight--;
+    if (gone) {
+        uring_settle(p);
+    } else if (p->closing) {
+        return;
+    } else if (cqe->res == 0) {
+        closeclient(p);
+    } else if (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+        uring_recv(r, p); //after the buffers given back, in queue order
+    } else if (cqe->res == -EINVAL && !r->oneshot_recv) {
+        r->oneshot_recv = 1;
+        uring_recv(r, p);
+    } else {
+        errno = -cqe->res;
+        perror("recv");
+        closeclient(p);
+    }
+}
+
+/* Handles a send of the chunk at the head of the output of client p */
+static void uring_sent(struct client *p, int res) {
+    struct outchunk *c = p->sendnext;
+
+    p->sendnext = c->next;
+    c->sending = 0;
+    p->sending--;
+    p->inflight--;
+    if (res > 0) {
+        c->start += res;
+        p->outqueued -= res;
+        if (c->start == c->end) {
+            p->outhead = c->next;
+            if (p->outhead == NULL)
+                p->outtail = NULL;
+            put_chunk(c);
+        }
+    } else if (res < 0 && res != -ECANCELED && !p->closing && !p->retired && !p->moving) {
+        errno = -res;
+        perror("send");
+        closeclient(p);
+    }
+    if (p->retired || p->moving)
+        uring_settle(p);
+    else if (p->sending == 0 && p->outhead != NULL && !p->closing)
+        add_pending(p); //send the rest at the end of the pass
+}
+
+/* Finishes with a client that has left the shard, once the kernel has
+ * nothing more for it */
+static void uring_settle(struct client *p) {
+    if (p->inflight > 0)
+        return;
+    if (p->retired) {
+        freeclient(p);
+    } else {
+        p->moving = 0;
+        send_to_shard(p);
+    }
+}
+
+/**
+ * Event loop using io_uring. Each pass submits all the requests queued in
+ * the last one, waits for a completion and handles all that have arrived.
+ * Returns only if io_uring cannot be set up.
+ **/
+static void uring_loop(int listenfd, struct client **top) {
+    struct io_uring_cqe *cqe;
+    struct uring *r;
+    unsigned head;
+
+    if ((r = uring_init()) == NULL)
+        return;
+    self->ring = r;
+    uring_accept(r, listenfd);
+    uring_wake(r, self->wakefd[0]);
+    while (1) {
+        if (uring_enter(r, self->fanout == NULL) == -1) { //no waiting while broadcasts are left
+            if (errno != EINTR)
+                perror("io_uring_enter");
+            continue;
+        }
+        head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &r->cqes[head & r->cq_mask];
+            //clients are only freed by flush_pending and uring_settle, once
+            //the kernel is done with them, so the client is still there
+            switch (cqe->user_data & UD_TAGS) {
+            case UD_RECV:
+                uring_received(r, (struct client *)(uintptr_t)(cqe->user_data & ~(__u64)UD_TAGS), cqe, top);
+                break;
+            case UD_SEND:
+                uring_sent((struct client *)(uintptr_t)(cqe->user_data & ~(__u64)UD_TAGS), cqe->res);
+                break;
+            case UD_ACCEPT:
+                uring_accepted(r, cqe, top);
+                break;
+            case UD_WAKE:
+                read_inbox(top);
+                uring_wake(r, self->wakefd[0]);
+                break;
+            }
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+        }
+        flush_pending(top);
+        if (r->accept_stalled) {
+            r->accept_stalled = 0;
+            uring_accept(r, listenfd);
+        }
+    }
+}
+#endif
+
+/* Starts watching the socket of client p with the shard's backend: adds it
+ * to the epoll set, or starts receiving with io_uring. Returns -1 on error. */
+static int watch_client(struct client *p) {
+#ifdef USE_URING
+    if (self->ring) {
+        uring_recv(self->ring, p);
+        return 0;
+    }
+#endif
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    if (self->epfd >= 0) {
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = p;
+        if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, p->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+/* Event loop using select, for systems without epoll */
+static void select_loop(int listenfd, struct client **top) {
+    int maxfd, nready, i;
+    struct client *p;
+    fd_set rset; //read set
+    fd_set wset; //clients with output the socket did not take yet
+    struct timeval nowait;
 
     while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
+        // build the sets passed into select from the clients still here:
+        // clients are dropped at the end of a pass, often not by their own event
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        FD_SET(listenfd, &rset);
+        FD_SET(self->wakefd[0], &rset);
+        // maxfd identifies how far into the set to search
+        maxfd = listenfd > self->wakefd[0] ? listenfd : self->wakefd[0];
+        for (p = *top; p != NULL; p = p->next) {
+            FD_SET(p->fd, &rset);
+            if (p->outhead)
+                FD_SET(p->fd, &wset);
+            if (p->fd > maxfd)
+                maxfd = p->fd;
+        }
 
         //waiting until one or more of the file descriptors become "ready"
         //The select function blocks the calling process until there is activity on 
         //any of the specified sets of file descriptors
-        /* Timeout set to NULL: wait forever until new signal*/
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
+        /* Timeout set to NULL: wait forever until new signal, unless
+           broadcasts are left to queue */
+        nowait.tv_sec = nowait.tv_usec = 0;
+        nready = select(maxfd + 1, &rset, &wset, NULL, self->fanout ? &nowait : NULL);
 
         if (nready == -1) {
             perror("select");
@@ -59,43 +1005,25 @@ int main(void) {
         }
         if (FD_ISSET(listenfd, &rset)){
             printf("a new client is connecting\n");
-            len = sizeof(q);
-            //blocks waiting for a connection from the queue
-            //returns new fd which refers to TCP connection with client
-            //reads & writes happen on this new fd returned by accept
-            if ((clientfd = accept(listenfd, (struct sockaddr *)&q, &len)) < 0) {
-                perror("accept");
-                exit(1);
-            }
-            //This macro adds filedes to the file descriptor set allset.
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-
-            printf("connection from %s\n", inet_ntoa(q.sin_addr));
-            cwrite(clientfd, "What is your name? ", 19); //prompt for their name
-            addclient(&head, clientfd, q.sin_addr);
+            //new clients are added to the sets on the next pass
+            while (accept_client(listenfd, top, FD_SETSIZE) != NULL)
+                ;
         }
+        if (FD_ISSET(self->wakefd[0], &rset))
+            read_inbox(top);
 
         for(i = 0; i <= maxfd; i++) {
-            if (FD_ISSET(i, &rset)) {
-                for (p = head; p != NULL; p = p->next) {
-                    if (p->fd == i) {
-                        int result = handleclient(p, &head);
-                        if (result == -1) {
-                            int tmp_fd = p->fd;
-                            head = removeclient(head, p);
-                            FD_CLR(tmp_fd, &allset);
-                            close(tmp_fd);
-                        }
-                        break;
-                    }
-                }
+            if (i != listenfd && i != self->wakefd[0] && (FD_ISSET(i, &rset) || FD_ISSET(i, &wset))) {
+                //clients are only freed or handed off by flush_pending, so p is still here
+                p = self->clients[i];
+                if (FD_ISSET(i, &wset) && !p->closing && flushclient(p) == -1)
+                    closeclient(p);
+                if (FD_ISSET(i, &rset))
+                    serve_client(p, top, 0);
             }
         }
+        flush_pending(top);
     }
-    return 0;
 }
 
 /**
@@ -108,11 +1036,11 @@ void show_player_stats(struct client *p1, struct client *p2){
     snprintf(buf, (51 + sizeof p1->hitpoints + sizeof p1->powermoves + strlen(p2->name) + sizeof p2->hitpoints), 
             "Your hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n", 
             p1->hitpoints, p1->powermoves, p2->name, p2->hitpoints);               
-    cwrite(p1->fd, buf, strlen(buf));    //write the buf to client
+    cwrite(p1, buf, strlen(buf));    //write the buf to client
     snprintf(buf, (51 + sizeof p2->hitpoints + sizeof p2->powermoves + strlen(p1->name) + sizeof p1->hitpoints), 
             "Your hitpoints: %d\nYour powermoves: %d\n\n%s's hitpoints: %d\n", 
             p2->hitpoints, p2->powermoves, p1->name, p1->hitpoints);    
-    cwrite(p2->fd, buf, strlen(buf));    //write the buf to client
+    cwrite(p2, buf, strlen(buf));    //write the buf to client
 }
 
 /**
@@ -124,115 +1052,164 @@ void show_menu(struct client *p){
     if (!p->active){
         snprintf(buf, 27 + strlen(p->last_opponent->name), 
             "Waiting for %s to strike...\n", p->last_opponent->name);
-        cwrite(p->fd, buf, strlen(buf));
+        cwrite(p, buf, strlen(buf));
     } else {
         if (p->powermoves > 0)
-            cwrite(p->fd, "\n(a)ttack\n(p)owermove\n(s)peak something\n", 41);
+            cwrite(p, "\n(a)ttack\n(p)owermove\n(s)peak something\n", 41);
         else
-            cwrite(p->fd, "\n(a)ttack\n(s)peak something\n", 29);
+            cwrite(p, "\n(a)ttack\n(s)peak something\n", 29);
     }
 }
 
 /**
- * Matches a player by searching for a suitable partner starting from 
- * the beginning of the client list. If found, sets all the initial 
- * parameters of the match. 
+ * Matches a player with the player waiting longest for an opponent. If
+ * found, sets all the initial parameters of the match. Otherwise the
+ * player is handed to another shard with a player waiting, at the end of
+ * the pass, or joins the waiting queue. Returns 1 if a match started.
  **/
-int match_player(struct client *top, struct client *p){
-  //searching for suitable opponent
-  struct client *opp = top;
-  while (opp) {
-    //Checks if the player is not currently matched (engaged) and did not battle
-    //player p most recently (last_opponent).
-    if (p->fd != opp->fd && !opp->engaged && (!p->last_opponent || !opp->last_opponent || p->last_opponent->fd != opp->fd)){
-      //There is a player available
-      p->last_opponent = opp;
-      opp->last_opponent = p;
-      //Changes both players' 'engaged' variable to 1 to indicate they are currently in a match.
-      p->engaged = 1;
-      opp->engaged = 1;
-      /* Each player starts a match with between 20 and 30 hitpoints */
-      p->hitpoints = rand() % 11 + 20;
-      opp->hitpoints = rand() % 11 + 20;
-      /* Each player starts a match with between 1 and 3 powermoves */
-      p->powermoves = rand() % 3 + 1;
-      opp->powermoves = rand() % 3 + 1;
-
-      char buf[BUFFER_SIZE] = {0}; 
-      snprintf(buf, 14 + strlen(p->name), "You engage %s!\n", p->name);
-      cwrite(opp->fd, buf, strlen(buf));
-      snprintf(buf, 14 + strlen(opp->name), "You engage %s!\n", opp->name);
-      cwrite(p->fd, buf, strlen(buf));
-
-      show_player_stats(opp, p);
-      int pactive = rand() % 2;
-      if (pactive){ //changes one player to active randomly.
-        p->active = 1;
-      } else {
-        opp->active = 1;
-        
-      }
-      show_menu(p);
-      show_menu(opp);
+int match_player(struct client *p){
+  struct client *opp;
+  int to;
+  if (p->closing) //about to be dropped, so not worth matching
+    return 0;
+  //searching for suitable opponent: everyone waiting is not currently matched
+  //(engaged), and only one of them can have battled player p most recently
+  //(last_opponent), so this looks at two players at most. Ids are compared,
+  //not pointers: the struct of a player who left goes to the next one to join.
+  for (opp = self->waiting.head; opp; opp = opp->wait_next) {
+    if (!p->last_opponent_id || !opp->last_opponent_id || p->last_opponent_id != opp->id)
       break;
+  }
+  if (opp == NULL) {
+    if ((to = claim_lobby()) >= 0) {
+      p->handoff = to;
+      add_pending(p);
+    } else {
+      wait_for_opponent(p);
     }
-    opp = opp->next;
+    return 0;
+  }
+  //There is a player available
+  stop_waiting(opp);
+  p->last_opponent = opp;
+  opp->last_opponent = p;
+  p->last_opponent_id = opp->id;
+  opp->last_opponent_id = p->id;
+  //Changes both players' 'engaged' variable to 1 to indicate they are currently in a match.
+  p->engaged = 1;
+  opp->engaged = 1;
+  /* Each player starts a match with between 20 and 30 hitpoints */
+  p->hitpoints = shard_rand() % 11 + 20;
+  opp->hitpoints = shard_rand() % 11 + 20;
+  /* Each player starts a match with between 1 and 3 powermoves */
+  p->powermoves = shard_rand() % 3 + 1;
+  opp->powermoves = shard_rand() % 3 + 1;
+
+  char buf[BUFFER_SIZE] = {0}; 
+  snprintf(buf, 14 + strlen(p->name), "You engage %s!\n", p->name);
+  cwrite(opp, buf, strlen(buf));
+  snprintf(buf, 14 + strlen(opp->name), "You engage %s!\n", opp->name);
+  cwrite(p, buf, strlen(buf));
+
+  show_player_stats(opp, p);
+  int pactive = shard_rand() % 2;
+  if (pactive){ //changes one player to active randomly.
+    p->active = 1;
+  } else {
+    opp->active = 1;
+    
   }
-  return 0;
+  show_menu(p);
+  show_menu(opp);
+  return 1;
 }
 
-/* Adds the client with the socket fd to the list of clients. */
-static void addclient(struct client **top, int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
+/* Adds the client with the socket fd to the list of clients, and returns it. */
+static struct client *addclient(struct client **top, int fd, struct in_addr addr) {
+    struct client *p = get_client();
     if (!p) {
-        perror("malloc");
+        perror("aligned_alloc");
         exit(1);
     }
 
     printf("Adding client %s\n", inet_ntoa(addr));
     p->fd = fd;
+    p->id = ++self->connections * nshards + self->id; //unique on every shard
     p->ipaddr = addr;
     p->name = NULL;
     p->inbuf = 0;
     p->last_move = 'n'; //Client still need to provide a name.
     p->last_opponent = NULL;
+    p->last_opponent_id = 0;
     p->engaged = 1; //Sets 'engaged' by default because until the client is named, they cannot be matched.
     p->active = 0;
-    p->next = NULL;
+    p->closing = 0;
+    p->pending = -1;
+    p->outhead = p->outtail = NULL;
+    p->outqueued = 0;
+    p->wait_next = p->wait_prev = NULL;
+    p->handoff = -1;
+    p->inflight = p->sending = 0;
+    p->retired = p->moving = 0;
+    p->sendnext = NULL;
+    linkclient(top, p);
+    return p;
+}
 
-    struct client **nav;
+/* Adds client p to the list and the table of the shard */
+static void linkclient(struct client **top, struct client *p) {
+    /* The list is in no particular order (the waiting queue keeps the order
+    in which players are matched), so the new client goes at the head. */
+    p->prev = NULL;
+    p->next = *top;
+    if (*top)
+        (*top)->prev = p;
+    *top = p;
+
+    if (p->fd >= self->maxclients) { //grow the table to hold fd
+        int n = self->maxclients ? self->maxclients : 64;
+        while (n <= p->fd)
+            n *= 2;
+        if ((self->clients = realloc(self->clients, n * sizeof(struct client *))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(self->clients + self->maxclients, 0, (n - self->maxclients) * sizeof(struct client *));
+        self->maxclients = n;
+    }
+    self->clients[p->fd] = p;
+}
 
-    /* Navigates through the linked list to get the address of the NULL node at the end 
-    of the list, and sets it to the new client node. Takes care of the case of an empty 
-    list (top is the address of the pointer to the head node).*/
-    for (nav = top; *nav; nav = &(*nav)->next);
-    *nav = p;
+/* Takes client p out of the list, the table and the waiting queue of the shard */
+static void unlinkclient(struct client **top, struct client *p) {
+    self->clients[p->fd] = NULL;
+    stop_waiting(p);
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        *top = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
 }
 
 
 /** 
- * Appends character w to the client's buffer. Returns a string
- * if a network newline is found (end of text message), or if the
- * buffer is at full capacity.
+ * Returns the line starting at offset *start of the client's buffer,
+ * terminated in place, and moves *start past it. A line ends at a
+ * network newline (end of text message), or when it fills the whole
+ * buffer. Returns NULL if the full line has not been read yet.
  **/
-char *readline(struct client *p, char w){
-    int where; // location of network newline
-    p->buf[p->inbuf] = w; // Receive message
-    p->inbuf++; //bytes currently in buffer, and index to position after data in buf
-    where = find_network_newline(p->buf, p->inbuf);
+char *readline(struct client *p, int *start){
+    char *line = p->buf + *start;
+    int where = find_network_newline(line, p->inbuf - *start); // location of network newline
     if (where >= 0){
-        p->buf[where] = '\0';
-        char * result = malloc(p->inbuf - 1); //number of data bytes currently in buffer, counting up to newline.
-        strncpy(result, p->buf, where + 1);  
-        memset(p->buf, 0, sizeof(p->buf) - 1);
-        p->inbuf = 0;
-        return result;
-    } else if ((sizeof(p->buf) - 1) == p->inbuf){ //in case of buffer overflow.
-        p->buf[p->inbuf] = '\0';
-        char * result = malloc(p->inbuf + 1);
-        strncpy(result, p->buf, p->inbuf + 1); 
-        p->inbuf = 0;
-        return result;
+        line[where] = '\0';
+        *start += where + 1;
+        return line;
+    } else if (*start == 0 && (sizeof(p->buf) - 1) == p->inbuf){ //in case of buffer overflow.
+        line[p->inbuf] = '\0';
+        *start = p->inbuf;
+        return line;
     }
     return NULL; //full line has not been read yet.
 }
@@ -259,37 +1236,37 @@ int find_network_newline(char *buf, int inbuf) {
  * as outlined in the handout. Decreases the opposing player's hitpoints, and resets and restores
  * the player's variables on the event of a losing or winning match.
  **/
-struct client *execute_strike(struct client *p, char move, struct client *top) {
+void execute_strike(struct client *p, char move) {
 
     char buf[BUFFER_SIZE] = {0}; 
     //print stats to buffer 
-    int damage = rand() % 5 + 2; //regular attack damage between 2-6.    
+    int damage = shard_rand() % 5 + 2; //regular attack damage between 2-6.    
     if (move == 'a'){ //REGULAR ATTACK
         
         snprintf(buf, 29 + strlen(p->last_opponent->name) + sizeof damage, "\nYou hit %s for %d damage!\n", p->last_opponent->name, damage);
-        cwrite(p->fd, buf, strlen(buf));
+        cwrite(p, buf, strlen(buf));
         snprintf(buf, 29 + strlen(p->name) + sizeof damage, "%s hits you for %d damage!\n", p->name, damage);
-        cwrite(p->last_opponent->fd, buf, strlen(buf));
+        cwrite(p->last_opponent, buf, strlen(buf));
         p->last_opponent->hitpoints -= damage;
 
     } else if (p->powermoves){ //POWERMOVE
 
-        if ((rand() % 2)){ //successful hit (50% chance)
+        if ((shard_rand() % 2)){ //successful hit (50% chance)
             damage *= 3; //three times the damage of a regular attack
             snprintf(buf, 29 + strlen(p->last_opponent->name) + sizeof damage, "\nYou hit %s for %d damage!\n", p->last_opponent->name, damage);
-            cwrite(p->fd, buf, strlen(buf));
+            cwrite(p, buf, strlen(buf));
             snprintf(buf, 35 + strlen(p->name) + sizeof damage, "%s powermoves you for %d damage!\n", p->name, damage);
-            cwrite(p->last_opponent->fd, buf, strlen(buf));
+            cwrite(p->last_opponent, buf, strlen(buf));
             p->last_opponent->hitpoints -= damage;
         } else { //target missed, change nothing
-            cwrite(p->fd, "\nYou missed!\n", 13);
+            cwrite(p, "\nYou missed!\n", 13);
             snprintf(buf, 14 + strlen(p->name), "%s missed you!\n", p->name);
-            cwrite(p->last_opponent->fd, buf, strlen(buf));
+            cwrite(p->last_opponent, buf, strlen(buf));
         }
         p->powermoves -= 1;
     } else {
         //no more powermoves, discard powermove command.
-        return top;
+        return;
     }
       
     if (p->last_opponent->hitpoints > 0){ //game is still on, hand turn over to opposing player.
@@ -301,10 +1278,10 @@ struct client *execute_strike(struct client *p, char move, struct client *top) {
     }
     else { /* Handles the case when the opposing player loses the match */
         snprintf(buf, 48 + strlen(p->last_opponent->name), "%s gives up. You win!\n\nAwaiting next opponent...\n", p->last_opponent->name);
-        cwrite(p->fd, buf, strlen(buf));
+        cwrite(p, buf, strlen(buf));
         
         snprintf(buf, 71 + strlen(p->name), "You are no match for %s. You scurry away...\n\nAwaiting next opponent...\n", p->name);
-        cwrite(p->last_opponent->fd, buf, strlen(buf));
+        cwrite(p->last_opponent, buf, strlen(buf));
         
         //clears player's match statuses
         p->engaged = 0;
@@ -312,116 +1289,112 @@ struct client *execute_strike(struct client *p, char move, struct client *top) {
         p->last_opponent->engaged = 0;
         p->last_opponent->active = 0;
 
-
-        struct client **nav;
-        struct client *t;
+        //match single clients with new players if possible, or they
+        //join the end of the waiting queue, current client first.
         struct client *opp = p->last_opponent;
-
-        /* MOVES both clients to the END of the client list */
-        //searching for one of p and opp clients and removing them.
-        for (nav = &top; *nav && ((*nav)->fd != p->fd) && ((*nav)->fd != opp->fd); nav = &(*nav)->next);
-        //change 
-        if (*nav){
-            t = (*nav)->next;
-            *nav = t;
-        } 
-        //searching for the other client and removing them
-        for (; *nav && ((*nav)->fd != p->fd) && ((*nav)->fd != opp->fd); nav = &(*nav)->next);
-
-        if (*nav){
-            t = (*nav)->next; 
-            *nav = t;
-        }
-        //get the address of the NULL client node at the end of the list 
-        for(; *nav; nav = &(*nav)->next);
-
-        //adds current client and their opponent to the end of the list            
-        *nav = p;
-        p->next = opp;
-        opp->next = NULL;
-
-        //match single clients with new players if possible.
-        match_player(top, p);
-        match_player(top, opp);
+        match_player(p);
+        match_player(opp);
     }
-    return top;
 
 }
 
 /** 
- * Handles any character printed by a client, including all commands,
- * written speech or the client name. Disregards any irrelevant text
- * (such as when the client is not in a match, or it is not their turn).
- * Returns 0 on success, or -1 on death of a client (client quits). 
+ * Handles a full line from a client: their name, or what they speak.
+ * The line lives in the client's buffer, so it is copied if kept.
  **/
-int handleclient(struct client *p, struct client **top) {
-    char move;
+static void handleline(struct client *p, char *line, struct client **top) {
     char outbuf[512];
-    int len = read(p->fd, &move, 1);
-    if (len > 0) {
-        //Client is still in the state of typing their name.
-        if (p->last_move == 'n'){ 
-            char * name = readline(p, move);
-            if (name) { //
-                p->name = name;
-                p->last_move = 0;
-                p->engaged = 0;
-                snprintf(outbuf, 9 + strlen(name) + 24, "Welcome, %s! Awaiting opponent...\n", name);
-                cwrite(p->fd, outbuf, strlen(outbuf));
-                snprintf(outbuf, 23 + strlen(name), "**%s enters the arena**\n", name);
-                broadcast(*top, p->fd, outbuf, strlen(outbuf));
-                match_player(*top, p);
-            }
-        //Client is speaking, so the character is interpreted as speech rather than an explicit command.
-        } else if (p->last_move == 's') { 
-            char * msg = readline(p, move);
-            if (msg) { //the message has ended, or the client buffer is full
-                p->last_move = 0;
-                snprintf(outbuf, 14 + strlen(msg), "You speak: %s\n\n", msg);
-                cwrite(p->fd, outbuf, strlen(outbuf));
-                snprintf(outbuf, 30 + strlen(p->name) + strlen(msg), "%s takes a break to tell you:\n%s\n\n", p->name, msg);
-                cwrite(p->last_opponent->fd, outbuf, strlen(outbuf));
-                free(msg);
-                //reiterate state of match for both players
-                show_player_stats(p, p->last_opponent);
-                show_menu(p);
-                show_menu(p->last_opponent);
-            }
+    //Client is still in the state of typing their name.
+    if (p->last_move == 'n'){ 
+        //most names fit in the client, and cost no allocation
+        if (strlen(line) < NAME_INLINE)
+            p->name = strcpy(p->shortname, line);
+        else if ((p->name = strdup(line)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        p->last_move = 0;
+        p->engaged = 0;
+        snprintf(outbuf, 9 + strlen(line) + 24, "Welcome, %s! Awaiting opponent...\n", line);
+        cwrite(p, outbuf, strlen(outbuf));
+        snprintf(outbuf, 23 + strlen(line), "**%s enters the arena**\n", line);
+        broadcast(p->id, outbuf, strlen(outbuf));
+        match_player(p);
+    //Client is speaking: the message has ended, or the client buffer is full
+    } else { 
+        p->last_move = 0;
+        snprintf(outbuf, 14 + strlen(line), "You speak: %s\n\n", line);
+        cwrite(p, outbuf, strlen(outbuf));
+        snprintf(outbuf, 30 + strlen(p->name) + strlen(line), "%s takes a break to tell you:\n%s\n\n", p->name, line);
+        cwrite(p->last_opponent, outbuf, strlen(outbuf));
+        //reiterate state of match for both players
+        show_player_stats(p, p->last_opponent);
+        show_menu(p);
+        show_menu(p->last_opponent);
+    }
+}
+
+/* Handles a character sent by a client as a command */
+static void handlemove(struct client *p, char move) {
+    if (!p->engaged | !p->active) //any text sent by the inactive player should be discarded
+        return;
+    if ((move == 'a') | (move == 'p')){
+         execute_strike(p, move);
+    } else if (move == 's'){
+        cwrite(p, "\nSpeak: ", 8);
+        p->last_move = 's';
+    } else {
+        //any invalid commands sent by the active player should be discarded.
+    }
+}
+
+/**
+ * Handles everything in the client's buffer: every command, written
+ * speech and the client name. A partial line is kept in the buffer until
+ * the rest arrives. The buffer always has room left afterwards.
+ **/
+static void process_input(struct client *p, struct client **top) {
+    char *line;
+    int start = 0;
+    while (start < p->inbuf) {
+        //the name or speech is a line, anything else is read as commands
+        if (p->last_move == 'n' || p->last_move == 's') {
+            if ((line = readline(p, &start)) == NULL)
+                break;
+            handleline(p, line, top);
         } else {
-            if (!p->engaged | !p->active) //any text sent by the inactive player should be discarded
-                return 0;
-            if ((move == 'a') | (move == 'p')){
-                 *top = execute_strike(p, move, *top);
-            } else if (move == 's'){
-                cwrite(p->fd, "\nSpeak: ", 8);
-                p->last_move = 's';
-            } else {
-                //any invalid commands sent by the active player should be discarded.
-            }
+            handlemove(p, p->buf[start++]);
         }
+    }
+    //keep the partial line, if any, at the start of the buffer
+    p->inbuf -= start;
+    memmove(p->buf, p->buf + start, p->inbuf);
+}
+
+/** 
+ * Reads whatever the client has sent, as far as it fits in the client's
+ * buffer, and handles all of it: every command, written speech and the
+ * client name. Disregards any irrelevant text (such as when the client
+ * is not in a match, or it is not their turn). A partial line is kept
+ * in the buffer until the rest arrives.
+ * Returns 0 on success, 1 if there is nothing more to read for now, or -1
+ * on death of a client (client quits). 
+ **/
+int handleclient(struct client *p, struct client **top) {
+    int room = sizeof(p->buf) - 1 - p->inbuf; //leave room to terminate a full line
+    int len = read(p->fd, p->buf + p->inbuf, room);
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    } else if (len == -1 && errno == EINTR) {
         return 0;
+    } else if (len > 0) {
+        p->inbuf += len;
+        process_input(p, top);
+        //a short read empties the socket, so there is no need to read again;
+        //an end of stream that came with it is left to the caller
+        return len < room ? 1 : 0;
     } else if (len == 0) { //Client has disconnected
-        // socket is closed
-        struct client *opp = p->last_opponent;
-        if (p->engaged & (p->last_move != 'n')) { //If player p was previously in a match with another player
-            snprintf(outbuf, 49 + strlen(p->name), "--%s dropped. You win!\n\nAwaiting next opponent...\n", p->name);
-            cwrite(opp->fd, outbuf, strlen(outbuf));
-            /* Clear all memory of the match for the opposing player */
-            opp->last_opponent = NULL; 
-            opp->active = 0;
-            opp->engaged = 0;
-            opp->last_move = 0;
-            opp->inbuf = 0;
-        } else if (opp) {
-            //get rid of any lingering references to the disconnected client
-            if (opp->last_opponent->fd == p->fd) 
-                opp->last_opponent = NULL; //this client does not exist anymore, and their fd may be reused.
-        }
-        if (p->last_move != 'n'){
-            snprintf(outbuf, 13 + strlen(p->name), "**%s leaves**\n", p->name);
-            broadcast(*top, p->fd, outbuf, strlen(outbuf));
-        }
-        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr)); //20
+        // socket is closed, the others are told when it is dropped
         return -1;
     } else { // shouldn't happen
         perror("read");
@@ -432,7 +1405,7 @@ int handleclient(struct client *p, struct client **top) {
  /* bind and listen, abort on error
   * returns FD of listening socket
   */
-int bindandlisten(void) {
+int bindandlisten(int shared) {
     struct sockaddr_in r;
     int listenfd;
     /* set up listening socket soc */
@@ -446,6 +1419,13 @@ int bindandlisten(void) {
     if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
         perror("setsockopt");
     }
+#ifdef SO_REUSEPORT
+    // Each shard listens on the port, and the kernel spreads connections across them
+    if (shared && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+#endif
     memset(&r, '\0', sizeof(r));
     r.sin_family = AF_INET; /*address family that is used for the socket you're creating 
                  *(in this case an Internet Protocol address).*/
@@ -464,10 +1444,13 @@ int bindandlisten(void) {
     //The argument n specifies the length of the queue for pending connections. 
     //When the queue fills, new clients attempting to connect fail with ECONNREFUSED 
     //until the server calls accept to accept a connection from the queue.
-    if (listen(listenfd, 5)) {
+    if (listen(listenfd, SOMAXCONN)) {
         perror("listen");
         exit(1);
     }
+    //accept is called until there is no connection left, so it must not block
+    if (set_nonblocking(listenfd) == -1)
+        exit(1);
     //returns listening socket
     return listenfd;
 }
@@ -475,22 +1458,20 @@ int bindandlisten(void) {
 /* Removes client from list, and matches any opponent left behind */ 
 static struct client *removeclient(struct client *top, struct client *p) {
 
-    struct client **nav;
-    for (nav = &top; *nav && (*nav)->fd != p->fd; nav = &(*nav)->next);
-    // Now, p points to (1) top, or (2) a pointer to another client
-    // This avoids a special case for removing the head of the list
-    if (*nav) {
-        struct client *t = (*nav)->next;
-        printf("Removing client %d %s\n", p->fd, inet_ntoa((*nav)->ipaddr)); 
+    if (p->fd < self->maxclients && self->clients[p->fd] == p) {
+        printf("Removing client %d %s\n", p->fd, inet_ntoa(p->ipaddr)); 
         int drop = (p->engaged & (p->last_move != 'n')) ? 1 : 0;
         struct client *opp = p->last_opponent;
-        if ((*nav)->name){ //just in case the client exited without a name
-            free((*nav)->name);
-        }
-        free(*nav);
-        *nav = t;
+        unlinkclient(&top, p);
+#ifdef USE_URING
+        if (p->inflight > 0) { //freed once the kernel is done with it
+            p->retired = 1;
+            shutdown(p->fd, SHUT_RDWR); //ends its receive and sends
+        } else
+#endif
+        freeclient(p);
         if (drop) {
-            match_player(top, opp); //try to match the lone client with someone new
+            match_player(opp); //try to match the lone client with someone new
         }
     } else {
         fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
@@ -499,22 +1480,300 @@ static struct client *removeclient(struct client *top, struct client *p) {
     return top;
 }
 
-/* Broadcasts a message 's' across all client fds */
-static void broadcast(struct client *top, int eventfd, char *s, int size) {
+/* Frees client p and everything it holds, and closes its socket */
+static void freeclient(struct client *p) {
+    if (p->name && p->name != p->shortname){ //just in case the client exited without a name
+        free(p->name);
+    }
+    while (p->outhead) { //output that was never sent
+        struct outchunk *c = p->outhead;
+        p->outhead = c->next;
+        put_chunk(c);
+    }
+    close(p->fd); //also takes it out of the epoll set
+    put_client(p);
+}
+
+/* Adds CLIENT_SLAB clients, on a cache line each, to the pool of shard s.
+ * Returns -1 if out of memory. */
+static int grow_clients(struct shard *s) {
+    struct client *slab = aligned_alloc(__alignof__(struct client), CLIENT_SLAB * sizeof(struct client));
+    int i;
+    if (slab == NULL)
+        return -1;
+    for (i = CLIENT_SLAB - 1; i >= 0; i--) { //handed out in address order
+        slab[i].next = s->freeclients;
+        s->freeclients = &slab[i];
+    }
+    return 0;
+}
+
+/* Takes a client from the pool of the shard, or NULL if out of memory */
+static struct client *get_client(void) {
     struct client *p;
-    for (p = top; p; p = p->next) {
-        if (p->fd == eventfd)
+    if (self->freeclients == NULL && grow_clients(self) == -1)
+        return NULL;
+    p = self->freeclients;
+    self->freeclients = p->next;
+    return p;
+}
+
+/* Puts client p back in the pool of the shard it was last on */
+static void put_client(struct client *p) {
+    p->next = self->freeclients;
+    self->freeclients = p;
+}
+
+/* Takes a chunk of output from the pool of the shard, or mallocs one */
+static struct outchunk *get_chunk(void) {
+    struct outchunk *c = self->freechunks;
+    if (c == NULL)
+        return malloc(sizeof(struct outchunk));
+    self->freechunks = c->next;
+    self->nfreechunks--;
+    return c;
+}
+
+/* Takes a chunk for a message from the pool of the shard, or mallocs one */
+static struct outchunk *get_ref(void) {
+    struct outchunk *c = self->freerefs;
+    if (c == NULL)
+        return malloc(offsetof(struct outchunk, data));
+    self->freerefs = c->next;
+    self->nfreerefs--;
+    return c;
+}
+
+/* Puts chunk c back in the pool of the shard, unless it is full */
+static void put_chunk(struct outchunk *c) {
+    if (c->msg) {
+        release_message(c->msg);
+        if (self->nfreerefs >= CHUNK_POOL) {
+            free(c);
+            return;
+        }
+        c->next = self->freerefs;
+        self->freerefs = c;
+        self->nfreerefs++;
+        return;
+    }
+    if (self->nfreechunks >= CHUNK_POOL) {
+        free(c);
+        return;
+    }
+    c->next = self->freechunks;
+    self->freechunks = c;
+    self->nfreechunks++;
+}
+
+/* Broadcasts a message 's' to every client but the connection with id
+ * sender, on every shard. The clients get it over the next passes of the
+ * event loop. */
+static void broadcast(unsigned long sender, char *s, int size) {
+    struct message *m = malloc(sizeof(struct message) + size);
+    struct fanout *f;
+    int i;
+    if (m == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    m->refs = nshards; //one for each shard, until its clients have it
+    m->size = size;
+    memcpy(m->data, s, size);
+    for (i = 0; i < nshards; i++) {
+        if ((f = malloc(sizeof(struct fanout))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        f->msg = m;
+        f->skip = sender;
+        f->next_fd = 0;
+        if (i == self->id) {
+            queue_fanout(f);
             continue;
-        cwrite(p->fd, s, size);
+        }
+        pthread_mutex_lock(&shards[i].lock);
+        f->next = shards[i].inbox_fanout;
+        shards[i].inbox_fanout = f;
+        pthread_mutex_unlock(&shards[i].lock);
+        wake_shard(&shards[i]);
     }
 }
 
-/* Write to client: wrapper function for the write call. Checks for errors on write. */
-int cwrite (int clientfd, char *buf, int nbytes){
-    if (write(clientfd, buf, nbytes) == -1) {
-        //An error occurred while writing, problem with reading end of the client socket
-        perror("write");
+/* Adds broadcast f to those being queued for the clients of the shard,
+ * and queues it right away if the budget of the pass allows */
+static void queue_fanout(struct fanout *f) {
+    f->next = NULL;
+    if (self->fanout_tail)
+        self->fanout_tail->next = f;
+    else
+        self->fanout = f;
+    self->fanout_tail = f;
+    run_fanout();
+}
+
+/**
+ * Queues the broadcasts of the shard for its clients, in fd order, for as
+ * many clients as the budget of the pass allows; the rest waits for the
+ * next pass. Each broadcast reaches every client before the next one
+ * starts, so clients get them in order. Clients already far behind on
+ * their output miss them. Only the last broadcast queued has the clients
+ * flushed, so a burst of them goes out in one write per client rather
+ * than one each.
+ **/
+static void run_fanout(void) {
+    struct fanout *f;
+    struct client *p;
+
+    while ((f = self->fanout) != NULL) {
+        for (; f->next_fd < self->maxclients && self->fanout_budget > 0; f->next_fd++) {
+            p = self->clients[f->next_fd];
+            if (p == NULL || p->closing)
+                continue;
+            if (p->id != f->skip && p->outqueued <= OUT_SOFT_MARK) {
+                attach_message(p, f->msg);
+                self->fanout_budget--;
+            }
+            if (f->next == NULL && p->outhead)
+                add_pending(p);
+        }
+        if (f->next_fd < self->maxclients)
+            return;
+        self->fanout = f->next;
+        if (self->fanout == NULL)
+            self->fanout_tail = NULL;
+        release_message(f->msg);
+        free(f);
+    }
+}
+
+/* Queues message m for client p, without copying it unless it is short.
+ * The caller has it sent. */
+static void attach_message(struct client *p, struct message *m) {
+    struct outchunk *c;
+    if (m->size < OUT_SHARE_MIN) {
+        queue_output(p, m->data, m->size);
+        return;
+    }
+    if ((c = get_ref()) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    c->msg = m;
+    c->next = NULL;
+    c->start = 0;
+    c->end = m->size;
+    c->sending = 0;
+    if (p->outtail)
+        p->outtail->next = c;
+    else
+        p->outhead = c;
+    p->outtail = c;
+    p->outqueued += m->size;
+}
+
+/* Drops a reference to message m, and frees it with the last one */
+static void release_message(struct message *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(m);
+}
+
+/* Returns the bytes chunk c holds or points to */
+static char *chunk_data(struct outchunk *c) {
+    return c->msg ? c->msg->data : c->data;
+}
+
+/* Write to client: queues the message on the client, to be sent at the end
+ * of the pass. A client that lets its queue grow past OUT_HIGH_WATER is
+ * closed. Returns -1 if the client is closed. */
+int cwrite (struct client *p, char *buf, int nbytes){
+    if (queue_output(p, buf, nbytes) == -1)
+        return -1;
+    add_pending(p);
+    return 0;
+}
+
+/* Queues a message on the client, like cwrite, but leaves it to the caller
+ * to have it sent */
+static int queue_output(struct client *p, char *buf, int nbytes) {
+    struct outchunk *c = p->outtail;
+    int n;
+    if (p->closing)
         return -1;
+    if (p->outqueued + nbytes > OUT_HIGH_WATER) {
+        fprintf(stderr, "%s is not reading its output, dropping client %d\n", inet_ntoa(p->ipaddr), p->fd);
+        closeclient(p);
+        return -1;
+    }
+    while (nbytes > 0) {
+        //a chunk being sent by io_uring must not change, and messages
+        //are shared
+        if (c == NULL || c->end == OUT_CHUNK || c->sending || c->msg) {
+            if ((c = get_chunk()) == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            c->next = NULL;
+            c->start = c->end = 0;
+            c->sending = 0;
+            c->msg = NULL;
+            if (p->outtail)
+                p->outtail->next = c;
+            else
+                p->outhead = c;
+            p->outtail = c;
+        }
+        n = nbytes < OUT_CHUNK - c->end ? nbytes : OUT_CHUNK - c->end;
+        memcpy(c->data + c->end, buf, n);
+        c->end += n;
+        buf += n;
+        nbytes -= n;
+        p->outqueued += n;
+    }
+    return 0;
+}
+
+/**
+ * Sends the client's queued output with writev until it is all sent or
+ * the socket is full. Returns -1 if the client cannot be written to.
+ **/
+static int flushclient(struct client *p) {
+    struct iovec iov[OUT_IOV];
+    struct outchunk *c;
+    ssize_t sent;
+    int n, done;
+#ifdef USE_URING
+    if (self->ring)
+        return uring_flush(self->ring, p);
+#endif
+    while (p->outhead) {
+        for (c = p->outhead, n = 0; c && n < OUT_IOV; c = c->next, n++) {
+            iov[n].iov_base = chunk_data(c) + c->start;
+            iov[n].iov_len = c->end - c->start;
+        }
+        if ((sent = writev(p->fd, iov, n)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0; //the rest goes once the socket is writable
+            if (errno == EINTR)
+                continue;
+            //An error occurred while writing, problem with reading end of the client socket
+            perror("writev");
+            return -1;
+        }
+        p->outqueued -= sent;
+        while (sent > 0) { //free what was sent
+            c = p->outhead;
+            done = sent < c->end - c->start ? sent : c->end - c->start;
+            c->start += done;
+            sent -= done;
+            if (c->start == c->end) {
+                p->outhead = c->next;
+                put_chunk(c);
+            }
+        }
+        if (p->outhead == NULL)
+            p->outtail = NULL;
     }
     return 0;
 }
@@ -5,49 +5,247 @@
     #define PORT 30100
 #endif
 
+/* Most worker threads (shards) the server runs */
+#define MAX_SHARDS 64
+
 /* Maximum buffer size */
 #define BUFFER_SIZE 512
 
+/* Output queued for a client is kept in chunks of OUT_CHUNK bytes, and
+ * sent with up to OUT_IOV chunks per writev. Clients with more than
+ * OUT_SOFT_MARK bytes queued miss broadcasts, and clients with more than
+ * OUT_HIGH_WATER bytes queued are dropped. */
+#define OUT_CHUNK 1024
+#define OUT_IOV 64
+#define OUT_SOFT_MARK (16 * 1024)
+#define OUT_HIGH_WATER (256 * 1024)
+
+/* Clients are allocated CLIENT_SLAB at a time and never given back, and
+ * each shard keeps up to CHUNK_POOL chunks of output for reuse. Names up
+ * to NAME_INLINE bytes, with the terminator, are kept in the client. */
+#define CLIENT_SLAB 256
+#define CHUNK_POOL 1024
+#define NAME_INLINE 32
+
+/* Most clients broadcasts are queued for in a pass of the event loop.
+ * Broadcasts shorter than OUT_SHARE_MIN bytes are copied into the
+ * client's output, which costs less than a chunk of their own. The enter
+ * and leave notices are that short unless the name is long, so only the
+ * notices of long names are shared. Building with OUT_SHARE_MIN defined
+ * as 0 shares them all, for "make bench" to compare. */
+#define FANOUT_BATCH 512
+#ifndef OUT_SHARE_MIN
+#define OUT_SHARE_MIN 256
+#endif
+
+/* A broadcast, built once and shared by the output queues of every client
+ * it goes to, on any shard. Freed when the last reference goes. */
+struct message {
+    int refs;
+    int size;
+    char data[];
+};
+
+/* A chunk of output waiting to be sent. A chunk that points to a message
+ * is allocated without the data array. */
+struct outchunk {
+    struct outchunk *next;
+    int start;            // bytes of data already sent
+    int end;              // bytes of data queued
+    int sending;          // 1 while io_uring is sending it, and it must not change
+    struct message *msg;  // message the chunk sends, or NULL to send data
+    char data[OUT_CHUNK];
+};
+
+/* A connected player. The fields looked at on every event and broadcast
+ * come first, to share one cache line. */
 struct client {
-    char *name; 
     int fd; //file descriptor
-    
-    char buf[300];       // buffer to hold data being read from client
     int inbuf;            // how many bytes currently in buf?
-
-    char last_move;
-    struct in_addr ipaddr; //internet address
-    struct client *next; //link/pointer to next client
-    struct client *last_opponent; //latest opponent
     int engaged; //1 for currently engaged in match with other player
     int active;
     int hitpoints;
     int powermoves;
+    char last_move;
+    int closing;          // 1 once the client is to be dropped
+    int outqueued;        // bytes of output not sent yet
+    int pending;          // index in the clients to flush, or -1
+    char *name; 
+    struct client *next; //link/pointer to next client, or in the pool of free clients
+
+    char buf[300];       // buffer to hold data being read from client
+
+    struct client *prev; //link/pointer to previous client
+    struct client *last_opponent; //latest opponent
+    unsigned long id;     // tells connections apart, as their structs are reused
+    unsigned long last_opponent_id; // id of the latest opponent, or 0
+    struct in_addr ipaddr; //internet address
+    int handoff;          // shard to hand the client to, or -1
+    struct outchunk *outhead; //output not sent yet, oldest first
+    struct outchunk *outtail;
+
+    struct client *wait_next; //links in the waiting queue, while waiting
+    struct client *wait_prev;
+    char shortname[NAME_INLINE]; // the name, unless it is longer
+
+    //io_uring only
+    int inflight;         // requests the kernel has for the client
+    int sending;          // sends in flight, one per chunk from outhead
+    struct outchunk *sendnext; // chunk of the next send to complete
+    int retired;          // 1 once removed, freed when inflight drops to 0
+    int moving;           // 1 once handed off, sent on when inflight drops to 0
+} __attribute__((aligned(64)));
+
+/* Queue of players waiting for an opponent, linked through the clients */
+struct waitqueue {
+    struct client *head;  // waiting longest, matched first
+    struct client *tail;
+};
+
+/* A broadcast on its way to the clients of a shard */
+struct fanout {
+    struct fanout *next;
+    struct message *msg;  // holds a reference
+    unsigned long skip;   // id of the connection not to send it to
+    int next_fd;          // clients up to this fd have it queued
+};
+
+/* A worker thread with its own listening socket, event loop and clients.
+ * Other shards only use its inbox, under lock. */
+struct shard {
+    int id;
+    int listenfd;
+    int epfd;                 // epoll set of the shard, or -1 with select
+    struct uring *ring;       // io_uring of the shard, or NULL without it
+    struct client *head;      // clients of the shard, in no particular order
+    struct client **clients;  // clients by socket fd
+    int maxclients;           // size of clients
+    struct waitqueue waiting; // players waiting for an opponent
+    struct client **pending;  // clients to flush, drop or hand off at the end of the pass
+    int npending, maxpending;
+    unsigned int seed;        // state of the shard's random numbers
+    unsigned long connections; // clients added by the shard, for their ids
+    struct client *freeclients; // pool of free clients
+    struct outchunk *freechunks; // pool of free chunks of output
+    int nfreechunks;
+    struct outchunk *freerefs;   // pool of free chunks for messages
+    int nfreerefs;
+    struct fanout *fanout;    // broadcasts being queued for the clients, oldest first
+    struct fanout *fanout_tail;
+    int fanout_budget;        // clients they can still be queued for in this pass
+    pthread_t thread;
+
+    pthread_mutex_t lock;     // guards the inbox: arrivals and inbox_fanout
+    struct client *arrivals;  // clients handed to this shard
+    struct fanout *inbox_fanout; // broadcasts from other shards, newest first
+    int wakefd[2];            // pipe written to when something is put in the inbox
 };
 
 /* Add client to list of fds to listen for */
-static void addclient(struct client **top, int fd, struct in_addr addr);
+static struct client *addclient(struct client **top, int fd, struct in_addr addr);
 
 /* Remove client from list of clients */
 static struct client *removeclient(struct client *top, struct client *p);
 
-/* Broadcast a message to all connected clients */
-static void broadcast(struct client *top, int eventfd, char *s, int size);
+/* Broadcast a message to all connected clients, a batch at a time */
+static void broadcast(unsigned long sender, char *s, int size);
+static void queue_fanout(struct fanout *f);
+static void run_fanout(void);
+static void attach_message(struct client *p, struct message *m);
+static void release_message(struct message *m);
+static char *chunk_data(struct outchunk *c);
+
+/* Add a client to, or take it out of, the list and table of its shard */
+static void linkclient(struct client **top, struct client *p);
+static void unlinkclient(struct client **top, struct client *p);
+
+/* Hand a client to another shard, and take in those handed to this one */
+static void handoff(struct client **top, struct client *p);
+static void send_to_shard(struct client *p);
+static void read_inbox(struct client **top);
+
+/* Watch a client's socket with the shard's epoll set or io_uring, if any */
+static int watch_client(struct client *p);
+
+/* Queue of clients to flush or drop at the end of each pass of the event loop */
+static void add_pending(struct client *p);
+static void closeclient(struct client *p);
+static void flush_pending(struct client **top);
+
+/* Tell the others a client quit, remove it and close its socket */
+static void dropclient(struct client **top, struct client *p);
+static void freeclient(struct client *p);
+
+/* Pools of clients and chunks of output, per shard */
+static int grow_clients(struct shard *s);
+static struct client *get_client(void);
+static void put_client(struct client *p);
+static struct outchunk *get_chunk(void);
+static struct outchunk *get_ref(void);
+static void put_chunk(struct outchunk *c);
 
-/* Handle commands or written lines from the client */
+/* Send as much of a client's queued output as the socket takes */
+static int flushclient(struct client *p);
+
+/* Event loops: wait for new connections and client input, forever */
+#ifdef USE_URING
+static void uring_loop(int listenfd, struct client **top);
+#endif
+#ifdef USE_EPOLL
+static void epoll_loop(int listenfd, struct client **top);
+#endif
+static void select_loop(int listenfd, struct client **top);
+
+/* Add a new connection as a client and ask for its name */
+static struct client *new_client(struct client **top, int clientfd, struct in_addr addr);
+
+/* io_uring requests and their completions */
+#ifdef USE_URING
+static struct uring *uring_init(void);
+static struct io_uring_sqe *uring_sqe(struct uring *r);
+static void uring_reserve(struct uring *r, unsigned n);
+static int uring_enter(struct uring *r, int wait);
+static void uring_accept(struct uring *r, int listenfd);
+static void uring_recv(struct uring *r, struct client *p);
+static void uring_provide(struct uring *r, int bid);
+static void uring_wake(struct uring *r, int fd);
+static void uring_cancel(struct uring *r, struct client *p);
+static int uring_flush(struct uring *r, struct client *p);
+static void uring_accepted(struct uring *r, struct io_uring_cqe *cqe, struct client **top);
+static void uring_received(struct uring *r, struct client *p, struct io_uring_cqe *cqe, struct client **top);
+static void uring_sent(struct client *p, int res);
+static void uring_settle(struct client *p);
+static void take_input(struct client *p, char *data, int n, struct client **top);
+#endif
+
+/* Read from the client and handle its commands and written lines */
 int handleclient(struct client *p, struct client **top);
+static void process_input(struct client *p, struct client **top);
+
+/* Handle a full line (name or speech) from the client */
+static void handleline(struct client *p, char *line, struct client **top);
+
+/* Handle a character sent as a command */
+static void handlemove(struct client *p, char move);
 
-/* Update client buffer with new character, return full message when available */
-char * readline(struct client *p, char w);
+/* Return the next full message in the client buffer, terminated in place, when available */
+char * readline(struct client *p, int *start);
 
 /* Search buffer for presence of a network newline */
 int find_network_newline(char *buf, int inbuf);
 
-/* Match player with available LIFO client */
-int match_player(struct client *top, struct client *p);
+/* Match player with the client waiting longest, or make them wait */
+int match_player(struct client *p);
+
+/* Add a player to, or take them out of, the queue of those waiting for an opponent */
+static void wait_for_opponent(struct client *p);
+static void stop_waiting(struct client *p);
+
+/* Make a socket non-blocking */
+static int set_nonblocking(int fd);
 
-/* Returns FD of listening socket */
-int bindandlisten(void);
+/* Returns FD of listening socket, shared with other shards if shared is 1 */
+int bindandlisten(int shared);
 
 /* Prints game statistics of each player match, hiding the other's powermoves */
 void show_player_stats(struct client *p1, struct client *p2);
@@ -56,9 +254,10 @@ void show_player_stats(struct client *p1, struct client *p2);
 void show_menu(struct client *p);
 
 /* Based on player's move, updates points and handles winning/losing end of the match */
-struct client *execute_strike(struct client *p, char move, struct client *top);
+void execute_strike(struct client *p, char move);
 
-/* Wrapper function for write system call used for error checking */
-int cwrite(int clientfd, char *buf, int nbytes);
+/* Queue a message for a client, to be sent at the end of the pass */
+int cwrite(struct client *p, char *buf, int nbytes);
+static int queue_output(struct client *p, char *buf, int nbytes);
 
 #endif
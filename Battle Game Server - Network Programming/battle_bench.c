@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef PORT
+    #define PORT 30100
+#endif
+
+/* Load generator for the battle server.
+ *
+ *   battle_bench [-c PLAYERS] [-d SECONDS] [-r RATE] [-s SPEAK%] [-S SEED]
+ *                [-P SERVER_PID] [-p PORT]
+ *
+ * "make bench" builds it with optimization, starts the server and runs it
+ * against the server with the default settings.
+ *
+ * It connects PLAYERS simulated players (2000 by default) over loopback,
+ * at most CONNECT_BATCH at a time, and has them give their names. Then, for
+ * SECONDS (10 by default), every player whose turn it is waits 1/RATE
+ * seconds (not at all if RATE is 0, the default) and makes a move: it
+ * speaks a line SPEAK% of the time (10 by default), and otherwise uses a
+ * powermove a quarter of the time it has any left, and attacks. The moves
+ * are drawn from a random number generator seeded with SEED, so a run
+ * makes the same choices each time.
+ *
+ * It reports:
+ * - connection setup: the time from connect to the server asking for the
+ *   name, per player, and for all of them.
+ * - turn round trip: the time from sending a move to its answer from the
+ *   server (the hit or miss, the speak prompt, or the echo of the speech).
+ * - moves and finished matches per second.
+ * - the CPU time the server used in each phase, if its pid is given with
+ *   -P, from /proc.
+ */
+
+#define CONNECT_BATCH 256
+#define MAX_EVENTS 256
+#define IN_BUF 4096
+
+/* What a player is doing */
+#define CONNECTING 0  // waiting for connect and the name prompt
+#define NAMED 1       // named, waiting for a match or its turn
+#define THINKING 2    // its turn, waiting to move
+#define ANSWER 3      // waiting for the answer to its move
+
+struct player {
+    int fd;
+    int state;
+    int can_power;     // 1 if the last menu offered a powermove
+    int speaking;      // 1 after asking to speak, until the speech is echoed
+    double sent;       // when the move waiting for an answer was sent
+    int inlen;
+    char in[IN_BUF];   // input not looked at yet
+};
+
+/* Latencies of one kind, in microseconds */
+struct samples {
+    float *v;
+    size_t n, max;
+};
+
+static struct player *players;
+static int nplayers = 2000, speak_pct = 10;
+static double rate = 0, duration = 10;
+static int port = PORT, epfd;
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static struct samples setup, turns;
+static int named;
+static long moves, matches;
+static long long bytes_in;
+
+/* Players whose turn it is, in the order their moves are due. All wait
+ * the same time, so a FIFO is in due order. */
+static int *thinking;
+static double *due;
+static int think_head, think_len;
+
+/* xorshift64*, so runs with a seed make the same moves on every machine */
+static unsigned long long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_sample(struct samples *s, double seconds) {
+    if (s->n == s->max) {
+        s->max = s->max ? s->max * 2 : 1024;
+        if ((s->v = realloc(s->v, s->max * sizeof(float))) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = seconds * 1e6;
+}
+
+static int by_value(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, struct samples *s) {
+    if (s->n == 0) {
+        printf("%-16s %10s\n", what, "none");
+        return;
+    }
+    qsort(s->v, s->n, sizeof(float), by_value);
+    printf("%-16s %10zu %9.0f %9.0f %9.0f %9.0f\n", what, s->n, s->v[s->n / 2],
+           s->v[s->n * 99 / 100], s->v[s->n * 999 / 1000], s->v[s->n - 1]);
+}
+
+/* Returns the CPU time, user and system, process pid has used, or -1 */
+static double cpu_time(int pid) {
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+    int n;
+
+    if (pid <= 0)
+        return -1;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n > 0 ? n : 0] = '\0';
+    //the command name can hold spaces, so count fields from its end
+    if ((p = strrchr(buf, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void send_all(struct player *p, const char *s, int n) {
+    int sent;
+    //the messages are tiny, so the socket buffer always has room
+    while (n > 0) {
+        if ((sent = write(p->fd, s, n)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
+        }
+        s += sent;
+        n -= sent;
+    }
+}
+
+/* Starts connecting player i. Returns -1 on error. */
+static int start_connect(int i) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    struct player *p = &players[i];
+    int one = 1;
+
+    if ((p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    p->state = CONNECTING;
+    p->sent = now();
+    if (connect(p->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        return -1;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u32 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/* Makes the move of player i, whose turn it is */
+static void move(int i) {
+    struct player *p = &players[i];
+    int r = rng() % 100;
+    char c = 'a';
+
+    if (r < speak_pct) {
+        c = 's';
+        p->speaking = 1;
+    } else if (p->can_power && r % 4 == 0) {
+        c = 'p';
+    }
+    p->state = ANSWER;
+    p->sent = now();
+    send_all(p, &c, 1);
+    moves++;
+}
+
+static void turn(int i) {
+    if (rate > 0) {
+        players[i].state = THINKING;
+        thinking[(think_head + think_len) % nplayers] = i;
+        due[(think_head + think_len) % nplayers] = now() + 1 / rate;
+        think_len++;
+    } else {
+        move(i);
+    }
+}
+
+/* Looks for what the server tells the player at the start of its input,
+ * and returns its length. Returns 0 if there is nothing it knows there,
+ * and -1 if the input may be the start of something it knows. */
+static int handle_token(int i, char *s, int len) {
+    static const char *tokens[] = {
+        "What is your name? ", "(p)owermove\n", "(a)ttack\n", "(s)peak something\n",
+        "You hit ", "You missed!", "Speak: ", "You speak: ", "You win!",
+    };
+    struct player *p = &players[i];
+    char name[32];
+    int t, n, partial = 0;
+
+    if (memchr("W(YS", s[0], 4) == NULL) //no token starts with it, as is most of the input
+        return 0;
+    for (t = 0; t < sizeof(tokens) / sizeof(tokens[0]); t++) {
+        n = strlen(tokens[t]);
+        if (len >= n && memcmp(s, tokens[t], n) == 0)
+            break;
+        partial |= len < n && memcmp(s, tokens[t], len) == 0;
+    }
+    if (t == sizeof(tokens) / sizeof(tokens[0]))
+        return partial ? -1 : 0;
+    switch (t) {
+    case 0:
+        add_sample(&setup, now() - p->sent);
+        p->state = NAMED;
+        named++;
+        n = snprintf(name, sizeof(name), "bot%d\n", i);
+        send_all(p, name, n);
+        break;
+    case 1:
+        p->can_power = 1;
+        break;
+    case 2:
+        p->can_power = 0;
+        break;
+    case 3:
+        turn(i);
+        break;
+    case 4:
+    case 5:
+        if (p->state == ANSWER)
+            add_sample(&turns, now() - p->sent);
+        p->state = NAMED;
+        break;
+    case 6:
+        if (p->state == ANSWER && p->speaking) {
+            add_sample(&turns, now() - p->sent);
+            p->sent = now();
+            n = snprintf(name, sizeof(name), "hello from bot%d\n", i);
+            send_all(p, name, n);
+            moves++;
+        }
+        break;
+    case 7:
+        if (p->state == ANSWER && p->speaking)
+            add_sample(&turns, now() - p->sent);
+        p->speaking = 0;
+        p->state = NAMED;
+        break;
+    case 8:
+        matches++;
+        break;
+    }
+    return strlen(tokens[t]);
+}
+
+/* Reads what the server sent player i and acts on it. Returns -1 if the
+ * server closed the connection. */
+static int handle_input(int i) {
+    struct player *p = &players[i];
+    int n, start, used;
+
+    while ((n = read(p->fd, p->in + p->inlen, IN_BUF - p->inlen)) > 0) {
+        bytes_in += n;
+        p->inlen += n;
+        for (start = 0; start < p->inlen; start += used ? used : 1) {
+            if ((used = handle_token(i, p->in + start, p->inlen - start)) == -1)
+                break; //keep what may be the start of a token
+        }
+        p->inlen -= start;
+        memmove(p->in, p->in + start, p->inlen);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        return -1;
+    return 0;
+}
+
+/* Waits for and handles what the server sends, until the next move is due
+ * or the time is up */
+static void pass(double until) {
+    struct epoll_event events[MAX_EVENTS];
+    double t = now(), wait = until - t;
+    int n, i;
+
+    while (think_len > 0 && due[think_head] <= t) {
+        move(thinking[think_head]);
+        think_head = (think_head + 1) % nplayers;
+        think_len--;
+    }
+    if (think_len > 0 && due[think_head] - t < wait)
+        wait = due[think_head] - t;
+    n = epoll_wait(epfd, events, MAX_EVENTS, wait > 0 ? (int)(wait * 1000) + 1 : 0);
+    for (i = 0; i < n; i++) {
+        if (handle_input(events[i].data.u32) == -1) {
+            fprintf(stderr, "player %u: the server closed the connection\n", events[i].data.u32);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    struct rlimit rl;
+    double t0, t_setup, t_run, cpu0, cpu1, cpu2;
+    long long bytes0;
+    long moves0, matches0;
+    int opt, pid = 0, started;
+
+    while ((opt = getopt(argc, argv, "c:d:r:s:S:P:p:")) != -1) {
+        switch (opt) {
+        case 'c': nplayers = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 's': speak_pct = atoi(optarg); break;
+        case 'S': rng_state = strtoull(optarg, NULL, 10) | 1; break;
+        case 'P': pid = atoi(optarg); break;
+        case 'p': port = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c PLAYERS] [-d SECONDS] [-r RATE] [-s SPEAK%%] [-S SEED]"
+                            " [-P SERVER_PID] [-p PORT]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nplayers < 2) {
+        fprintf(stderr, "need at least 2 players\n");
+        return 1;
+    }
+    //a socket per player
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    players = calloc(nplayers, sizeof(struct player));
+    thinking = malloc(nplayers * sizeof(int));
+    due = malloc(nplayers * sizeof(double));
+    if (players == NULL || thinking == NULL || due == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    //connect everyone, CONNECT_BATCH at a time
+    t0 = now();
+    cpu0 = cpu_time(pid);
+    started = 0;
+    while (named < nplayers) {
+        while (started < nplayers && started - named < CONNECT_BATCH) {
+            if (start_connect(started++) == -1)
+                return 1;
+        }
+        pass(now() + 0.1);
+    }
+    t_setup = now() - t0;
+
+    //play
+    moves0 = moves;
+    matches0 = matches;
+    bytes0 = bytes_in;
+    cpu1 = cpu_time(pid);
+    t0 = now();
+    while ((t_run = now() - t0) < duration)
+        pass(t0 + duration);
+    cpu2 = cpu_time(pid);
+
+    printf("%d players, %.1f s, rate %g moves/s per turn (0: at once), %d%% speech, port %d\n",
+           nplayers, duration, rate, speak_pct, port);
+    printf("%-16s %10s %9s %9s %9s %9s\n", "latency", "samples", "p50us", "p99us", "p99.9us", "max us");
+    report("connect", &setup);
+    report("turn round trip", &turns);
+    printf("connection setup: %.3f s for all, %.0f connections/s\n", t_setup, nplayers / t_setup);
+    printf("moves: %.0f/s, matches finished: %.1f/s, server output: %.2f MiB/s\n",
+           (moves - moves0) / t_run, (matches - matches0) / t_run, (bytes_in - bytes0) / t_run / 1048576.0);
+    if (cpu0 >= 0 && cpu2 >= 0)
+        printf("server CPU time: %.2f s setting up, %.2f s playing (%.0f%% of a core)\n",
+               cpu1 - cpu0, cpu2 - cpu1, 100 * (cpu2 - cpu1) / t_run);
+    else
+        printf("server CPU time: unknown, give the server pid with -P\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "smalloc.h"
+
+
+#define SIZE (16 * 1024 * 1024)
+#define COUNT 100000
+
+/* Test for arena_mark, arena_alloc and arena_release.
+ * Test covers the following scenarios, for the list and tagged layouts:
+ * - arena objects are 16-byte aligned and laid out one after another.
+ * - arena_release frees everything since the mark, so the next objects
+ *   take the same addresses again; nested marks release only their part.
+ * - a request larger than a chunk, and spare chunks that are too small.
+ * - releasing many objects at once against freeing them one by one.
+ * - the chunks are ordinary blocks, and mem_clean takes care of them.
+ */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_block(void *addr, size_t size, void *arg) {
+    (*(long *)arg)++;
+}
+
+static long count(int which) {
+    long blocks = 0;
+    mem_walk(which, count_block, &blocks);
+    return blocks;
+}
+
+static void run(const char *name, int flags) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, flags };
+    struct arena_pos start, inner;
+    static char *ptrs[COUNT];
+    char *a, *b, *c, *big;
+    double t, arena_time, sfree_time;
+    long chunks;
+    int i, ok;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    start = arena_mark();
+    a = arena_alloc(10);
+    b = arena_alloc(20);
+    c = arena_alloc(1);
+    printf("%s: arena_alloc(10), (20), (1). Expected: %p %p %p. Result: %p %p %p\n",
+           name, a, a + 16, a + 48, a, b, c);
+    printf("%s: 16-byte aligned. Expected: yes. Result: %s\n",
+           name, (uintptr_t)a % 16 == 0 ? "yes" : "no");
+    printf("%s: arena_alloc(0). Expected: NULL. Result: %p\n", name, arena_alloc(0));
+
+    inner = arena_mark();
+    arena_alloc(100);
+    arena_release(inner);
+    printf("%s: after releasing the inner mark. Expected: %p. Result: %p\n",
+           name, c + 16, arena_alloc(16));
+    arena_release(start);
+    printf("%s: after releasing the outer mark. Expected: %p. Result: %p\n",
+           name, a, arena_alloc(10));
+    chunks = count(SM_WALK_ALLOCATED);
+    printf("%s: Expected chunks: 1. Result: %ld\n", name, chunks);
+
+    //a request bigger than a chunk gets a chunk of its own
+    big = arena_alloc(200000);
+    printf("%s: arena_alloc(200000). Expected: not NULL, chunks: 2. Result: %s, chunks: %ld\n",
+           name, big != NULL ? "not NULL" : "NULL", count(SM_WALK_ALLOCATED));
+    memset(big, 1, 200000);
+    arena_release(start);
+    //the 200000 byte chunk is a spare now, and 300000 bytes do not fit
+    arena_alloc(60000);
+    big = arena_alloc(300000);
+    printf("%s: arena_alloc(300000) past a small spare. Expected chunks: 3. Result: %ld\n",
+           name, count(SM_WALK_ALLOCATED));
+    memset(big, 1, 300000);
+    arena_release(start);
+
+    //many small objects: one release against an sfree each
+    t = now();
+    for (i = 0; i < COUNT; i++)
+        ptrs[i] = arena_alloc(48);
+    arena_release(start);
+    arena_time = now() - t;
+    t = now();
+    for (i = 0; i < COUNT; i++)
+        ptrs[i] = smalloc(48);
+    for (i = 0; i < COUNT; i++)
+        sfree(ptrs[i]);
+    sfree_time = now() - t;
+    printf("%s: %d objects: arena %.4fs, smalloc/sfree %.4fs\n", name, COUNT, arena_time, sfree_time);
+
+    ok = 1;
+    for (i = 0; i < COUNT; i++) {
+        ptrs[i] = arena_alloc(48);
+        ok &= ptrs[i] != NULL;
+    }
+    printf("%s: %d more objects in the kept chunks. Expected: yes. Result: %s\n",
+           name, COUNT, ok ? "yes" : "no");
+    mem_clean();
+}
+
+int main(void) {
+    run("list", 0);
+    run("tagged", SM_TAGGED);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+
+
+#define SIZE 4096
+
+/* Test for the SM_SEGREGATED_FIT placement policy.
+ * Test covers the following scenarios:
+ * - small allocation served from the head of its size class instead of the
+ *   lowest-addressed free block.
+ * - freeing blocks of different size classes, which must still coalesce with
+ *   their neighbours in the address-ordered freelist.
+ * - large allocation skipping the small classes.
+ * - Releasing all allocated memory merges back to one free block.
+ */
+int main(void) {
+
+    struct smalloc_opts opts = { SM_SEGREGATED_FIT };
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+
+    char *ptrs[8];
+    int sizes[8] = {16, 600, 16, 40, 16, 1000, 16, 200};
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        ptrs[i] = smalloc(sizes[i]);
+        write_to_mem(sizes[i], ptrs[i], i);
+    }
+    printf("List of allocated blocks:\n");
+    print_allocated();
+    printf("List of free blocks:\n");
+    print_free();
+
+    /* Free the 600 and 1000 byte blocks, and two 16 byte blocks that are
+     * not beside each other: four separate free blocks plus the remainder. */
+    printf("freeing %p result = %d\n", ptrs[1], sfree(ptrs[1]));
+    printf("freeing %p result = %d\n", ptrs[5], sfree(ptrs[5]));
+    printf("freeing %p result = %d\n", ptrs[2], sfree(ptrs[2]));
+    printf("freeing %p result = %d\n", ptrs[6], sfree(ptrs[6]));
+    /* 600 + 16 and 1000 + 16 blocks were merged, freelist is address ordered */
+    printf("List of free blocks:\n");
+    print_free();
+
+    /* A 10 byte request is served from the head of the first non-empty
+     * class that is guaranteed to fit: both merged blocks are in the 512-1023
+     * class and the one freed last (at ptrs[5]) is at its head. */
+    char *small = smalloc(10);
+    printf("allocating 10 bytes. Expected: %p. Result: %p\n", ptrs[5], small);
+
+    /* 900 bytes is not guaranteed to fit anything in the 512-1023 class, so
+     * only the larger classes are searched, and the block is carved from the
+     * remainder after the last allocation. */
+    char *big = smalloc(900);
+    printf("allocating 900 bytes. Expected: %p. Result: %p\n", ptrs[7] + 200, big);
+    printf("List of free blocks:\n");
+    print_free();
+
+    /* Larger than any free block. Expected: NULL */
+    printf("allocating 4000 bytes. Expected: NULL. Result: %p\n", smalloc(4000));
+
+    /* Free all: Expected a single free block of SIZE bytes */
+    printf("freeing %p result = %d\n", small, sfree(small));
+    printf("freeing %p result = %d\n", big, sfree(big));
+    for (i = 0; i < 8; i++) {
+        if (i != 1 && i != 2 && i != 5 && i != 6)
+            printf("freeing %p result = %d\n", ptrs[i], sfree(ptrs[i]));
+    }
+    printf("List of allocated blocks:\n");
+    print_allocated();
+    printf("List of free blocks:\n");
+    print_free();
+
+    mem_clean();
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "smalloc.h"
+
+
+#define SIZE (16 * 1024 * 1024)
+#define COUNT 100
+#define ROUNDS 2000
+
+/* Test for smalloc_bulk and sfree_bulk.
+ * Test covers the following scenarios, for the list, segregated fit, slab
+ * and tagged layouts:
+ * - the blocks of one smalloc_bulk call are laid out one after another
+ *   (list layout) and all count in mem_stats.
+ * - a request that cannot be met allocates nothing.
+ * - sfree_bulk in any order frees them all back into one free block, for
+ *   large and small (slab) blocks alike, and reports -1 for an address
+ *   that is not an allocated block while still freeing the rest.
+ * - bulk calls against one smalloc or sfree per block, on a heap with
+ *   many free blocks.
+ */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_block(void *addr, size_t size, void *arg) {
+    (*(long *)arg)++;
+}
+
+static long count(int which) {
+    long blocks = 0;
+    mem_walk(which, count_block, &blocks);
+    return blocks;
+}
+
+static void shuffle(void **ptrs, int n) {
+    void *tmp;
+    int i, j;
+    for (i = n - 1; i > 0; i--) {
+        j = rand() % (i + 1);
+        tmp = ptrs[i];
+        ptrs[i] = ptrs[j];
+        ptrs[j] = tmp;
+    }
+}
+
+static void run(const char *name, int policy, int flags) {
+    struct smalloc_opts opts = { policy, flags };
+    static void *ptrs[COUNT + 1], *holes[COUNT * 10], *big[9];
+    struct smalloc_stats st;
+    double t, bulk_time, single_time;
+    int i, j, together;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    printf("%s: smalloc_bulk of %d blocks. Expected: 0. Result: %d\n",
+           name, COUNT, smalloc_bulk(300, COUNT, ptrs));
+    together = 1;
+    for (i = 1; i < COUNT; i++)
+        together &= (char *)ptrs[i] == (char *)ptrs[i - 1] + 300;
+    if (!(flags & SM_TAGGED))
+        printf("%s: laid out one after another. Expected: yes. Result: %s\n",
+               name, together ? "yes" : "no");
+    mem_stats(&st);
+    printf("%s: Expected: %d blocks, %d allocs. Result: %zu blocks, %zu allocs\n",
+           name, COUNT, COUNT, st.blocks_in_use, st.allocs);
+    printf("%s: smalloc_bulk of more than the heap. Expected: -1, %d allocated. Result: %d, %ld allocated\n",
+           name, COUNT, smalloc_bulk(SIZE / 8, 9, big), count(SM_WALK_ALLOCATED));
+
+    shuffle(ptrs, COUNT);
+    ptrs[COUNT] = (char *)ptrs[0] + 8;
+    printf("%s: sfree_bulk with a bad address. Expected: -1. Result: %d\n",
+           name, sfree_bulk(ptrs, COUNT + 1));
+    printf("%s: Expected allocated blocks: 0. Result: %ld\n", name, count(SM_WALK_ALLOCATED));
+    printf("%s: Expected free blocks: 1. Result: %ld\n", name, count(SM_WALK_FREE));
+
+    //small enough for the slabs
+    smalloc_bulk(24, COUNT, ptrs);
+    shuffle(ptrs, COUNT);
+    printf("%s: sfree_bulk of %d small blocks. Expected: 0. Result: %d\n",
+           name, COUNT, sfree_bulk(ptrs, COUNT));
+    printf("%s: Expected free blocks: 1. Result: %ld\n", name, count(SM_WALK_FREE));
+
+    //leave many free blocks in the heap, then allocate and free in bulk
+    for (i = 0; i < COUNT * 10; i++)
+        holes[i] = smalloc(64 + i % 7 * 16);
+    for (i = 0; i < COUNT * 10; i += 2)
+        sfree(holes[i]);
+    t = now();
+    for (j = 0; j < ROUNDS; j++) {
+        smalloc_bulk(300, COUNT, ptrs);
+        sfree_bulk(ptrs, COUNT);
+    }
+    bulk_time = now() - t;
+    t = now();
+    for (j = 0; j < ROUNDS; j++) {
+        for (i = 0; i < COUNT; i++)
+            ptrs[i] = smalloc(300);
+        for (i = 0; i < COUNT; i++)
+            sfree(ptrs[i]);
+    }
+    single_time = now() - t;
+    printf("%s: %d rounds of %d blocks: bulk %.4fs, one at a time %.4fs\n",
+           name, ROUNDS, COUNT, bulk_time, single_time);
+    for (i = 1; i < COUNT * 10; i += 2)
+        sfree(holes[i]);
+    printf("%s: Expected free blocks: 1. Result: %ld\n", name, count(SM_WALK_FREE));
+    mem_clean();
+}
+
+int main(void) {
+    run("first fit", SM_FIRST_FIT, 0);
+    run("segregated fit", SM_SEGREGATED_FIT, 0);
+    run("slab", SM_FIRST_FIT, SM_SLAB);
+    run("tagged", SM_FIRST_FIT, SM_TAGGED);
+    return 0;
+}
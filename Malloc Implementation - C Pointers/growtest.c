@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+
+
+#define SIZE 4096
+#define COUNT 1000
+
+/* Test for SM_GROW, the heap that maps more memory as it fills up.
+ * Test covers the following scenarios, for the list and tagged layouts:
+ * - allocating far more than the initial SIZE bytes.
+ * - freeing everything cuts the heap back to its initial size.
+ * - the pages of a large free block inside the heap are given back to
+ *   the OS (resident set size drops).
+ * - a single allocation of more than 2 GiB.
+ * - allocations past opts.max_size fail with NULL.
+ * - SM_BUDDY carves the new memory into blocks that merge with the old.
+ */
+
+struct totals {
+    long blocks;
+    size_t bytes;
+};
+
+static void count_block(void *addr, size_t size, void *arg) {
+    struct totals *t = arg;
+    t->blocks++;
+    t->bytes += size;
+}
+
+static struct totals walk(int which) {
+    struct totals t = {0, 0};
+    mem_walk(which, count_block, &t);
+    return t;
+}
+
+/* Resident set size of this process, in bytes */
+static long rss(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void run(const char *name, int flags) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_GROW | flags };
+    static char *ptrs[COUNT];
+    struct totals t;
+    char *big, *fence;
+    long before;
+    int i, failed = 0;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    t = walk(SM_WALK_FREE);
+    printf("%s: initial free bytes: %zu\n", name, t.bytes);
+
+    for (i = 0; i < COUNT; i++) {
+        if ((ptrs[i] = smalloc(1000)) == NULL)
+            failed++;
+        else
+            write_to_mem(1000, ptrs[i], (char)i);
+    }
+    printf("%s: allocating %d x 1000 bytes. Expected failures: 0. Result: %d\n",
+           name, COUNT, failed);
+    for (i = 0; i < COUNT; i++)
+        sfree(ptrs[i]);
+    t = walk(SM_WALK_FREE);
+    printf("%s: after freeing all. Expected free blocks: 1. Result: %ld, free bytes: %zu\n",
+           name, t.blocks, t.bytes);
+
+    /* A 64 MiB block with an allocated block after it, so freeing it
+     * cannot cut the heap back and its pages are released in place */
+    big = smalloc(64 << 20);
+    fence = smalloc(100);
+    memset(big, 1, 64 << 20);
+    before = rss();
+    sfree(big);
+    printf("%s: freeing a touched 64 MiB block. Expected RSS drop: yes. Result: %s\n",
+           name, before - rss() >= (60 << 20) ? "yes" : "no");
+    sfree(fence);
+
+    big = smalloc(3UL << 30);
+    printf("%s: allocating 3 GiB. Expected: not NULL. Result: %s\n",
+           name, big != NULL ? "not NULL" : "NULL");
+    if (big != NULL) {
+        big[(3UL << 30) - 1] = 1;
+        printf("%s: freeing 3 GiB. Expected: 0. Result: %d\n", name, sfree(big));
+    }
+    t = walk(SM_WALK_FREE);
+    printf("%s: Expected free blocks: 1. Result: %ld, free bytes: %zu\n",
+           name, t.blocks, t.bytes);
+    t = walk(SM_WALK_ALLOCATED);
+    printf("%s: Expected allocated blocks: 0. Result: %ld\n", name, t.blocks);
+    mem_clean();
+
+    /* The heap may not grow past 1 MiB */
+    opts.max_size = 1 << 20;
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    big = smalloc(512 << 10);
+    printf("%s: allocating 512 KiB of 1 MiB. Expected: not NULL. Result: %s\n",
+           name, big != NULL ? "not NULL" : "NULL");
+    printf("%s: allocating 1 MiB more. Expected: NULL. Result: %p\n", name, smalloc(1 << 20));
+    mem_clean();
+}
+
+int main(void) {
+    struct smalloc_opts buddy = { SM_BUDDY, SM_GROW };
+    struct totals t;
+    char *p;
+
+    run("list", 0);
+    run("tagged", SM_TAGGED);
+
+    /* The first 1 MiB of the grown buddy heap merges with the initial
+     * 4096 byte block; the last 4096 bytes stay a block of their own */
+    if (mem_init_ex(SIZE, &buddy) == -1) {
+        printf("buddy: mem_init_ex failed\n");
+        return 1;
+    }
+    p = smalloc(8192);
+    printf("buddy: allocating 8192 bytes. Expected: not NULL. Result: %s\n",
+           p != NULL ? "not NULL" : "NULL");
+    printf("buddy: freeing. Expected: 0. Result: %d\n", sfree(p));
+    t = walk(SM_WALK_FREE);
+    printf("buddy: Expected free blocks: 2. Result: %ld, free bytes: %zu\n", t.blocks, t.bytes);
+    mem_clean();
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "smalloc.h"
+
+
+#define HUGE (2UL << 20)
+#define SIZE (8 * HUGE)
+#define COUNT 2000
+
+/* Test for SM_HUGEPAGE, SM_POPULATE and SM_NUMA_LOCAL.
+ * Test covers the following scenarios:
+ * - the region is aligned to a huge page and the kernel may back it with
+ *   huge pages.
+ * - SM_POPULATE faults the region in at mem_init_ex.
+ * - SM_NUMA_LOCAL sets up a working heap.
+ * - with SM_SLAB, small objects mixed with large ones sit in fewer huge
+ *   pages when slabs come from huge page zones.
+ * - SM_GROW with SM_HUGEPAGE grows the heap past its initial size.
+ */
+
+static void first_block(void *addr, size_t size, void *arg) {
+    if (*(void **)arg == NULL)
+        *(void **)arg = addr;
+}
+
+/* Returns the start of the region: its first free block, on an empty heap */
+static char *region(void) {
+    void *start = NULL;
+    mem_walk(SM_WALK_FREE, first_block, &start);
+    return start;
+}
+
+/* Returns 1 if the mapping holding addr may use transparent huge pages,
+ * or already does */
+static int thp_backed(void *addr) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    char line[256];
+    unsigned long from, to, kb;
+    int inside = 0, found = 0, eligible;
+
+    if (f == NULL)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%lx-%lx ", &from, &to) == 2)
+            inside = (uintptr_t)addr >= from && (uintptr_t)addr < to;
+        else if (inside && sscanf(line, "THPeligible: %d", &eligible) == 1)
+            found = eligible == 1;
+        else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+            found = kb > 0;
+    }
+    fclose(f);
+    return found;
+}
+
+static long rss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+/* Allocates small and large blocks in turn and returns the number of huge
+ * pages the small ones are spread over */
+static int small_units(int flags) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, flags };
+    static char *small[COUNT], *large[COUNT];
+    static uintptr_t units[COUNT];
+    int i, j, n = 0;
+
+    if (mem_init_ex(4 * SIZE, &opts) == -1)
+        return -1;
+    for (i = 0; i < COUNT; i++) {
+        small[i] = smalloc(64);
+        large[i] = smalloc(8000);
+        for (j = 0; j < n && units[j] != (uintptr_t)small[i] / HUGE; j++)
+            ;
+        if (j == n)
+            units[n++] = (uintptr_t)small[i] / HUGE;
+    }
+    for (i = 0; i < COUNT; i++) {
+        sfree(small[i]);
+        sfree(large[i]);
+    }
+    mem_clean();
+    return n;
+}
+
+int main(void) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_HUGEPAGE };
+    long before, after;
+    int with, without;
+    char *p;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    p = region();
+    printf("region %p. Expected aligned to 2 MiB: yes. Result: %s\n",
+           p, (uintptr_t)p % HUGE == 0 ? "yes" : "no");
+    memset(p, 1, HUGE);
+    printf("region may use huge pages. Expected: yes. Result: %s\n", thp_backed(p) ? "yes" : "no");
+    mem_clean();
+
+    opts.flags = SM_POPULATE;
+    before = rss_kb();
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    after = rss_kb();
+    printf("SM_POPULATE. Expected resident memory to grow by %lu kB: yes. Result: %s (%ld kB)\n",
+           SIZE / 1024, after - before >= (long)(SIZE / 1024) ? "yes" : "no", after - before);
+    mem_clean();
+
+    opts.flags = SM_NUMA_LOCAL | SM_HUGEPAGE | SM_POPULATE;
+    printf("SM_NUMA_LOCAL. Expected: 0. Result: %d\n", mem_init_ex(SIZE, &opts));
+    p = smalloc(1000);
+    printf("allocating 1000 bytes. Expected: not NULL. Result: %s\n", p != NULL ? "not NULL" : "NULL");
+    sfree(p);
+    mem_clean();
+
+    without = small_units(SM_SLAB);
+    with = small_units(SM_SLAB | SM_HUGEPAGE);
+    printf("huge pages holding %d small objects: %d without zones, %d with. Expected fewer with zones: yes. Result: %s\n",
+           COUNT, without, with, with > 0 && with < without ? "yes" : "no");
+
+    opts.flags = SM_GROW | SM_HUGEPAGE;
+    if (mem_init_ex(HUGE / 2, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    printf("grown region. Expected aligned to 2 MiB: yes. Result: %s\n",
+           (uintptr_t)region() % HUGE == 0 ? "yes" : "no");
+    p = smalloc(3 * HUGE);
+    printf("allocating 6 MiB from a 1 MiB heap. Expected: not NULL. Result: %s\n", p != NULL ? "not NULL" : "NULL");
+    if (p != NULL)
+        memset(p, 1, 3 * HUGE);
+    sfree(p);
+    mem_clean();
+    return 0;
+}
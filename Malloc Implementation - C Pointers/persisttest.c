@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "smalloc.h"
+
+
+#define SIZE (1024 * 1024)
+#define NODES 1000
+#define SLOTS 64
+#define CRASHES 5
+
+/* Test for SM_PERSIST, a heap kept in a file.
+ * Test covers the following scenarios:
+ * - a list built in the heap and reachable from a root is all there when
+ *   the file is opened again, after a clean mem_clean.
+ * - the file cannot be opened by a second process while it is open, and
+ *   a file that is not a heap is refused.
+ * - a process killed at a random point while it allocates and frees
+ *   leaves a heap that opens as recovered, with the list intact, at most
+ *   one block leaked per crash and everything else coalescing back into
+ *   one block.
+ */
+
+struct node {
+    size_t next; /* offset of the next node, 0 at the end */
+    int value;
+};
+
+static const char *path;
+
+static int open_heap(void) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_PERSIST };
+    opts.path = path;
+    return mem_init_ex(SIZE, &opts);
+}
+
+/* Returns the number of nodes of the list at root 0 holding 0, 1, 2, ... */
+static int check_list(void) {
+    struct node *n = mem_get_root(0);
+    int i;
+    for (i = 0; n != NULL && n->value == i; i++)
+        n = n->next != 0 ? mem_at(n->next) : NULL;
+    return i;
+}
+
+static void count_block(void *addr, size_t size, void *arg) {
+    (*(long *)arg)++;
+}
+
+static long count(int which) {
+    long blocks = 0;
+    mem_walk(which, count_block, &blocks);
+    return blocks;
+}
+
+static void collect(void *addr, size_t size, void *arg) {
+    void ***p = arg;
+    *(*p)++ = addr;
+}
+
+/* Allocates and frees blocks forever, keeping each one reachable from the
+ * array at root 1 while it is allocated */
+static void churn(void) {
+    size_t *slots = mem_get_root(1);
+    size_t old;
+    void *p;
+    int i;
+
+    for (i = 0; ; i++) {
+        old = slots[i % SLOTS];
+        slots[i % SLOTS] = 0;
+        if (old != 0)
+            sfree(mem_at(old));
+        if ((p = smalloc(16 + (i * 53) % 2000)) != NULL)
+            slots[i % SLOTS] = mem_offset(p);
+    }
+}
+
+int main(void) {
+    char file[] = "/tmp/persisttestXXXXXX";
+    struct node *n, *prev = NULL;
+    size_t *slots;
+    void **blocks, **end;
+    long leaked;
+    pid_t pid;
+    int fd, i, status, crash, ok;
+
+    if ((fd = mkstemp(file)) == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    path = file;
+    if (open_heap() == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    for (i = 0; i < NODES; i++) {
+        n = smalloc(sizeof(struct node));
+        n->value = i;
+        n->next = 0;
+        if (prev == NULL)
+            mem_set_root(0, n);
+        else
+            prev->next = mem_offset(n);
+        prev = n;
+    }
+    printf("root out of range. Expected: -1. Result: %d\n", mem_set_root(SM_ROOTS, n));
+    mem_clean();
+
+    printf("reopening. Expected: 0. Result: %d\n", open_heap());
+    printf("list nodes found. Expected: %d. Result: %d\n", NODES, check_list());
+    printf("recovered. Expected: 0. Result: %d\n", mem_recovered());
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+        exit(open_heap() == -1 ? 0 : 1);
+    waitpid(pid, &status, 0);
+    printf("opening it twice fails. Expected exit status: 0. Result: %d\n",
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    slots = smalloc(SLOTS * sizeof(size_t));
+    memset(slots, 0, SLOTS * sizeof(size_t));
+    mem_set_root(1, slots);
+    printf("mem_sync. Expected: 0. Result: %d\n", mem_sync());
+    mem_clean();
+
+    for (crash = 1; crash <= CRASHES; crash++) {
+        fflush(stdout);
+        if ((pid = fork()) == 0) {
+            if (open_heap() == -1)
+                exit(1);
+            churn();
+        }
+        usleep(20000 * crash);
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        if (open_heap() == -1) {
+            printf("crash %d: reopening failed\n", crash);
+            break;
+        }
+        printf("crash %d. Expected: recovered 1, %d list nodes. Result: recovered %d, %d list nodes\n",
+               crash, NODES, mem_recovered(), check_list());
+        mem_clean();
+    }
+
+    //free everything that is reachable, then what is left: the list and
+    //the leaked blocks, if any
+    open_heap();
+    slots = mem_get_root(1);
+    for (i = 0; i < SLOTS; i++) {
+        if (slots[i] != 0)
+            sfree(mem_at(slots[i]));
+    }
+    sfree(slots);
+    mem_set_root(1, NULL);
+    leaked = count(SM_WALK_ALLOCATED) - NODES;
+    printf("leaked blocks. Expected at most %d: yes. Result: %s\n",
+           CRASHES, leaked >= 0 && leaked <= CRASHES ? "yes" : "no");
+    blocks = malloc((NODES + SLOTS + CRASHES + 1) * sizeof(void *));
+    end = blocks;
+    mem_walk(SM_WALK_ALLOCATED, collect, &end);
+    ok = 1;
+    while (end > blocks)
+        ok &= sfree(*--end) == 0;
+    free(blocks);
+    printf("freeing the rest. Expected: all freed, 1 free block. Result: %s, %ld free block\n",
+           ok ? "all freed" : "not all freed", count(SM_WALK_FREE));
+    mem_clean();
+
+    //a file that is not a heap
+    fd = open(file, O_WRONLY | O_TRUNC);
+    if (fd != -1 && write(fd, "not a heap\n", 11) == 11) {
+        close(fd);
+        printf("opening a file that is not a heap. Expected: -1. Result: %d\n", open_heap());
+    }
+    unlink(file);
+    return 0;
+}
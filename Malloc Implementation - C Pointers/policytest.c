@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+
+
+#define SIZE 1024
+
+/* Test for the placement policies selectable with mem_init_ex.
+ * Test covers the following scenarios:
+ * - the same free list (holes of 100, 300 and 120 bytes and a 384 byte
+ *   remainder) gives a different block to a 110 byte request under first
+ *   fit, next fit, best fit and segregated fit.
+ * - the buddy system rounds requests up to powers of two, splits larger
+ *   blocks in half to get them, and merges buddies back when freed.
+ */
+int main(void) {
+
+    const char *names[4] = {"first fit", "next fit", "best fit", "segregated fit"};
+    int policies[4] = {SM_FIRST_FIT, SM_NEXT_FIT, SM_BEST_FIT, SM_SEGREGATED_FIT};
+    /* offsets of the expected block: the 300 byte hole, the remainder
+     * after the last allocation, and the 120 byte hole (twice) */
+    int expected[4] = {140, 640, 480, 480};
+    int sizes[6] = {100, 40, 300, 40, 120, 40};
+    char *ptrs[6];
+    int i, j;
+
+    for (i = 0; i < 4; i++) {
+        struct smalloc_opts opts = { policies[i], 0 };
+        if (mem_init_ex(SIZE, &opts) == -1) {
+            fprintf(stderr, "mem_init_ex failed\n");
+            return 1;
+        }
+        for (j = 0; j < 6; j++)
+            ptrs[j] = smalloc(sizes[j]);
+        sfree(ptrs[0]);
+        sfree(ptrs[2]);
+        sfree(ptrs[4]);
+        printf("%s, list of free blocks:\n", names[i]);
+        print_free();
+
+        char *p = smalloc(110);
+        printf("%s: allocating 110 bytes. Expected: %p. Result: %p\n",
+               names[i], ptrs[0] + expected[i], p);
+        mem_clean();
+    }
+
+    struct smalloc_opts buddy = { SM_BUDDY, 0 };
+    if (mem_init_ex(SIZE, &buddy) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    /* 100 bytes: the 1024 byte block is split into 512, 256 and 128 byte
+     * free blocks and a 128 byte allocated block */
+    char *a = smalloc(100);
+    /* 20 bytes: the free 128 byte block is split down to 32 bytes */
+    char *b = smalloc(20);
+    printf("buddy, list of allocated blocks:\n");
+    print_allocated();
+    printf("buddy, list of free blocks:\n");
+    print_free();
+
+    /* Larger than the largest free block. Expected: NULL */
+    printf("buddy: allocating 600 bytes. Expected: NULL. Result: %p\n", smalloc(600));
+
+    /* Freeing both merges every buddy back into one 1024 byte block */
+    printf("freeing %p result = %d\n", a, sfree(a));
+    printf("freeing %p result = %d\n", b, sfree(b));
+    printf("buddy, list of free blocks:\n");
+    print_free();
+
+    /* 600 bytes now fits in a 1024 byte block */
+    char *c = smalloc(600);
+    printf("buddy: allocating 600 bytes. Expected: %p. Result: %p\n", a, c);
+    mem_clean();
+
+    /* Next fit and buddy need the list layout.
+     * Expected: -1 */
+    struct smalloc_opts tagged_buddy = { SM_BUDDY, SM_TAGGED };
+    printf("mem_init_ex with SM_BUDDY | SM_TAGGED. Expected: -1. Result: %d\n",
+           mem_init_ex(SIZE, &tagged_buddy));
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+
+
+#define SIZE 8192
+
+/* Test for SM_ALIGNED, smemalign and srealloc.
+ * Test covers the following scenarios, for the list and tagged layouts:
+ * - every block is 16-byte aligned, whatever size was asked for.
+ * - smemalign returns addresses aligned as asked, and NULL for an
+ *   alignment that is not a power of two.
+ * - srealloc grows a block in place into the free block after it, and
+ *   shrinks a block in place, keeping its contents.
+ * - srealloc moves a block that cannot grow in place, keeping its contents.
+ * - srealloc of NULL allocates, srealloc to 0 bytes frees, and srealloc of
+ *   an address that is not allocated fails with NULL.
+ * - Releasing all allocated memory leaves a single free block.
+ */
+
+static int is_aligned(void *p, uintptr_t alignment) {
+    return p != NULL && (uintptr_t)p % alignment == 0;
+}
+
+/* Returns 1 if the first size bytes at p all hold value */
+static int holds(char *p, int size, char value) {
+    int i;
+    for (i = 0; i < size; i++) {
+        if (p[i] != value)
+            return 0;
+    }
+    return 1;
+}
+
+static void count_block(void *addr, size_t size, void *arg) {
+    (*(long *)arg)++;
+}
+
+static void run(const char *name, int flags) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, flags };
+    char *ptrs[4], *a, *b, *p;
+    int sizes[4] = {10, 1, 33, 7};
+    long blocks = 0;
+    int i, ok = 1;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        ptrs[i] = smalloc(sizes[i]);
+        ok &= is_aligned(ptrs[i], 16);
+    }
+    printf("%s: blocks of 10, 1, 33 and 7 bytes 16-byte aligned. Expected: yes. Result: %s\n",
+           name, ok ? "yes" : "no");
+
+    a = smemalign(64, 100);
+    b = smemalign(4096, 10);
+    printf("%s: smemalign(64, 100) aligned. Expected: yes. Result: %s\n",
+           name, is_aligned(a, 64) ? "yes" : "no");
+    printf("%s: smemalign(4096, 10) aligned. Expected: yes. Result: %s\n",
+           name, is_aligned(b, 4096) ? "yes" : "no");
+    printf("%s: smemalign(48, 10). Expected: NULL. Result: %p\n", name, smemalign(48, 10));
+    sfree(a);
+    sfree(b);
+    for (i = 0; i < 4; i++)
+        sfree(ptrs[i]);
+
+    /* a is followed by b; once b is free, a can grow into its space */
+    a = smalloc(100);
+    b = smalloc(100);
+    p = smalloc(100);
+    write_to_mem(100, a, 'a');
+    sfree(b);
+    printf("%s: growing 100 to 180 bytes in place. Expected: %p. Result: %p\n",
+           name, a, srealloc(a, 180));
+    printf("%s: contents kept. Expected: yes. Result: %s\n", name, holds(a, 100, 'a') ? "yes" : "no");
+    printf("%s: shrinking 180 to 40 bytes in place. Expected: %p. Result: %p\n",
+           name, a, srealloc(a, 40));
+    /* The space a gave up holds a new 100 byte block again */
+    b = smalloc(100);
+    printf("%s: allocating 100 bytes after a. Expected: yes. Result: %s\n",
+           name, b > a && b < p ? "yes" : "no");
+
+    /* b is in the way now, so a has to move */
+    b = srealloc(b, 0);
+    a = srealloc(a, 1000);
+    printf("%s: growing 40 to 1000 bytes moves the block. Expected: yes. Result: %s\n",
+           name, a > p ? "yes" : "no");
+    printf("%s: contents kept. Expected: yes. Result: %s\n", name, holds(a, 40, 'a') ? "yes" : "no");
+    printf("%s: srealloc of a free address. Expected: NULL. Result: %p\n",
+           name, srealloc(p + 1, 10));
+    sfree(a);
+    sfree(p);
+
+    a = srealloc(NULL, 50);
+    printf("%s: srealloc(NULL, 50). Expected: not NULL. Result: %s\n",
+           name, a != NULL ? "not NULL" : "NULL");
+    printf("%s: srealloc(a, 0). Expected: NULL. Result: %p\n", name, srealloc(a, 0));
+
+    mem_walk(SM_WALK_FREE, count_block, &blocks);
+    printf("%s: Expected free blocks: 1. Result: %ld\n", name, blocks);
+    blocks = 0;
+    mem_walk(SM_WALK_ALLOCATED, count_block, &blocks);
+    printf("%s: Expected allocated blocks: 0. Result: %ld\n", name, blocks);
+    mem_clean();
+}
+
+int main(void) {
+    run("aligned list", SM_ALIGNED);
+    run("tagged", SM_TAGGED);
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "smalloc.h"
+
+
+#define SIZE (1024 * 1024)
+#define CHILDREN 3
+#define ROUNDS 20000
+#define SLOTS 64
+#define CRASHES 5
+
+/* Test for SM_SHARED, a heap shared by several processes.
+ * Test covers the following scenarios:
+ * - SM_SHARED cannot be combined with SM_THREADS, SM_GROW or SM_SLAB.
+ * - a forked child reads a block its parent allocated, allocates a block
+ *   of its own that the parent reads and frees, and frees a parent block.
+ * - a process that maps the heap with mem_attach finds the same blocks at
+ *   the same offsets.
+ * - several children allocating and freeing at the same time leave the
+ *   heap consistent.
+ * - a child killed at a random point while it allocates and frees, most
+ *   likely holding the lock, leaves a heap whose blocks still add up and
+ *   that the parent can go on using, with at most one block leaked per
+ *   crash and everything else coalescing back into one block.
+ */
+
+static void count_block(void *addr, size_t size, void *arg) {
+    (*(long *)arg)++;
+}
+
+static long count(int which) {
+    long blocks = 0;
+    mem_walk(which, count_block, &blocks);
+    return blocks;
+}
+
+/* Waits for pid and returns its exit status, or -1 if it did not exit */
+static int wait_for(pid_t pid) {
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+/* Allocates and frees blocks of changing sizes, checking that nobody else
+ * writes to them. Returns the number of blocks found overwritten. */
+static int churn(int id) {
+    char *ptrs[16] = { NULL };
+    int i, j, errors = 0;
+    for (i = 0; i < ROUNDS; i++) {
+        j = i % 16;
+        if (ptrs[j] != NULL) {
+            if (ptrs[j][0] != id || ptrs[j][(i * 7) % 100] != id)
+                errors++;
+            sfree(ptrs[j]);
+        }
+        if ((ptrs[j] = smalloc(100 + (i * 37) % 900)) != NULL)
+            memset(ptrs[j], id, 100);
+    }
+    for (j = 0; j < 16; j++)
+        sfree(ptrs[j]);
+    return errors;
+}
+
+static void add_block(void *addr, size_t size, void *arg) {
+    *(size_t *)arg += size + 8; //with the header
+}
+
+/* Returns the bytes of the blocks in the heap and on the free lists,
+ * which stays the same while the heap is consistent */
+static size_t span(void) {
+    size_t bytes = 0;
+    mem_walk(SM_WALK_ALLOCATED, add_block, &bytes);
+    mem_walk(SM_WALK_FREE, add_block, &bytes);
+    return bytes;
+}
+
+static void collect(void *addr, size_t size, void *arg) {
+    void ***p = arg;
+    *(*p)++ = addr;
+}
+
+/* Allocates and frees blocks until killed, keeping each one in slots while
+ * it is allocated */
+static void churn_until_killed(void **slots) {
+    void *p;
+    int i;
+    for (i = 0; ; i++) {
+        p = slots[i % SLOTS];
+        slots[i % SLOTS] = NULL;
+        if (p != NULL)
+            sfree(p);
+        slots[i % SLOTS] = smalloc(16 + (i * 53) % 2000);
+    }
+}
+
+int main(void) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_SHARED | SM_GROW };
+    char *msg, *reply, **slot;
+    void **slots, **blocks, **end;
+    size_t *off, off_at, bytes;
+    pid_t pids[CHILDREN];
+    long leaked;
+    int fd, i, errors, pipefd[2], crash, ok;
+
+    printf("SM_SHARED with SM_GROW. Expected: -1. Result: %d\n", mem_init_ex(SIZE, &opts));
+    opts.flags = SM_SHARED;
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    fd = mem_shared_fd();
+    printf("shared heap has a file descriptor. Expected: yes. Result: %s\n", fd >= 0 ? "yes" : "no");
+
+    msg = smalloc(64);
+    strcpy(msg, "hello from the parent");
+    slot = smalloc(sizeof(char *));
+    *slot = NULL;
+    fflush(stdout);
+    if ((pids[0] = fork()) == 0) {
+        if (strcmp(msg, "hello from the parent") != 0)
+            exit(1);
+        reply = smalloc(64);
+        strcpy(reply, "hello from the child");
+        *slot = reply;
+        exit(sfree(msg) == 0 ? 0 : 2);
+    }
+    printf("child reads and frees a parent block. Expected exit status: 0. Result: %d\n", wait_for(pids[0]));
+    printf("parent reads the child's block. Expected: hello from the child. Result: %s\n",
+           *slot != NULL ? *slot : "(none)");
+    printf("freeing the child's block. Expected: 0. Result: %d\n", sfree(*slot));
+    printf("freeing the parent block the child freed. Expected: -1. Result: %d\n", sfree(msg));
+
+    //a process with its own mapping of the heap finds blocks by offset
+    msg = smalloc(64);
+    strcpy(msg, "found by offset");
+    sfree(slot);
+    off = smalloc(sizeof(size_t));
+    *off = mem_offset(msg);
+    off_at = mem_offset(off);
+    fflush(stdout);
+    if ((pids[0] = fork()) == 0) {
+        fd = dup(fd);
+        mem_clean();
+        if (mem_attach(fd) == -1)
+            exit(1);
+        close(fd);
+        reply = mem_at(*(size_t *)mem_at(off_at));
+        exit(reply != NULL && strcmp(reply, "found by offset") == 0 && sfree(reply) == 0 ? 0 : 2);
+    }
+    printf("mem_attach in a child. Expected exit status: 0. Result: %d\n", wait_for(pids[0]));
+    printf("Expected allocated blocks: 1. Result: %ld\n", count(SM_WALK_ALLOCATED));
+    if (pipe(pipefd) == 0) {
+        printf("mem_attach on a pipe. Expected: -1. Result: %d\n", mem_attach(pipefd[0]));
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+
+    fflush(stdout);
+    for (i = 0; i < CHILDREN; i++) {
+        if ((pids[i] = fork()) == 0)
+            exit(churn(i + 1) == 0 ? 0 : 1);
+    }
+    errors = 0;
+    for (i = 0; i < CHILDREN; i++)
+        errors += wait_for(pids[i]) != 0;
+    printf("%d children allocating at once. Expected failures: 0. Result: %d\n", CHILDREN, errors);
+    sfree(off);
+
+    //the slots are in the heap, so the parent sees what the child holds
+    slots = smalloc(SLOTS * sizeof(void *));
+    memset(slots, 0, SLOTS * sizeof(void *));
+    bytes = span();
+    for (crash = 1; crash <= CRASHES; crash++) {
+        fflush(stdout);
+        if ((pids[0] = fork()) == 0)
+            churn_until_killed(slots);
+        usleep(20000 * crash);
+        kill(pids[0], SIGKILL);
+        waitpid(pids[0], NULL, 0);
+        smalloc_usable_size(slots); //takes the lock, and undoes what the child left
+        printf("crash %d. Expected heap bytes: %zu. Result: %zu\n", crash, bytes, span());
+        printf("crash %d, then allocating. Expected overwritten blocks: 0. Result: %d\n",
+               crash, churn(CHILDREN + crash));
+    }
+    for (i = 0; i < SLOTS; i++)
+        sfree(slots[i]);
+    sfree(slots);
+    leaked = count(SM_WALK_ALLOCATED);
+    printf("leaked blocks. Expected at most %d: yes. Result: %s\n",
+           CRASHES, leaked <= CRASHES ? "yes" : "no");
+    blocks = malloc((CRASHES + 1) * sizeof(void *));
+    end = blocks;
+    if (leaked <= CRASHES)
+        mem_walk(SM_WALK_ALLOCATED, collect, &end);
+    ok = 1;
+    while (end > blocks)
+        ok &= sfree(*--end) == 0;
+    free(blocks);
+    printf("freeing the leaked blocks. Expected: all freed. Result: %s\n", ok ? "all freed" : "not all freed");
+    printf("Expected allocated blocks: 0. Result: %ld\n", count(SM_WALK_ALLOCATED));
+    printf("Expected free blocks: 1. Result: %ld\n", count(SM_WALK_FREE));
+    mem_clean();
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * malloc, free and friends on top of smalloc, for LD_PRELOAD:
+ *
+ *   LD_PRELOAD=./libsmalloc.so ./program
+ *
+ * The heap is set up the first time any of them is called. It uses the
+ * tagged layout with SM_GROW: all of its metadata lives in the region, so
+ * smalloc never calls back into malloc for struct block nodes, and the
+ * heap grows as the program needs. One lock serializes every call.
+ *
+ * Setting up the heap can itself allocate (error messages, pthread_atfork).
+ * Those calls come back in on the same thread while init_heap runs and
+ * are served from a small static bootstrap buffer that is never freed.
+ *
+ * With SMALLOC_STATS set in the environment, the mem_stats_json output is
+ * written to stderr when the program exits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "smalloc.h"
+#include "smalloc_int.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define SHIM_INIT_SIZE (1UL << 20)
+#define BOOT_SIZE (64 * 1024)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int ready; /* the heap is set up; only changed under lock */
+static __thread int in_init __attribute__((tls_model("initial-exec"))); /* in init_heap */
+
+/* Bootstrap allocations: a 16-byte header holding the size, then the
+ * payload. Freeing one does nothing. */
+static char boot[BOOT_SIZE] __attribute__((aligned(16)));
+static size_t boot_used;
+
+static int is_boot(void *p) {
+	return (char *)p >= boot && (char *)p < boot + BOOT_SIZE;
+}
+
+static void *boot_alloc(size_t alignment, size_t nbytes) {
+	size_t start;
+	char *p;
+
+	if (alignment < 16)
+		alignment = 16;
+	start = (boot_used + 16 + alignment - 1) & ~(alignment - 1);
+	if (nbytes > BOOT_SIZE || start + nbytes > BOOT_SIZE)
+		return NULL;
+	p = boot + start;
+	*(size_t *)(p - 8) = nbytes;
+	boot_used = start + ((nbytes + 15) & ~15UL);
+	return p;
+}
+
+static size_t boot_size(void *p) {
+	return *(size_t *)((char *)p - 8);
+}
+
+static void before_fork(void) {
+	pthread_mutex_lock(&lock);
+}
+
+static void after_fork(void) {
+	pthread_mutex_unlock(&lock);
+}
+
+/* Called with lock held */
+static void init_heap(void) {
+	struct smalloc_opts opts = { SM_FIRST_FIT, SM_TAGGED | SM_GROW };
+
+	in_init = 1;
+	if (mem_init_ex(SHIM_INIT_SIZE, &opts) == -1) {
+		fprintf(stderr, "libsmalloc: cannot set up the heap\n");
+		abort();
+	}
+	//a fork while another thread holds the lock would leave it locked
+	//in the child
+	pthread_atfork(before_fork, after_fork, after_fork);
+	ready = 1;
+	in_init = 0;
+}
+
+/* Takes the lock, setting up the heap on first use. Returns 0 if the
+ * caller is inside init_heap and must use the bootstrap buffer instead. */
+static int enter(void) {
+	if (in_init)
+		return 0;
+	pthread_mutex_lock(&lock);
+	if (!ready)
+		init_heap();
+	return 1;
+}
+
+static void leave(void) {
+	pthread_mutex_unlock(&lock);
+}
+
+EXPORT void *malloc(size_t size) {
+	void *p;
+	if (!enter())
+		return boot_alloc(16, size);
+	//malloc(0) must still return a pointer that can be freed
+	p = smalloc(size ? size : 1);
+	leave();
+	if (p == NULL)
+		errno = ENOMEM;
+	return p;
+}
+
+EXPORT void free(void *ptr) {
+	if (ptr == NULL || is_boot(ptr) || !enter())
+		return;
+	//pointers smalloc does not know are ignored rather than trusted
+	sfree(ptr);
+	leave();
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+	void *p;
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	//freed blocks are reused as they are, so always clear
+	if ((p = malloc(nmemb * size)) != NULL)
+		memset(p, 0, nmemb * size);
+	return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+	void *p;
+	if (ptr == NULL)
+		return malloc(size);
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if (is_boot(ptr)) {
+		if ((p = malloc(size)) != NULL)
+			memcpy(p, ptr, boot_size(ptr) < size ? boot_size(ptr) : size);
+		return p;
+	}
+	if (!enter())
+		return NULL;
+	p = srealloc(ptr, size);
+	leave();
+	if (p == NULL)
+		errno = ENOMEM;
+	return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+	void *p;
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	if (!enter()) {
+		p = boot_alloc(alignment, size);
+	} else {
+		p = smemalign(alignment, size ? size : 1);
+		leave();
+	}
+	if (p == NULL)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+	void *p;
+	int error = posix_memalign(&p, alignment < sizeof(void *) ? sizeof(void *) : alignment, size);
+	if (error != 0) {
+		errno = error;
+		return NULL;
+	}
+	return p;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+	return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+	return aligned_alloc(SM_PAGE, size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+	return aligned_alloc(SM_PAGE, (size + SM_PAGE - 1) & ~(SM_PAGE - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+	size_t size;
+	if (ptr == NULL)
+		return 0;
+	if (is_boot(ptr))
+		return boot_size(ptr);
+	if (!enter())
+		return 0;
+	size = smalloc_usable_size(ptr);
+	leave();
+	return size;
+}
+
+__attribute__((destructor)) static void print_stats(void) {
+	char buf[1024];
+	int n;
+	if (getenv("SMALLOC_STATS") == NULL || !enter())
+		return;
+	n = mem_stats_json(buf, sizeof(buf) - 1);
+	leave();
+	if (n > (int)sizeof(buf) - 2)
+		n = sizeof(buf) - 2;
+	buf[n++] = '\n';
+	if (write(STDERR_FILENO, buf, n) == -1)
+		return;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+#define COUNT 10000
+
+/* Test for libsmalloc.so, run as LD_PRELOAD=./libsmalloc.so ./shimtest.
+ * Only uses the libc interface, so nothing here knows about smalloc.
+ * Test covers the following scenarios:
+ * - the library is loaded.
+ * - malloc, calloc, realloc, posix_memalign, aligned_alloc and
+ *   malloc_usable_size behave as the C library documents.
+ * - libc functions that allocate themselves (strdup, stdio, qsort)
+ *   work on top of it.
+ * - a forked child can allocate and free.
+ */
+
+static int preloaded(void) {
+    FILE *f = fopen("/proc/self/maps", "r");
+    char line[512];
+    int found = 0;
+    if (f == NULL)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+        found = strstr(line, "libsmalloc.so") != NULL;
+    fclose(f);
+    return found;
+}
+
+static int cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int main(void) {
+    static char *ptrs[COUNT];
+    char *p, *q;
+    void *aligned;
+    //volatile, so gcc does not see the calloc overflow at compile time
+    volatile size_t huge = SIZE_MAX / 2;
+    int i, ok, status;
+    pid_t pid;
+
+    printf("libsmalloc.so loaded. Expected: yes. Result: %s\n", preloaded() ? "yes" : "no");
+
+    p = malloc(0);
+    printf("malloc(0). Expected: not NULL. Result: %s\n", p != NULL ? "not NULL" : "NULL");
+    free(p);
+    free(NULL);
+
+    p = malloc(100);
+    printf("malloc_usable_size(malloc(100)) at least 100. Expected: yes. Result: %s\n",
+           malloc_usable_size(p) >= 100 ? "yes" : "no");
+    memset(p, 'x', 100);
+    q = realloc(p, 5000);
+    ok = q != NULL;
+    for (i = 0; ok && i < 100; i++)
+        ok = q[i] == 'x';
+    printf("realloc to 5000 bytes keeps the contents. Expected: yes. Result: %s\n", ok ? "yes" : "no");
+    printf("realloc to 0 bytes. Expected: NULL. Result: %p\n", realloc(q, 0));
+
+    //reuse freed memory, then check calloc clears it
+    p = malloc(4096);
+    memset(p, 0xff, 4096);
+    free(p);
+    p = calloc(512, 8);
+    ok = p != NULL;
+    for (i = 0; ok && i < 4096; i++)
+        ok = p[i] == 0;
+    printf("calloc(512, 8) zeroed. Expected: yes. Result: %s\n", ok ? "yes" : "no");
+    free(p);
+    printf("calloc overflow. Expected: NULL. Result: %p\n", calloc(huge, 4));
+
+    i = posix_memalign(&aligned, 4096, 300);
+    printf("posix_memalign(4096). Expected: 0, aligned. Result: %d, %s\n",
+           i, (uintptr_t)aligned % 4096 == 0 ? "aligned" : "not aligned");
+    free(aligned);
+    printf("posix_memalign(24). Expected: EINVAL (22). Result: %d\n", posix_memalign(&aligned, 24, 10));
+    aligned = aligned_alloc(64, 640);
+    printf("aligned_alloc(64). Expected: aligned. Result: %s\n",
+           aligned != NULL && (uintptr_t)aligned % 64 == 0 ? "aligned" : "not aligned");
+    free(aligned);
+
+    //libc allocating on its own
+    for (i = 0; i < COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "name %d", (i * 7919) % COUNT);
+        ptrs[i] = strdup(name);
+    }
+    qsort(ptrs, COUNT, sizeof(char *), cmp);
+    ok = 1;
+    for (i = 1; i < COUNT; i++)
+        ok &= strcmp(ptrs[i - 1], ptrs[i]) < 0;
+    printf("%d strdup'd strings sorted. Expected: yes. Result: %s\n", COUNT, ok ? "yes" : "no");
+    for (i = 0; i < COUNT; i++)
+        free(ptrs[i]);
+
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        for (i = 0; i < COUNT; i++)
+            ptrs[i] = malloc(i % 500 + 1);
+        for (i = 0; i < COUNT; i++)
+            free(ptrs[i]);
+        exit(0);
+    }
+    waitpid(pid, &status, 0);
+    printf("allocating in a forked child. Expected exit status: 0. Result: %d\n",
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Slab front end for small objects (SM_SLAB).
+ *
+ * Requests of up to SLAB_MAX bytes are rounded up to one of SLAB_CLASSES
+ * object sizes and served from slabs: page-aligned, page-sized blocks
+ * taken from the general allocator and carved into equal objects. The
+ * pages come from heap_memalign, so they do not count as allocations in
+ * mem_stats; the objects do. A slab starts with a small header holding
+ * a bitmap of its free objects, so allocating is finding the first set
+ * bit and freeing is setting one, and a double free is caught by the bit
+ * already being set.
+ *
+ *   [struct slab | object 0 | object 1 | ... | object n-1 | unused tail]
+ *
+ * Slabs that have free objects are kept on a list per size class. A slab
+ * whose last object is freed goes back to the general allocator, so small
+ * objects never pin pages there. Which pages of the region are slabs is
+ * recorded in a bitmap with one bit per page, which is how sfree tells a
+ * slab object from a general block.
+ *
+ * With SM_HUGEPAGE, slab pages are not taken one at a time but carved from
+ * zones: huge page sized and aligned blocks of the general allocator. Small
+ * objects then share a few huge pages instead of scattering single pages
+ * over all of them. Pages of a zone that are not slabs (yet, or any more)
+ * are kept on a free list as empty slabs with no objects, for any class to
+ * reuse; zones stay allocated until mem_clean.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "smalloc.h"
+#include "smalloc_int.h"
+
+#define SLAB_CLASSES 12
+#define SLAB_WORDS 4 /* free bitmap words: enough for SM_PAGE / 16 objects */
+
+struct slab {
+	struct slab *next; /* slabs of the same class with free objects */
+	struct slab *prev;
+	uint32_t size; /* object size */
+	uint32_t class;
+	uint32_t used; /* objects allocated */
+	uint32_t capacity;
+	uint64_t free[SLAB_WORDS]; /* bit set for each free object */
+};
+
+/* Objects start right after the header, 16-byte aligned */
+#define SLAB_HDR ((sizeof(struct slab) + 15) & ~15UL)
+
+/* Object sizes: 16 bytes apart up to 128, then 32 bytes apart */
+static const uint16_t class_size[SLAB_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+
+/* Size class for a request, indexed by (nbytes + 15) / 16 */
+static const uint8_t class_of[SLAB_MAX / 16 + 1] = {
+	0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11
+};
+
+static struct slab *partial[SLAB_CLASSES];
+
+/* One bit per page of the region: set if the page is a slab */
+static unsigned long *slab_pages;
+static char *base;
+static size_t span;
+
+/* Zones: size (0 if not used), one bit per zone-sized unit of the region
+ * set where a zone starts, and the free pages of all zones */
+static size_t zone_size;
+static unsigned long *zone_map;
+static struct slab *zone_free;
+
+static size_t page_of(void *addr) {
+	return ((char *)addr - base) / SM_PAGE;
+}
+
+static void list_push(struct slab *s) {
+	s->prev = NULL;
+	s->next = partial[s->class];
+	if (s->next != NULL)
+		s->next->prev = s;
+	partial[s->class] = s;
+}
+
+static void list_remove(struct slab *s) {
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		partial[s->class] = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+}
+
+static void mark_page(struct slab *s) {
+	size_t page = page_of(s);
+	slab_pages[page / BITS_PER_WORD] |= 1UL << (page % BITS_PER_WORD);
+}
+
+static void unmark_page(struct slab *s) {
+	size_t page = page_of(s);
+	slab_pages[page / BITS_PER_WORD] &= ~(1UL << (page % BITS_PER_WORD));
+}
+
+/* Returns the page s to its zone's free list, as a slab with no objects */
+static void zone_put(struct slab *s) {
+	s->size = 16; //keeps the offset checks in slab_free well defined
+	s->used = 0;
+	s->capacity = 0;
+	s->free[0] = s->free[1] = s->free[2] = s->free[3] = 0;
+	s->next = zone_free;
+	zone_free = s;
+}
+
+/* Takes a free zone page, getting a new zone from the general allocator if
+ * there is none. Returns NULL if there is no memory for a zone. */
+static struct slab *zone_get(void) {
+	struct slab *s;
+	size_t unit, size;
+	char *zone;
+
+	if (zone_free == NULL) {
+		if ((zone = heap_memalign(zone_size, zone_size, &size)) == NULL)
+			return NULL;
+		unit = (zone - base) / zone_size;
+		zone_map[unit / BITS_PER_WORD] |= 1UL << (unit % BITS_PER_WORD);
+		//pushed last to first, so pages are handed out in address order
+		for (s = (struct slab *)(zone + zone_size - SM_PAGE); ; s = (struct slab *)((char *)s - SM_PAGE)) {
+			mark_page(s);
+			zone_put(s);
+			if ((char *)s == zone)
+				break;
+		}
+	}
+	s = zone_free;
+	zone_free = s->next;
+	return s;
+}
+
+/* Returns 1 if the page s was carved from a zone */
+static int is_zone_page(struct slab *s) {
+	size_t unit;
+	if (zone_size == 0)
+		return 0;
+	unit = ((char *)s - base) / zone_size;
+	return (zone_map[unit / BITS_PER_WORD] >> (unit % BITS_PER_WORD)) & 1;
+}
+
+/* Returns 1 if page is the first page of a zone */
+static int is_zone(void *page) {
+	return zone_size != 0 && ((char *)page - base) % zone_size == 0 && is_zone_page(page);
+}
+
+/* Gets a page, from a zone or else from the general allocator, and formats
+ * it as an empty slab of class c. Returns NULL if there is no memory left. */
+static struct slab *slab_new(int c) {
+	struct slab *s = NULL;
+	size_t size;
+	int i;
+
+	if (zone_size != 0)
+		s = zone_get();
+	if (s == NULL) {
+		if ((s = heap_memalign(SM_PAGE, SM_PAGE, &size)) == NULL)
+			return NULL;
+		mark_page(s);
+	}
+	s->size = class_size[c];
+	s->class = c;
+	s->used = 0;
+	s->capacity = (SM_PAGE - SLAB_HDR) / s->size;
+	for (i = 0; i < SLAB_WORDS; i++) {
+		if (s->capacity >= 64 * (i + 1))
+			s->free[i] = ~0ULL;
+		else if (s->capacity > 64 * i)
+			s->free[i] = (1ULL << (s->capacity - 64 * i)) - 1;
+		else
+			s->free[i] = 0;
+	}
+	list_push(s);
+	return s;
+}
+
+/* Returns the slab holding addr, or NULL if addr is not in a slab page */
+static struct slab *slab_of(void *addr) {
+	size_t page;
+	if ((char *)addr < base || (char *)addr >= base + span)
+		return NULL;
+	page = page_of(addr);
+	if (!(slab_pages[page / BITS_PER_WORD] & (1UL << (page % BITS_PER_WORD))))
+		return NULL;
+	return (struct slab *)((uintptr_t)addr & ~(SM_PAGE - 1));
+}
+
+/* Returns the index of the object at addr in s, or -1 if addr is not the
+ * start of an allocated object */
+static int object_of(struct slab *s, void *addr) {
+	size_t off = (char *)addr - (char *)s;
+	int i;
+
+	if (off < SLAB_HDR || (off - SLAB_HDR) % s->size != 0)
+		return -1;
+	i = (off - SLAB_HDR) / s->size;
+	if (i >= s->capacity || (s->free[i / 64] & (1ULL << (i % 64))))
+		return -1;
+	return i;
+}
+
+int slab_init(void *region, size_t size, size_t zone) {
+	int i;
+	base = region;
+	span = size;
+	zone_size = zone;
+	zone_free = NULL;
+	zone_map = NULL;
+	slab_pages = calloc((size / SM_PAGE + BITS_PER_WORD) / BITS_PER_WORD, sizeof(unsigned long));
+	if (slab_pages == NULL)
+		return -1;
+	if (zone != 0 && (zone_map = calloc((size / zone + BITS_PER_WORD) / BITS_PER_WORD,
+	                                    sizeof(unsigned long))) == NULL) {
+		free(slab_pages);
+		slab_pages = NULL;
+		return -1;
+	}
+	for (i = 0; i < SLAB_CLASSES; i++)
+		partial[i] = NULL;
+	return 0;
+}
+
+void *slab_alloc(size_t nbytes, size_t *size) {
+	struct slab *s;
+	int c = class_of[(nbytes + 15) / 16], w, i;
+
+	if ((s = partial[c]) == NULL && (s = slab_new(c)) == NULL)
+		return NULL;
+	for (w = 0; s->free[w] == 0; w++)
+		;
+	i = __builtin_ctzll(s->free[w]);
+	s->free[w] &= s->free[w] - 1;
+	if (++s->used == s->capacity)
+		list_remove(s);
+	*size = s->size;
+	return (char *)s + SLAB_HDR + (size_t)(w * 64 + i) * s->size;
+}
+
+int slab_free(void *addr, size_t *size) {
+	struct slab *s = slab_of(addr);
+	size_t page_size;
+	int i;
+
+	if (s == NULL)
+		return 1;
+	if ((i = object_of(s, addr)) == -1)
+		return -1; //not an object, or already free
+	*size = s->size;
+	s->free[i / 64] |= 1ULL << (i % 64);
+	if (s->used-- == s->capacity)
+		list_push(s);
+	if (s->used == 0) {
+		list_remove(s);
+		if (is_zone_page(s)) {
+			zone_put(s);
+		} else {
+			//give the page back, so it can merge with its neighbours
+			unmark_page(s);
+			heap_free(s, &page_size);
+		}
+	}
+	return 0;
+}
+
+size_t slab_usable_size(void *addr) {
+	struct slab *s = slab_of(addr);
+	return s != NULL && object_of(s, addr) != -1 ? s->size : 0;
+}
+
+static void walk_page(struct slab *s, void (*visit)(void *addr, size_t size, void *arg), void *arg) {
+	unsigned int i;
+	for (i = 0; i < s->capacity; i++) {
+		if (!(s->free[i / 64] & (1ULL << (i % 64))))
+			visit((char *)s + SLAB_HDR + (size_t)i * s->size, s->size, arg);
+	}
+}
+
+/* Calls visit on every allocated object of the slab page, or of every page
+ * of the zone, at page. Returns 0 if page is neither. */
+int slab_walk(void *page, void (*visit)(void *addr, size_t size, void *arg), void *arg) {
+	struct slab *s = slab_of(page);
+	size_t off;
+
+	if (s == NULL || (void *)s != page)
+		return 0;
+	if (!is_zone(page)) {
+		walk_page(s, visit, arg);
+		return 1;
+	}
+	for (off = 0; off < zone_size; off += SM_PAGE)
+		walk_page((struct slab *)((char *)page + off), visit, arg);
+	return 1;
+}
+
+void slab_clean(void) {
+	int i;
+	free(slab_pages);
+	free(zone_map);
+	slab_pages = NULL;
+	zone_map = NULL;
+	zone_free = NULL;
+	zone_size = 0;
+	base = NULL;
+	span = 0;
+	for (i = 0; i < SLAB_CLASSES; i++)
+		partial[i] = NULL;
+}
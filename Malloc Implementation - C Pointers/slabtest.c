@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+
+
+#define SIZE (1024 * 1024)
+#define COUNT 300
+
+/* Test for SM_SLAB, the slab front end for small objects.
+ * Test covers the following scenarios:
+ * - small objects of one size class are packed side by side in one page.
+ * - sfree of an object that is already free, or of an address inside an
+ *   object, fails with -1.
+ * - srealloc keeps a slab object in place while it fits its class, and
+ *   moves it otherwise.
+ * - freeing every object of a slab gives its page back, so freeing
+ *   everything leaves a single free block.
+ * - small and large allocations mixed together leave fewer free blocks
+ *   (less external fragmentation) once the large ones are freed.
+ */
+
+static void count_block(void *addr, size_t size, void *arg) {
+    (*(long *)arg)++;
+}
+
+static long count(int which) {
+    long blocks = 0;
+    mem_walk(which, count_block, &blocks);
+    return blocks;
+}
+
+/* Allocates small and large blocks in turn, frees the large ones and
+ * returns the number of free blocks left */
+static long mixed(int flags) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, flags };
+    char *small[COUNT], *large[COUNT];
+    long blocks;
+    int i;
+
+    if (mem_init_ex(SIZE, &opts) == -1)
+        return -1;
+    for (i = 0; i < COUNT; i++) {
+        small[i] = smalloc(24);
+        large[i] = smalloc(600);
+    }
+    for (i = 0; i < COUNT; i++)
+        sfree(large[i]);
+    blocks = count(SM_WALK_FREE);
+    for (i = 0; i < COUNT; i++)
+        sfree(small[i]);
+    mem_clean();
+    return blocks;
+}
+
+int main(void) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_SLAB };
+    char *a, *b, *c, *p;
+    static char *ptrs[COUNT];
+    long with, without;
+    int i;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+
+    a = smalloc(24);
+    b = smalloc(20);
+    c = smalloc(32);
+    printf("three objects of the 32 byte class. Expected: %p %p %p. Result: %p %p %p\n",
+           a, a + 32, a + 64, a, b, c);
+    printf("same page. Expected: yes. Result: %s\n",
+           ((uintptr_t)a & ~4095UL) == ((uintptr_t)c & ~4095UL) ? "yes" : "no");
+    printf("List of allocated blocks:\n");
+    print_allocated();
+
+    printf("freeing %p result = %d\n", b, sfree(b));
+    printf("freeing %p again. Expected: -1. Result: %d\n", b, sfree(b));
+    printf("freeing %p, inside an object. Expected: -1. Result: %d\n", a + 8, sfree(a + 8));
+    /* b's slot is the first free one again */
+    p = smalloc(30);
+    printf("allocating 30 bytes. Expected: %p. Result: %p\n", b, p);
+    b = p;
+
+    write_to_mem(24, a, 'a');
+    printf("growing 24 to 32 bytes. Expected: %p. Result: %p\n", a, srealloc(a, 32));
+    p = srealloc(a, 200);
+    printf("growing 32 to 200 bytes moves the object. Expected: yes. Result: %s\n",
+           p != a && p[23] == 'a' ? "yes" : "no");
+    sfree(p);
+    sfree(b);
+    sfree(c);
+
+    /* More 16 byte objects than fit in one page */
+    for (i = 0; i < COUNT; i++)
+        ptrs[i] = smalloc(16);
+    printf("%d objects of 16 bytes. Expected pages: 2. Result: %s\n", COUNT,
+           ((uintptr_t)ptrs[0] & ~4095UL) != ((uintptr_t)ptrs[COUNT - 1] & ~4095UL) ? "2" : "1");
+    for (i = 0; i < COUNT; i++)
+        sfree(ptrs[i]);
+    printf("Expected allocated blocks: 0. Result: %ld\n", count(SM_WALK_ALLOCATED));
+    printf("Expected free blocks: 1. Result: %ld\n", count(SM_WALK_FREE));
+    mem_clean();
+
+    without = mixed(0);
+    with = mixed(SM_SLAB);
+    printf("free blocks after mixed sizes: %ld without slabs, %ld with. Expected fewer with slabs: yes. Result: %s\n",
+           without, with, with < without ? "yes" : "no");
+    return 0;
+}
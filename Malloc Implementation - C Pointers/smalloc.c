@@ -1,137 +1,967 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include "smalloc.h"
+#include "smalloc_int.h"
 
 void *mem;
 struct block *freelist;
 struct block *allocated_list;
 
+/* Placement policy chosen at mem_init_ex time */
+static int policy = SM_FIRST_FIT;
+
+/* With SM_TAGGED the region is managed by tagheap.c instead of the lists
+ * below, and mem_size is remembered so mem_clean can unmap it. */
+static struct tagheap *theap;
+static size_t mem_size;
+
+/* SM_SHARED: the tagged heap is in shared memory, backed by shared_fd (-1
+ * if there was no memfd to be had, so only forked children share it).
+ * Other processes use it too, so every call on it takes its lock. */
+static int shared;
+static int shared_fd = -1;
+
+/* SM_PERSIST: shared_fd is the heap file, and recovered is set if
+ * mem_init_ex found it had not been closed cleanly */
+static int persistent;
+static int recovered;
+
+/* With SM_THREADS the region is split into arenas managed by threads.c */
+static int threaded;
+
+/* SM_ALIGNED: list layout sizes are rounded up to 16 bytes, so every block
+ * starts 16-byte aligned (the other layouts always are) */
+static int aligned;
+
+/* SM_SLAB: requests of up to SLAB_MAX bytes are served by slab.c */
+static int slabs;
+
+/* With SM_GROW, mem_size bytes of a mem_reserved byte range are mapped.
+ * The heap grows in place from there and is never trimmed below the
+ * mem_initial bytes mem_init_ex mapped. mem_reserved is 0 otherwise. */
+static size_t mem_reserved;
+static size_t mem_initial;
+static size_t trim_threshold;
+
+/* SM_HUGEPAGE, SM_POPULATE and SM_NUMA_LOCAL, applied to the region and to
+ * every extension of it. grow_chunk is SM_GROW_CHUNK, or a huge page. */
+static int map_flags;
+static size_t grow_chunk;
+
+/* Size-class free lists for SM_SEGREGATED_FIT (classes in smalloc_int.h).
+ * A free block is in exactly one bin *and* in the address-ordered freelist,
+ * which is still what merge() and print_free() walk. */
+static struct block *bins[NBINS];
+static unsigned long binmap[BINMAP_WORDS];
+
+/* Allocated blocks are indexed by address in an open-addressing hash
+ * table (linear probing, index_cap is a power of two), so sfree finds
+ * the block for addr in O(1) instead of walking allocated_list. */
+static struct block **alloc_index;
+static size_t index_cap;
+static size_t index_count;
+
+/* Free blocks are also kept in a treap ordered by address, so sfree finds
+ * the free block just before the one being freed in O(log n) instead of
+ * walking freelist. With SM_BEST_FIT they are in a second treap ordered
+ * by size. */
+static struct block *free_root;
+static struct block *size_root;
+static unsigned int prio_state = 2463534242u;
+
+/* Where the next SM_NEXT_FIT search starts: just past the last allocation */
+static char *rover;
+
+/* Number and total size of the free blocks, and the mem_stats counters.
+ * With SM_THREADS the counters are per thread, in threads.c. */
+static size_t free_count;
+static size_t free_bytes;
+static struct sm_counters counters;
+
+/* struct block nodes are carved from chunks of NODE_CHUNK nodes taken with
+ * malloc, and freed nodes are kept on free_nodes (linked through next) for
+ * reuse. mem_clean gives the chunks back without walking either list. */
+#define NODE_CHUNK 256
+struct node_chunk {
+	struct node_chunk *next;
+	struct block nodes[NODE_CHUNK];
+};
+static struct node_chunk *node_chunks;
+static int chunk_used = NODE_CHUNK;
+static struct block *free_nodes;
+
+/* The arena (arena_alloc): a chain of blocks taken with smalloc, of which
+ * arena_cur is being filled up to arena_used bytes. Chunks after arena_cur
+ * are spares left by arena_release. */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size; /* usable bytes after the header */
+};
+#define ARENA_HDR ((sizeof(struct arena_chunk) + 15) & ~15UL)
+#define ARENA_CHUNK (64 * 1024UL)
+static struct arena_chunk *arena_first;
+static struct arena_chunk *arena_cur;
+static size_t arena_used;
+
+/* Smallest block handed out by SM_BUDDY */
+#define BUDDY_MIN 16
+
+/* End of the part of the region carved into buddy blocks */
+static size_t buddy_end;
+
 int merge(struct block *preceeding);
+static int grow(size_t nbytes);
+static void *take(struct block *current, size_t nbytes);
+static void release(struct block *b, void *addr, size_t size);
+static struct block *link_freed(struct block *pre_block, struct block *freed);
 
-void *smalloc(unsigned int nbytes) {
-	struct block *current = freelist;
-	//pointer to previous in case we find available block
-	struct block *previous = NULL;
+static void bin_insert(struct block *b) {
+	int i = bin_index(b->size);
+	b->bin_prev = NULL;
+	b->bin_next = bins[i];
+	if (bins[i] != NULL)
+		bins[i]->bin_prev = b;
+	bins[i] = b;
+	binmap[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+}
 
-	//No more free memory left
-	if ((freelist == NULL) | (nbytes == 0))
+static void bin_remove(struct block *b) {
+	int i = bin_index(b->size);
+	if (b->bin_prev != NULL)
+		b->bin_prev->bin_next = b->bin_next;
+	else
+		bins[i] = b->bin_next;
+	if (b->bin_next != NULL)
+		b->bin_next->bin_prev = b->bin_prev;
+	if (bins[i] == NULL)
+		binmap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+}
+
+static size_t index_slot(void *addr) {
+	uint64_t h = ((uintptr_t)addr >> 3) * 0x9E3779B97F4A7C15ULL;
+	return (h >> 32) & (index_cap - 1);
+}
+
+static void index_put(struct block *b) {
+	size_t i = index_slot(b->addr);
+	while (alloc_index[i] != NULL)
+		i = (i + 1) & (index_cap - 1);
+	alloc_index[i] = b;
+}
+
+/* Doubles the table once it is half full, keeping probe sequences short */
+static void index_grow(void) {
+	struct block **old = alloc_index;
+	size_t old_cap = index_cap, i;
+
+	index_cap = old_cap ? old_cap * 2 : 64;
+	alloc_index = calloc(index_cap, sizeof(struct block *));
+	if (alloc_index == NULL){ //check for failure of calloc
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < old_cap; i++) {
+		if (old[i] != NULL)
+			index_put(old[i]);
+	}
+	free(old);
+}
+
+/* Adds b to allocated_list (as a stack) and to the address index */
+static void alloc_insert(struct block *b) {
+	if (2 * (index_count + 1) > index_cap)
+		index_grow();
+	index_put(b);
+	index_count++;
+	b->prev = NULL;
+	b->next = allocated_list;
+	if (allocated_list != NULL)
+		allocated_list->prev = b;
+	allocated_list = b;
+}
+
+/* Returns the slot of the allocated block starting at addr in the index,
+ * or index_cap if there is none */
+static size_t alloc_slot(void *addr) {
+	size_t i;
+
+	if (index_cap == 0)
+		return 0;
+	for (i = index_slot(addr); alloc_index[i] != NULL; i = (i + 1) & (index_cap - 1)) {
+		if (alloc_index[i]->addr == addr)
+			return i;
+	}
+	return index_cap;
+}
+
+/* Removes the allocated block starting at addr from the index and from
+ * allocated_list. Returns the block, or NULL if no block starts at addr. */
+static struct block *alloc_remove(void *addr) {
+	size_t i, j, k;
+	struct block *b;
+
+	if ((i = alloc_slot(addr)) == index_cap)
 		return NULL;
+	b = alloc_index[i];
+	//backward-shift deletion: move up any later entry of the same probe
+	//run whose home slot is not between the hole and its position
+	for (j = i; ; ) {
+		j = (j + 1) & (index_cap - 1);
+		if (alloc_index[j] == NULL)
+			break;
+		k = index_slot(alloc_index[j]->addr);
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		alloc_index[i] = alloc_index[j];
+		i = j;
+	}
+	alloc_index[i] = NULL;
+	index_count--;
+
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		allocated_list = b->next;
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+	b->next = b->prev = NULL;
+	return b;
+}
+
+static size_t subtree_max(struct block *t) {
+	return t != NULL ? t->max_size : 0;
+}
+
+/* Recomputes the largest block size in the subtree rooted at t, which lets
+ * the fit searches skip whole subtrees that hold nothing large enough. */
+static void tree_pull(struct block *t) {
+	size_t m = t->size;
+	if (subtree_max(t->left) > m)
+		m = t->left->max_size;
+	if (subtree_max(t->right) > m)
+		m = t->right->max_size;
+	t->max_size = m;
+}
+
+static struct block *rotate_left(struct block *t) {
+	struct block *r = t->right;
+	t->right = r->left;
+	r->left = t;
+	tree_pull(t);
+	tree_pull(r);
+	return r;
+}
 
-	while (current->next != NULL && current->size < nbytes){
-		previous = current;
-		current = current->next;
+static struct block *rotate_right(struct block *t) {
+	struct block *l = t->left;
+	t->left = l->right;
+	l->right = t;
+	tree_pull(t);
+	tree_pull(l);
+	return l;
+}
+
+/* Inserts b into the treap rooted at t and returns the new root. Node
+ * priorities form a min-heap, which keeps the expected depth O(log n). */
+static struct block *tree_insert(struct block *t, struct block *b) {
+	if (t == NULL) {
+		b->left = b->right = NULL;
+		b->max_size = b->size;
+		return b;
+	}
+	if ((char *)b->addr < (char *)t->addr) {
+		t->left = tree_insert(t->left, b);
+		if (t->left->prio < t->prio)
+			return rotate_right(t);
+	} else {
+		t->right = tree_insert(t->right, b);
+		if (t->right->prio < t->prio)
+			return rotate_left(t);
+	}
+	tree_pull(t);
+	return t;
+}
+
+/* Removes b from the treap rooted at t and returns the new root */
+static struct block *tree_remove(struct block *t, struct block *b) {
+	if (t == b) {
+		if (t->left == NULL)
+			return t->right;
+		if (t->right == NULL)
+			return t->left;
+		//rotate b down towards a leaf, keeping the heap order
+		if (t->left->prio < t->right->prio) {
+			t = rotate_right(t);
+			t->right = tree_remove(t->right, b);
+		} else {
+			t = rotate_left(t);
+			t->left = tree_remove(t->left, b);
+		}
+	} else if ((char *)b->addr < (char *)t->addr) {
+		t->left = tree_remove(t->left, b);
+	} else {
+		t->right = tree_remove(t->right, b);
+	}
+	tree_pull(t);
+	return t;
+}
+
+/* Refreshes the subtree sizes on the path to b after its size changed */
+static void tree_update(struct block *t, struct block *b) {
+	if (t != b)
+		tree_update((char *)b->addr < (char *)t->addr ? t->left : t->right, b);
+	tree_pull(t);
+}
+
+/* Returns the free block with the highest address below addr, or NULL */
+static struct block *tree_pred(void *addr) {
+	struct block *t = free_root, *best = NULL;
+	while (t != NULL) {
+		if ((char *)t->addr < (char *)addr) {
+			best = t;
+			t = t->right;
+		} else {
+			t = t->left;
+		}
+	}
+	return best;
+}
+
+/* Returns the free block starting exactly at addr, or NULL */
+static struct block *tree_find(void *addr) {
+	struct block *t = free_root;
+	while (t != NULL && t->addr != addr)
+		t = (char *)addr < (char *)t->addr ? t->left : t->right;
+	return t;
+}
+
+/* Size-ordered treap for SM_BEST_FIT, keyed on (size, addr) so blocks of
+ * equal size are kept in address order. Shares the priorities of the
+ * address treap. */
+static int size_less(struct block *a, struct block *b) {
+	return a->size < b->size || (a->size == b->size && (char *)a->addr < (char *)b->addr);
+}
+
+static struct block *size_insert(struct block *t, struct block *b) {
+	struct block *c;
+	if (t == NULL) {
+		b->sleft = b->sright = NULL;
+		return b;
 	}
+	if (size_less(b, t)) {
+		t->sleft = size_insert(t->sleft, b);
+		if (t->sleft->prio < t->prio) { //rotate right
+			c = t->sleft;
+			t->sleft = c->sright;
+			c->sright = t;
+			return c;
+		}
+	} else {
+		t->sright = size_insert(t->sright, b);
+		if (t->sright->prio < t->prio) { //rotate left
+			c = t->sright;
+			t->sright = c->sleft;
+			c->sleft = t;
+			return c;
+		}
+	}
+	return t;
+}
+
+static struct block *size_remove(struct block *t, struct block *b) {
+	struct block *c;
+	if (t == b) {
+		if (t->sleft == NULL)
+			return t->sright;
+		if (t->sright == NULL)
+			return t->sleft;
+		if (t->sleft->prio < t->sright->prio) {
+			c = t->sleft;
+			t->sleft = c->sright;
+			c->sright = size_remove(t, b);
+		} else {
+			c = t->sright;
+			t->sright = c->sleft;
+			c->sleft = size_remove(t, b);
+		}
+		return c;
+	}
+	if (size_less(b, t))
+		t->sleft = size_remove(t->sleft, b);
+	else
+		t->sright = size_remove(t->sright, b);
+	return t;
+}
+
+/* Links free block b into freelist right after pre (at the head if pre is
+ * NULL), and into the free block indexes the policy uses. */
+static void free_link(struct block *pre, struct block *b) {
+	b->prev = pre;
+	b->next = pre ? pre->next : freelist;
+	if (b->next != NULL)
+		b->next->prev = b;
+	if (pre != NULL)
+		pre->next = b;
+	else
+		freelist = b;
+	free_count++;
+	free_bytes += b->size;
+	//xorshift32 priorities for the treaps
+	prio_state ^= prio_state << 13;
+	prio_state ^= prio_state >> 17;
+	prio_state ^= prio_state << 5;
+	b->prio = prio_state;
+	free_root = tree_insert(free_root, b);
+	if (policy == SM_SEGREGATED_FIT || policy == SM_BUDDY)
+		bin_insert(b);
+	else if (policy == SM_BEST_FIT)
+		size_root = size_insert(size_root, b);
+}
+
+/* Moves free block b to addr and changes its size. The new range must not
+ * reach past its neighbours in freelist, so its position there and in the
+ * address treap stays the same; the size indexes are refreshed. */
+static void free_resize(struct block *b, void *addr, size_t size) {
+	if (policy == SM_SEGREGATED_FIT || policy == SM_BUDDY)
+		bin_remove(b);
+	else if (policy == SM_BEST_FIT)
+		size_root = size_remove(size_root, b);
+	free_bytes += size - b->size;
+	b->addr = addr;
+	b->size = size;
+	if (policy == SM_SEGREGATED_FIT || policy == SM_BUDDY)
+		bin_insert(b);
+	else if (policy == SM_BEST_FIT)
+		size_root = size_insert(size_root, b);
+	tree_update(free_root, b);
+}
+
+/* Unlinks b from the (doubly linked, address-ordered) freelist and from
+ * the free block indexes */
+static void free_unlink(struct block *b) {
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		freelist = b->next;
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+	free_count--;
+	free_bytes -= b->size;
+	free_root = tree_remove(free_root, b);
+	if (policy == SM_SEGREGATED_FIT || policy == SM_BUDDY)
+		bin_remove(b);
+	else if (policy == SM_BEST_FIT)
+		size_root = size_remove(size_root, b);
+}
+
+/* Segregated fit: any block in a class at or above bin_fit_index(nbytes)
+ * fits, so the head of the first non-empty such bin is taken in O(1).
+ * Only when all of those are empty is the bin that nbytes falls into
+ * searched, since it holds blocks both smaller and larger than nbytes. */
+static struct block *bin_fit(size_t nbytes) {
+	int i = bin_next_nonempty(binmap, bin_fit_index(nbytes));
+	struct block *b;
+	if (i >= 0)
+		return bins[i];
+	for (b = bins[bin_index(nbytes)]; b != NULL; b = b->bin_next) {
+		if (b->size >= nbytes)
+			return b;
+	}
+	return NULL;
+}
+
+/* Returns the lowest-addressed block of at least nbytes in the subtree t
+ * whose address is not below from, or NULL. */
+static struct block *tree_fit(struct block *t, char *from, size_t nbytes) {
+	struct block *b;
+	if (subtree_max(t) < nbytes)
+		return NULL;
+	if ((char *)t->addr < from)
+		return tree_fit(t->right, from, nbytes);
+	if ((b = tree_fit(t->left, from, nbytes)) != NULL)
+		return b;
+	if (t->size >= nbytes)
+		return t;
+	return tree_fit(t->right, from, nbytes);
+}
+
+/* First fit: the lowest-addressed free block that is large enough. The
+ * subtree sizes in the address treap make this O(log n) instead of a walk
+ * over freelist. */
+static struct block *first_fit(size_t nbytes) {
+	return tree_fit(free_root, NULL, nbytes);
+}
+
+/* Next fit: like first fit, but starting at the roving pointer left after
+ * the previous allocation and wrapping around to the start of the region. */
+static struct block *next_fit(size_t nbytes) {
+	struct block *b = tree_fit(free_root, rover, nbytes);
+	return b != NULL ? b : tree_fit(free_root, NULL, nbytes);
+}
+
+/* Best fit: the smallest block that is large enough, lowest address first */
+static struct block *best_fit(size_t nbytes) {
+	struct block *t = size_root, *best = NULL;
+	while (t != NULL) {
+		if (t->size >= nbytes) {
+			best = t;
+			t = t->sleft;
+		} else {
+			t = t->sright;
+		}
+	}
+	return best;
+}
+
+static struct block *new_block(void *addr, size_t size) {
+	struct node_chunk *chunk;
+	struct block *b;
+
+	if (free_nodes != NULL) {
+		b = free_nodes;
+		free_nodes = b->next;
+	} else {
+		if (chunk_used == NODE_CHUNK) {
+			chunk = malloc(sizeof(struct node_chunk));
+			if (chunk == NULL){ //check for failure of malloc
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			chunk->next = node_chunks;
+			node_chunks = chunk;
+			chunk_used = 0;
+		}
+		b = &node_chunks->nodes[chunk_used++];
+	}
+	b->addr = addr;
+	b->size = size;
+	return b;
+}
+
+static void free_node(struct block *b) {
+	b->next = free_nodes;
+	free_nodes = b;
+}
+
+/* Returns the size of the buddy-system block that holds nbytes */
+static size_t buddy_size(size_t nbytes) {
+	size_t size = BUDDY_MIN;
+	while (size < nbytes)
+		size *= 2;
+	return size;
+}
+
+/* Binary buddy allocation: blocks are powers of two, aligned to their size
+ * relative to mem, and the bins hold one size each. The smallest free block
+ * that is large enough is halved until it has the requested size, the
+ * upper halves going back on the free lists. */
+static void *buddy_alloc(size_t nbytes) {
+	size_t size;
+	int i;
+	struct block *b, *half;
+
+	if (nbytes > mem_size && mem_reserved == 0)
+		return NULL;
+	size = buddy_size(nbytes);
+	if ((i = bin_next_nonempty(binmap, bin_index(size))) < 0 &&
+	    (grow(size) == -1 || (i = bin_next_nonempty(binmap, bin_index(size))) < 0))
+		return NULL;
+	b = bins[i];
+	while (b->size > size) {
+		half = new_block((char *)b->addr + b->size / 2, b->size / 2);
+		free_resize(b, b->addr, b->size / 2);
+		free_link(b, half);
+	}
+	free_unlink(b);
+	alloc_insert(b);
+	return b->addr;
+}
+
+/* Frees a buddy block, merging it with its buddy for as long as the buddy
+ * is free and whole. The buddy's offset differs from the block's only in
+ * the bit for the block's size. */
+static struct block *buddy_free(struct block *b) {
+	struct block *buddy;
+	for (;;) {
+		char *buddy_addr = (char *)mem + (((char *)b->addr - (char *)mem) ^ b->size);
+		buddy = tree_find(buddy_addr);
+		if (buddy == NULL || buddy->size != b->size)
+			break;
+		free_unlink(buddy);
+		if (buddy_addr < (char *)b->addr)
+			b->addr = buddy_addr;
+		b->size *= 2;
+		free_node(buddy);
+	}
+	free_link(tree_pred(b->addr), b);
+	return b;
+}
+
+/* Carves the region from buddy_end up to end into the largest blocks that
+ * are aligned to their size, merging them with free buddies. A tail
+ * smaller than BUDDY_MIN is left for the next call. */
+static void buddy_carve(size_t end) {
+	size_t block;
+	while (end - buddy_end >= BUDDY_MIN) {
+		for (block = BUDDY_MIN; buddy_end % (2 * block) == 0 && 2 * block <= end - buddy_end; block *= 2)
+			;
+		buddy_free(new_block((char *)mem + buddy_end, block));
+		buddy_end += block;
+	}
+}
+
+/* Takes the heap's lock when it is shared between processes */
+static void lock_heap(void) {
+	if (shared)
+		tag_lock(theap);
+}
+
+/* With SM_SHARED or SM_PERSIST, one locked call is one all-or-nothing
+ * operation */
+static void unlock_heap(void) {
+	if (shared) {
+		tag_commit(theap);
+		tag_unlock(theap);
+	}
+}
+
+/* Applies the map_flags to len bytes of newly mapped memory at addr. The
+ * advice comes before the prefaulting, so the pages are faulted in as huge
+ * pages and on the local node. Failures are ignored: the memory works the
+ * same without them. */
+static void map_advise(void *addr, size_t len) {
+	volatile char *p;
+	size_t i;
+
+	if (map_flags & SM_HUGEPAGE)
+		madvise(addr, len, MADV_HUGEPAGE);
+	if (map_flags & SM_NUMA_LOCAL)
+		syscall(SYS_mbind, addr, len, MPOL_LOCAL, NULL, 0, 0);
+	if ((map_flags & SM_POPULATE) && madvise(addr, len, MADV_POPULATE_WRITE) == -1) {
+		//kernels before 5.14: touch every page
+		for (i = 0, p = addr; i < len; i += SM_PAGE)
+			p[i] = 0;
+	}
+}
+
+/* Maps the region: size bytes at the start of a range of reserve bytes
+ * the heap may grow into later (reserve is 0 without SM_GROW). With
+ * SM_HUGEPAGE the region is aligned to a huge page. Returns MAP_FAILED if
+ * it cannot be mapped. */
+static void *map_region(size_t size, size_t reserve) {
+	size_t span = reserve ? reserve : size;
+	size_t align = (map_flags & SM_HUGEPAGE) ? SM_HUGE_PAGE : 0;
+	char *p, *start;
+
+	if (align != 0 && reserve == 0) {
+		//hugetlbfs pages, if the system has some set aside
+		p = mmap(NULL, (size + align - 1) & ~(align - 1), PROT_READ | PROT_WRITE,
+		         MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+	}
+	if (align == 0 && reserve == 0)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	//reserve the address range without mapping any memory, cut it down
+	//to an aligned span, then map the first size bytes of it
+	p = mmap(NULL, span + align, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+	start = align ? (char *)(((uintptr_t)p + align - 1) & ~(align - 1)) : p;
+	if (start > p)
+		munmap(p, start - p);
+	if (p + align > start)
+		munmap(start + span, p + align - start);
+	if (mmap(start, size, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		munmap(start, span);
+		return MAP_FAILED;
+	}
+	return start;
+}
+
+/* SM_SHARED: maps size bytes of shared memory, from a memfd that other
+ * processes can map too if the kernel has memfd_create, and sets
+ * shared_fd. Returns MAP_FAILED if it cannot be mapped. */
+static void *map_shared(size_t size) {
+	void *p;
+
+	if ((shared_fd = memfd_create("smalloc", MFD_CLOEXEC)) == -1)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (ftruncate(shared_fd, size) == -1 ||
+	    (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0)) == MAP_FAILED) {
+		close(shared_fd);
+		shared_fd = -1;
+		return MAP_FAILED;
+	}
+	return p;
+}
+
+/* SM_PERSIST: maps the heap file at path, making it size bytes if it is
+ * empty, and sets fresh if it was. Otherwise size is set to the size of
+ * the file. Only one process may have the file open at a time (forked
+ * children share it). Returns MAP_FAILED on error. */
+static void *map_file(const char *path, size_t *size, int *fresh) {
+	struct stat st;
+	void *p;
+
+	if (path == NULL) {
+		fprintf(stderr, "mem_init_ex: SM_PERSIST needs a path\n");
+		return MAP_FAILED;
+	}
+	if ((shared_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		perror(path);
+		return MAP_FAILED;
+	}
+	if (flock(shared_fd, LOCK_EX | LOCK_NB) == -1) {
+		fprintf(stderr, "mem_init_ex: %s is in use\n", path);
+		goto fail;
+	}
+	if (fstat(shared_fd, &st) == -1)
+		goto error;
+	*fresh = st.st_size == 0;
+	if (*fresh && ftruncate(shared_fd, *size) == -1)
+		goto error;
+	if (!*fresh)
+		*size = st.st_size;
+	p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_fd, 0);
+	if (p != MAP_FAILED)
+		return p;
+error:
+	perror(path);
+fail:
+	close(shared_fd);
+	shared_fd = -1;
+	return MAP_FAILED;
+}
+
+/* Maps extra more bytes at the end of the heap, inside the range reserved
+ * by mem_init_ex. Returns 0 on success, -1 if the range is used up. */
+static int heap_extend(size_t extra) {
+	if (extra > mem_reserved - mem_size)
+		return -1;
+	if (mmap((char *)mem + mem_size, extra, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) == MAP_FAILED)
+		return -1;
+	map_advise((char *)mem + mem_size, extra);
+	mem_size += extra;
+	return 0;
+}
+
+/* Unmaps the heap past its first size bytes. The range stays reserved. */
+static void heap_shrink(size_t size) {
+	mmap((char *)mem + size, mem_size - size, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANON | MAP_FIXED | MAP_NORESERVE, -1, 0);
+	mem_size = size;
+}
+
+/* SM_GROW: extends the heap by at least grow_chunk bytes, or by what is
+ * left of the reserved range, so a request of nbytes can be served.
+ * Returns 0 on success and -1 if the heap cannot grow that far. */
+static int grow(size_t nbytes) {
+	char *end = (char *)mem + mem_size;
+	size_t need = nbytes, extra;
+	struct block *pre;
+
+	if (mem_reserved == 0 || nbytes > mem_reserved)
+		return -1;
+	if (policy == SM_BUDDY)
+		//room for a block of nbytes (a power of two) aligned past buddy_end
+		need = ((buddy_end + nbytes - 1) & ~(nbytes - 1)) + nbytes - mem_size;
+	else if (theap != NULL)
+		need += 64; //tags, and the epilogue
+	extra = (need + grow_chunk - 1) & ~(grow_chunk - 1);
+	if (extra > mem_reserved - mem_size)
+		extra = (need + SM_PAGE - 1) & ~(SM_PAGE - 1);
+	if (heap_extend(extra) == -1)
+		return -1;
+	if (theap != NULL) {
+		tag_grow(theap, mem_size);
+	} else if (policy == SM_BUDDY) {
+		buddy_carve(mem_size);
+	} else {
+		//the new space is one free block, merged with the last one
+		pre = tree_pred(end);
+		free_link(pre, new_block(end, extra));
+		if (pre != NULL)
+			merge(pre);
+	}
+	return 0;
+}
+
+/* SM_GROW: called once [addr, addr + size) was freed into free block b.
+ * If b is at least trim_threshold bytes, its memory goes back to the OS:
+ * a block at the end of the heap is cut off at a page boundary (never
+ * below mem_initial), otherwise the whole pages of the freed range are
+ * released with madvise and read back as zeroes when next used. */
+static void release(struct block *b, void *addr, size_t size) {
+	size_t start = (char *)b->addr - (char *)mem, keep;
+	uintptr_t lo, hi;
+
+	if (b->size < trim_threshold)
+		return;
+	if (start + b->size == mem_size && policy != SM_BUDDY) {
+		keep = (start + SM_PAGE - 1) & ~(SM_PAGE - 1);
+		if (keep < mem_initial)
+			keep = mem_initial;
+		if (keep < mem_size) {
+			if (keep == start) {
+				free_unlink(b);
+				free_node(b);
+			} else {
+				free_resize(b, b->addr, keep - start);
+			}
+			heap_shrink(keep);
+			return;
+		}
+	}
+	lo = ((uintptr_t)addr + SM_PAGE - 1) & ~(SM_PAGE - 1);
+	hi = ((uintptr_t)addr + size) & ~(SM_PAGE - 1);
+	if (hi > lo)
+		madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/* Returns the free block the placement policy picks for nbytes, or NULL */
+static struct block *find_fit(size_t nbytes) {
+	switch (policy) {
+	case SM_SEGREGATED_FIT:
+		return bin_fit(nbytes);
+	case SM_NEXT_FIT:
+		return next_fit(nbytes);
+	case SM_BEST_FIT:
+		return best_fit(nbytes);
+	default:
+		return first_fit(nbytes);
+	}
+}
+
+/* smalloc without the slabs and the counting. Sets size to the usable
+ * size of the block, found while the block is taken, so counting it needs
+ * no second lookup. */
+static void *heap_malloc(size_t nbytes, size_t *size) {
+	struct block *current;
+	void *p;
+
+	if (threaded)
+		return mt_malloc(nbytes, size);
+	if (theap != NULL) {
+		lock_heap();
+		if ((p = tag_malloc(theap, nbytes)) != NULL)
+			*size = tag_usable_size(theap, p);
+		unlock_heap();
+		if (p == NULL && nbytes != 0 && grow(nbytes) == 0 &&
+		    (p = tag_malloc(theap, nbytes)) != NULL)
+			*size = tag_usable_size(theap, p);
+		return p;
+	}
+
+	//No more free memory left
+	if ((freelist == NULL && mem_reserved == 0) | (nbytes == 0))
+		return NULL;
+	if (policy == SM_BUDDY) {
+		*size = buddy_size(nbytes);
+		return buddy_alloc(nbytes);
+	}
+	if (aligned)
+		nbytes = (nbytes + 15) & ~15UL;
+
+	current = find_fit(nbytes);
 	/*If memory cannot be reserved (there is no block large enough to 
-	hold size nbytes), returns null.*/
-	if (current->size < nbytes){
+	hold size nbytes), grows the heap if it may, else returns null.*/
+	if (current == NULL && (grow(nbytes) == -1 || (current = find_fit(nbytes)) == NULL)){
     	return NULL;
 	} 
+	*size = nbytes;
+	return take(current, nbytes);
+}
+
+/* Allocates the first nbytes of free block current */
+static void *take(struct block *current, size_t nbytes) {
+	rover = (char *)current->addr + nbytes;
 	/* The case where we found a block of exactly the required size */
-	else if (current->size == nbytes){
+	if (current->size == nbytes){
 		//Remove block from freelist
-		if (previous == NULL){ //We are at the head of the freelist
-			freelist = current->next;
-		} else{
-			previous->next = current->next;
-		}
+		free_unlink(current);
 		//Insert block into allocated_list
-		current->next = allocated_list;
-		allocated_list = current; //stack
+		alloc_insert(current); //stack
 		return current->addr; //want address of memory in mem_region, not the struct itself
 
 	} else{ /* The case where we found a block that is larger than the required size*/
 		//Split up the free block.
 		//New block to maintain pointer to reserved memory
-		struct block *reserved_block = malloc(sizeof(struct block));
-		if (reserved_block == NULL){ //check for failure of malloc
-    		fprintf(stderr, "Out of memory\n");
-        	exit(1);
-    	}
-		reserved_block->addr = current->addr;
-		reserved_block->size = nbytes;
-		reserved_block->next = allocated_list;
-		allocated_list = reserved_block;
+		struct block *reserved_block = new_block(current->addr, nbytes);
+		alloc_insert(reserved_block);
 		//Modify block remaining in freelist to have size and address corresponding
 		//to memory left over.
-		current->addr = ((char*)(current->addr)) + nbytes;
-		current->size -= nbytes;
+		free_resize(current, (char *)current->addr + nbytes, current->size - nbytes);
 		return reserved_block->addr;
 	}
 }
 
-/* Return memory allocated by smalloc to the list
- * of free blocks so that it might be reused later. 
- * Arguments:
- * - addr Address of the reserved block in mem_region
- * If sfree cannot find the block, reports error.
- * Returns -1 on error, and a 0 on success.
- */
-int sfree(void *addr) {
+/* sfree without the slabs and the counting. Sets size to the usable size
+ * the block had. */
+int heap_free(void *addr, size_t *size) {
 	//need to merge free blocks whenever possible.
-	struct block *freed = allocated_list;
-	struct block *previous = NULL;
-	if (allocated_list == NULL) //allocated_list is empty
-		return -1;
-
-	//remove reserved block from allocated_list
-	while (freed->next != NULL && freed->addr != addr){
-		previous = freed;
-		freed = freed->next;
-	}
-	if (freed->addr != addr) //could not find allocated memory at addr.
-		return -1;
-
-	if (previous == NULL){ //We are at the head of the allocated_list
-		allocated_list = freed->next;
-	} else {
-		previous->next = freed->next;
+	struct block *freed;
+	size_t keep;
+	int result;
+	if (threaded)
+		return mt_free(addr, size);
+	if (theap != NULL) {
+		lock_heap();
+		if ((*size = tag_usable_size(theap, addr)) == 0)
+			result = -1;
+		else
+			result = tag_free(theap, addr);
+		unlock_heap();
+		if (result == -1)
+			return -1;
+		if (mem_reserved != 0 && (keep = tag_trim(theap, mem_initial)) < mem_size)
+			heap_shrink(keep);
+		return 0;
 	}
-	freed->next = NULL; //remove link to block in allocated_list
 
-	//insert free block into freelist.
-	//search for appropriate free spot in free list for insertion & possibly merging
-	struct block *pre_block = NULL;
-	struct block *post_block = freelist;
-
-	if (freelist == NULL){ //freelist is empty
-		freelist = freed;
+	//remove reserved block from allocated_list, found through the index
+	if ((freed = alloc_remove(addr)) == NULL) //could not find allocated memory at addr.
+		return -1;
+	*size = freed->size;
+	if (policy == SM_BUDDY) {
+		freed = buddy_free(freed);
+		if (mem_reserved != 0)
+			release(freed, addr, *size);
 		return 0;
-	} 
-
-	while (post_block->next != NULL && freed->addr > post_block->addr){
-		pre_block = post_block;
-		post_block = post_block->next;
 	}
 
-	if (freed->addr > post_block->addr){ //reached end of freelist
-		post_block->next = freed;
-		merge(post_block);
-		return 0;
-	} 
-	else if (pre_block == NULL){ //beginning of freelist
-		freed->next = post_block;
-		freelist = freed;
-		merge(freed);
-		return 0;
-	} 
-	else if (pre_block->addr < freed->addr && freed->addr < post_block->addr) { // middle of freelist
-		pre_block->next = freed;
-		freed->next = post_block;
-		if (merge(pre_block) == 0){ //pre_block was merged with freed
-			merge(pre_block); //try to merge pre_block now with post_block
-		} else {
-			merge(freed); //since pre_block and freed could not be merged, 
-						 //try merging freed with post_block.
-		}
-		return 0;
-	} 
-	else {
-		return -1;
+	freed = link_freed(tree_pred(addr), freed);
+	if (mem_reserved != 0)
+		release(freed, addr, *size);
+	return 0;
+}
+
+/* Inserts freed block freed into freelist right after pre_block, the free
+ * block before it, so the list stays in address order, then merges it
+ * with its neighbours. Returns the free block it ends up in. */
+static struct block *link_freed(struct block *pre_block, struct block *freed) {
+	free_link(pre_block, freed);
+	if (pre_block != NULL && merge(pre_block) == 0){ //pre_block was merged with freed
+		merge(pre_block); //try to merge pre_block now with the block after it
+		return pre_block;
 	}
-    
+	merge(freed); //since pre_block and freed could not be merged, 
+				 //try merging freed with the block after it.
+	return freed;
 }
 
 /* Checks if two blocks of memory are located right beside eachother,
@@ -155,12 +985,386 @@ int merge(struct block *preceeding){
 		return -1;
 	} 
 	//merge following block with preceeding block
-	preceeding->size += following->size; 
-	preceeding->next = following->next; 
-	free(following); //don't need this block anymore
+	free_unlink(following);
+	free_resize(preceeding, preceeding->addr, preceeding->size + following->size);
+	free_node(following); //don't need this block anymore
+	return 0;
+}
+
+/* smemalign without the counting; sets size as heap_malloc does. With the
+ * list layout the free space before the aligned address stays a free block
+ * of its own. */
+void *heap_memalign(size_t alignment, size_t nbytes, size_t *size) {
+	struct block *current, *rest;
+	size_t lead;
+	void *p;
+
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+		return NULL;
+	if (threaded)
+		return mt_memalign(alignment, nbytes, size);
+	if (theap != NULL) {
+		lock_heap();
+		if ((p = tag_memalign(theap, alignment, nbytes)) != NULL)
+			*size = tag_usable_size(theap, p);
+		unlock_heap();
+		if (p == NULL && nbytes != 0 && grow(nbytes + alignment + 64) == 0 &&
+		    (p = tag_memalign(theap, alignment, nbytes)) != NULL)
+			*size = tag_usable_size(theap, p);
+		return p;
+	}
+	if (alignment <= (aligned ? 16 : 1) || nbytes == 0)
+		return heap_malloc(nbytes, size);
+	if (policy == SM_BUDDY) {
+		//buddy blocks are aligned to their size, and mem to a page
+		if (alignment > SM_PAGE)
+			return NULL;
+		if (nbytes < alignment)
+			nbytes = alignment;
+		*size = buddy_size(nbytes);
+		return buddy_alloc(nbytes);
+	}
+	if (aligned)
+		nbytes = (nbytes + 15) & ~15UL;
+	if ((current = find_fit(nbytes + alignment - 1)) == NULL &&
+	    (grow(nbytes + alignment - 1) == -1 || (current = find_fit(nbytes + alignment - 1)) == NULL))
+		return NULL;
+	lead = -(uintptr_t)current->addr & (alignment - 1);
+	if (lead != 0) {
+		rest = new_block((char *)current->addr + lead, current->size - lead);
+		free_resize(current, current->addr, lead);
+		free_link(current, rest);
+		current = rest;
+	}
+	*size = nbytes;
+	return take(current, nbytes);
+}
+
+/* Resizes the allocated block at addr in place so it holds nbytes, and
+ * sets old_size to its size before and, on success, new_size to its size
+ * after. Shrinking turns the tail into a free block; growing takes the
+ * start of the free block right after it, the neighbour merge() would join
+ * it with. Returns 0 on success, 1 if the block cannot grow in place and
+ * -1 if addr is not an allocated block. */
+static int resize(void *addr, size_t nbytes, size_t *old_size, size_t *new_size) {
+	struct block *b, *next;
+	unsigned long old, new;
+	size_t i, size;
+	int result;
+
+	if (threaded) {
+		result = mt_resize(addr, nbytes, &old, &new);
+		*old_size = old;
+		*new_size = new;
+		return result;
+	}
+	if (slabs && (*old_size = slab_usable_size(addr)) != 0) { //a slab object cannot change size in place
+		*new_size = *old_size;
+		return nbytes <= *old_size ? 0 : 1;
+	}
+	if (theap != NULL) {
+		lock_heap();
+		*old_size = *new_size = tag_usable_size(theap, addr);
+		if ((result = tag_resize(theap, addr, nbytes)) == 0)
+			*new_size = tag_usable_size(theap, addr);
+		unlock_heap();
+		return result;
+	}
+	if ((i = alloc_slot(addr)) == index_cap)
+		return -1;
+	b = alloc_index[i];
+	*old_size = *new_size = b->size;
+	if (aligned)
+		nbytes = (nbytes + 15) & ~15UL;
+	if (policy == SM_BUDDY) //a buddy block cannot change size in place
+		return nbytes <= b->size ? 0 : 1;
+	*new_size = nbytes;
+	if (nbytes < b->size) {
+		next = new_block((char *)addr + nbytes, b->size - nbytes);
+		size = next->size;
+		b->size = nbytes;
+		free_link(tree_pred(next->addr), next);
+		merge(next);
+		if (mem_reserved != 0)
+			release(next, (char *)addr + nbytes, size);
+		return 0;
+	}
+	if (nbytes == b->size)
+		return 0;
+	next = tree_find((char *)addr + b->size);
+	if (next == NULL || b->size + next->size < nbytes)
+		return 1;
+	if (b->size + next->size == nbytes) {
+		free_unlink(next);
+		free_node(next);
+	} else {
+		free_resize(next, (char *)addr + nbytes, next->size - (nbytes - b->size));
+	}
+	b->size = nbytes;
+	return 0;
+}
+
+/* The counters of the calling thread */
+static struct sm_counters *my_counters(void) {
+	return threaded ? mt_counters() : &counters;
+}
+
+size_t smalloc_usable_size(void *addr) {
+	size_t i, size;
+	if (threaded)
+		return mt_usable_size(addr);
+	if (slabs && (size = slab_usable_size(addr)) != 0)
+		return size;
+	if (theap != NULL) {
+		lock_heap();
+		size = tag_usable_size(theap, addr);
+		unlock_heap();
+		return size;
+	}
+	if ((i = alloc_slot(addr)) == index_cap)
+		return 0;
+	return alloc_index[i]->size;
+}
+
+void *smalloc(size_t nbytes) {
+	size_t size;
+	void *p;
+	if (slabs && nbytes - 1 < SLAB_MAX)
+		p = slab_alloc(nbytes, &size);
+	else
+		p = heap_malloc(nbytes, &size);
+	if (p != NULL)
+		count_alloc(my_counters(), size);
+	return p;
+}
+
+/* Reserves nbytes starting at an address that is a multiple of alignment,
+ * which must be a power of two. Returns NULL if alignment is invalid or
+ * the memory cannot be allocated. */
+void *smemalign(size_t alignment, size_t nbytes) {
+	size_t size;
+	void *p = heap_memalign(alignment, nbytes, &size);
+	if (p != NULL)
+		count_alloc(my_counters(), size);
+	return p;
+}
+
+/* Return memory allocated by smalloc to the list
+ * of free blocks so that it might be reused later. 
+ * Arguments:
+ * - addr Address of the reserved block in mem_region
+ * If sfree cannot find the block, reports error.
+ * Returns -1 on error, and a 0 on success.
+ */
+int sfree(void *addr) {
+	size_t size;
+	int result;
+	if (!slabs || (result = slab_free(addr, &size)) == 1)
+		result = heap_free(addr, &size);
+	if (result == 0)
+		count_free(my_counters(), size);
+	return result;
+}
+
+/* Changes the size of the block at addr to nbytes, in place if it can,
+ * otherwise by moving it to a new block. Same as smalloc if addr is NULL,
+ * and as sfree if nbytes is 0. Returns the block's (new) address, or NULL
+ * if it cannot be resized, in which case addr is left as it was. */
+void *srealloc(void *addr, size_t nbytes) {
+	struct sm_counters *c;
+	size_t old_size, new_size;
+	void *p;
+
+	if (addr == NULL)
+		return smalloc(nbytes);
+	if (nbytes == 0) {
+		sfree(addr);
+		return NULL;
+	}
+	switch (resize(addr, nbytes, &old_size, &new_size)) {
+	case -1:
+		return NULL;
+	case 0:
+		//counted as the old block going and the new one coming,
+		//without adding to allocs and frees
+		c = my_counters();
+		count_free(c, old_size);
+		count_alloc(c, new_size);
+		counter_add(&c->allocs, -1);
+		counter_add(&c->frees, -1);
+		return addr;
+	}
+	if ((p = smalloc(nbytes)) == NULL)
+		return NULL;
+	memcpy(p, addr, old_size < nbytes ? old_size : nbytes);
+	sfree(addr);
+	return p;
+}
+
+/* List layout part of smalloc_bulk: carves count blocks of nbytes, one
+ * after another, out of a single free block, which is searched for once.
+ * Returns -1 if no free block holds them all. */
+static int heap_bulk(size_t nbytes, size_t count, void **out) {
+	struct block *current;
+	size_t total, i;
+	char *addr;
+
+	if (freelist == NULL && mem_reserved == 0)
+		return -1;
+	if (count > SIZE_MAX / nbytes)
+		return -1;
+	total = nbytes * count;
+	if ((current = find_fit(total)) == NULL &&
+	    (grow(total) == -1 || (current = find_fit(total)) == NULL))
+		return -1;
+	addr = current->addr;
+	for (i = 0; i < count; i++) {
+		out[i] = addr + i * nbytes;
+		alloc_insert(new_block(out[i], nbytes));
+	}
+	rover = addr + total;
+	if (current->size == total) {
+		free_unlink(current);
+		free_node(current);
+	} else {
+		free_resize(current, addr + total, current->size - total);
+	}
+	return 0;
+}
+
+int smalloc_bulk(size_t nbytes, size_t count, void **out) {
+	struct sm_counters *c;
+	size_t i;
+
+	if (count == 0)
+		return 0;
+	if (nbytes == 0)
+		return -1;
+	if (aligned)
+		nbytes = (nbytes + 15) & ~15UL;
+	//the other layouts, and sizes the slabs take, have no search to save
+	if (!threaded && theap == NULL && policy != SM_BUDDY && !(slabs && nbytes - 1 < SLAB_MAX) &&
+	    heap_bulk(nbytes, count, out) == 0) {
+		c = my_counters();
+		for (i = 0; i < count; i++)
+			count_alloc(c, nbytes);
+		return 0;
+	}
+	//one at a time, also when no free block holds them all together
+	for (i = 0; i < count; i++) {
+		if ((out[i] = smalloc(nbytes)) == NULL) {
+			while (i > 0)
+				sfree(out[--i]);
+			return -1;
+		}
+	}
 	return 0;
 }
 
+static int addr_cmp(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(void *const *)a, y = (uintptr_t)*(void *const *)b;
+	return (x > y) - (x < y);
+}
+
+/* Returns the free block right before addr, walking freelist forward from
+ * pre, a free block before addr, if that takes only a few steps. Else, or
+ * if pre is NULL, it is looked up in the address treap. */
+static struct block *pred_from(struct block *pre, void *addr) {
+	int steps;
+
+	if (pre == NULL)
+		return tree_pred(addr);
+	for (steps = 0; pre->next != NULL && (char *)pre->next->addr < (char *)addr; steps++) {
+		if (steps == 8)
+			return tree_pred(addr);
+		pre = pre->next;
+	}
+	return pre;
+}
+
+int sfree_bulk(void **ptrs, size_t count) {
+	struct sm_counters *c = my_counters();
+	struct block *pre = NULL, *freed;
+	size_t i, size;
+	int result = 0, r;
+
+	if (threaded || theap != NULL || policy == SM_BUDDY) {
+		for (i = 0; i < count; i++)
+			result |= sfree(ptrs[i]);
+		return result;
+	}
+	//in address order, the free block before each address is at most a
+	//few steps past the one the previous address was merged into, so the
+	//free list is walked once instead of searched for every block
+	qsort(ptrs, count, sizeof(void *), addr_cmp);
+	for (i = 0; i < count; i++) {
+		if (slabs) {
+			if ((r = slab_free(ptrs[i], &size)) != 1) {
+				if (r == 0)
+					count_free(c, size);
+				result |= r;
+				continue;
+			}
+		}
+		if ((freed = alloc_remove(ptrs[i])) == NULL) {
+			result = -1;
+			continue;
+		}
+		size = freed->size;
+		count_free(c, size);
+		pre = link_freed(pred_from(pre, ptrs[i]), freed);
+		if (mem_reserved != 0) {
+			//may give the block back to the OS
+			release(pre, ptrs[i], size);
+			pre = NULL;
+		}
+	}
+	return result;
+}
+
+
+struct arena_pos arena_mark(void) {
+	struct arena_pos mark = { arena_cur, arena_used };
+	return mark;
+}
+
+/* Bumps arena_used in the current chunk, moving on to the next chunk (a
+ * spare, or a new one) when nbytes does not fit */
+void *arena_alloc(size_t nbytes) {
+	struct arena_chunk *next;
+	size_t size;
+
+	if (nbytes == 0)
+		return NULL;
+	nbytes = (nbytes + 15) & ~15UL;
+	if (arena_cur != NULL && nbytes <= arena_cur->size - arena_used) {
+		arena_used += nbytes;
+		return (char *)arena_cur + ARENA_HDR + arena_used - nbytes;
+	}
+	next = arena_cur != NULL ? arena_cur->next : arena_first;
+	if (next == NULL || next->size < nbytes) {
+		//a new chunk goes in before the spare that is too small
+		size = nbytes > ARENA_CHUNK ? nbytes : ARENA_CHUNK;
+		if (size > (size_t)-1 - ARENA_HDR || (next = smalloc(ARENA_HDR + size)) == NULL)
+			return NULL;
+		next->size = size;
+		if (arena_cur != NULL) {
+			next->next = arena_cur->next;
+			arena_cur->next = next;
+		} else {
+			next->next = arena_first;
+			arena_first = next;
+		}
+	}
+	arena_cur = next;
+	arena_used = nbytes;
+	return (char *)next + ARENA_HDR;
+}
+
+void arena_release(struct arena_pos mark) {
+	arena_cur = mark.chunk;
+	arena_used = mark.used;
+}
 
 /* Initialize the memory space used by smalloc,
  * freelist, and allocated_list
@@ -178,40 +1382,383 @@ int merge(struct block *preceeding){
  *         descriptor argument is set to -1
  * - 0: only used if the address space is associated with a file.
  */
-void mem_init(int size) {
-    mem = mmap(NULL, size,  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+void mem_init(size_t size) {
+    if (mem_init_ex(size, NULL) == -1)
+        exit(1);
+}
+
+/* Returns the number of arenas to use for SM_THREADS: n, or one per CPU
+ * this process may run on if n is 0 */
+static int arena_count(int n) {
+    cpu_set_t cpus;
+    if (n != 0)
+        return n;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+        return 1;
+    n = CPU_COUNT(&cpus);
+    return n > 64 ? 64 : n;
+}
+
+/* Same as mem_init, but lets the caller pick the allocator options.
+ * A NULL opts gives the mem_init defaults (first fit, list layout).
+ * Returns 0 on success, and -1 if the options are invalid or the
+ * region cannot be mapped.
+ */
+int mem_init_ex(size_t size, const struct smalloc_opts *opts) {
+    int i, fresh = 1;
+    int new_policy = opts ? opts->policy : SM_FIRST_FIT;
+    int flags = opts ? opts->flags : 0;
+    if (new_policy < SM_FIRST_FIT || new_policy > SM_BUDDY) {
+        fprintf(stderr, "mem_init_ex: unknown placement policy %d\n", new_policy);
+        return -1;
+    }
+    if (flags & SM_PERSIST)
+        flags |= SM_SHARED;
+    if (flags & (SM_THREADS | SM_SHARED))
+        flags |= SM_TAGGED;
+    if ((flags & SM_TAGGED) && (new_policy == SM_NEXT_FIT || new_policy == SM_BUDDY)) {
+        fprintf(stderr, "mem_init_ex: policy %d needs the list layout\n", new_policy);
+        return -1;
+    }
+    if ((flags & (SM_GROW | SM_SLAB)) && (flags & SM_THREADS)) {
+        fprintf(stderr, "mem_init_ex: SM_GROW and SM_SLAB do not work with SM_THREADS\n");
+        return -1;
+    }
+    if ((flags & SM_SHARED) && (flags & (SM_THREADS | SM_GROW | SM_SLAB))) {
+        fprintf(stderr, "mem_init_ex: SM_SHARED does not work with SM_THREADS, SM_GROW or SM_SLAB\n");
+        return -1;
+    }
+    if (size == 0) {
+        fprintf(stderr, "mem_init_ex: invalid size %zu\n", size);
+        return -1;
+    }
+    map_flags = flags & (SM_HUGEPAGE | SM_POPULATE | SM_NUMA_LOCAL);
+    grow_chunk = (flags & SM_HUGEPAGE) ? SM_HUGE_PAGE : SM_GROW_CHUNK;
+    if (flags & SM_GROW) {
+        //the heap may grow in place up to mem_reserved bytes
+        size = (size + SM_PAGE - 1) & ~(SM_PAGE - 1);
+        mem_reserved = opts->max_size ? opts->max_size : SM_GROW_MAX;
+        mem_reserved = (mem_reserved + SM_PAGE - 1) & ~(SM_PAGE - 1);
+        if (mem_reserved < size)
+            mem_reserved = size;
+        trim_threshold = opts->trim_threshold ? opts->trim_threshold : SM_TRIM_THRESHOLD;
+    } else {
+        mem_reserved = 0;
+    }
+    shared = persistent = recovered = 0;
+    shared_fd = -1;
+    if (flags & SM_PERSIST)
+        mem = map_file(opts->path, &size, &fresh);
+    else if (flags & SM_SHARED)
+        mem = map_shared(size);
+    else
+        mem = map_region(size, mem_reserved);
     if(mem == MAP_FAILED) {
-         perror("mmap");
-         exit(1);
+         if (!(flags & SM_PERSIST)) //map_file says what went wrong
+             perror("mmap");
+         return -1;
+    }
+    map_advise(mem, size);
+    policy = new_policy;
+    memset(&counters, 0, sizeof(counters));
+    arena_first = arena_cur = NULL;
+    arena_used = 0;
+    mem_size = size;
+    mem_initial = size;
+    allocated_list = NULL;
+    freelist = NULL;
+    threaded = 0;
+    aligned = (flags & SM_ALIGNED) != 0;
+    slabs = 0;
+    if ((flags & SM_SLAB) && slab_init(mem, mem_reserved ? mem_reserved : size,
+                                       (flags & SM_HUGEPAGE) ? SM_HUGE_PAGE : 0) == -1) {
+        fprintf(stderr, "Out of memory\n");
+        munmap(mem, mem_reserved ? mem_reserved : size);
+        return -1;
+    }
+    slabs = (flags & SM_SLAB) != 0;
+    if (flags & SM_THREADS) {
+        if (mt_init(mem, size, arena_count(opts->arenas), policy) == -1) {
+            fprintf(stderr, "mem_init_ex: %zu bytes is too small for the arenas\n", size);
+            munmap(mem, size);
+            return -1;
+        }
+        theap = NULL;
+        threaded = 1;
+        return 0;
+    }
+    if (flags & SM_TAGGED) {
+        //metadata lives in the region itself, no lists to set up
+        if (!fresh)
+            theap = tag_open(mem, size, &recovered);
+        else if ((theap = tag_init(mem, size, policy)) != NULL && (flags & SM_PERSIST))
+            theap = tag_open(mem, size, &recovered);
+        if (theap == NULL) {
+            if (fresh)
+                fprintf(stderr, "mem_init_ex: %zu bytes is too small for SM_TAGGED\n", size);
+            else
+                fprintf(stderr, "mem_init_ex: %s is not a heap, or is damaged\n", opts->path);
+            if (slabs)
+                slab_clean();
+            slabs = 0;
+            if (shared_fd != -1)
+                close(shared_fd);
+            shared_fd = -1;
+            munmap(mem, mem_reserved ? mem_reserved : size);
+            return -1;
+        }
+        if (mem_reserved != 0)
+            tag_set_trim(theap, trim_threshold);
+        if (flags & SM_SHARED) {
+            tag_share(theap);
+            shared = 1;
+            persistent = (flags & SM_PERSIST) != 0;
+        }
+        return 0;
     }
+    theap = NULL;
+    for (i = 0; i < NBINS; i++)
+        bins[i] = NULL;
+    for (i = 0; i < BINMAP_WORDS; i++)
+        binmap[i] = 0;
     //initialize data structures, use malloc
     allocated_list = NULL;
-    //initializes first block of freelist
-    freelist = malloc (sizeof(struct block));
-    if (freelist == NULL){ //check for failure of malloc
-    	fprintf(stderr, "Out of memory\n");
-        exit(1);
+    index_count = 0;
+    freelist = NULL;
+    free_root = NULL;
+    size_root = NULL;
+    free_count = free_bytes = 0;
+    rover = mem;
+    if (policy == SM_BUDDY) {
+        //carve the region into the largest blocks that are aligned to
+        //their size
+        buddy_end = 0;
+        buddy_carve(size);
+        return 0;
     }
-    freelist->addr = mem;
-    freelist->size = size;
-    freelist->next = NULL;   
+    //initializes first block of freelist
+    free_link(NULL, new_block(mem, size));
+    return 0;
 }
 
 void mem_clean(){
-	//free all the memory for blocks in allocated_list
-	struct block *temp;
-	while(allocated_list != NULL){
-		temp = allocated_list->next;
-		free(allocated_list);
-		allocated_list = temp;
-	}
-	//free all the memory for blocks in free_list
-	while(freelist != NULL){
-		temp = freelist->next;
-		free(freelist);
-		freelist = temp;
+	struct node_chunk *chunk;
+	int i;
+	//the arena chunks are in the region, so there is nothing to free
+	arena_first = arena_cur = NULL;
+	arena_used = 0;
+	if (slabs)
+		slab_clean();
+	slabs = 0;
+	if (theap != NULL || threaded) {
+		//all the metadata is in the region, so unmapping it frees everything
+		if (threaded)
+			mt_clean();
+		if (persistent) {
+			tag_close(theap);
+			msync(mem, mem_size, MS_SYNC);
+		}
+		munmap(mem, mem_reserved ? mem_reserved : mem_size);
+		if (shared_fd != -1)
+			close(shared_fd);
+		shared_fd = -1;
+		shared = persistent = 0;
+		theap = NULL;
+		threaded = 0;
+		mem = NULL;
+		return;
+	}
+	//the blocks of both lists are all in the node chunks
+	while (node_chunks != NULL) {
+		chunk = node_chunks->next;
+		free(node_chunks);
+		node_chunks = chunk;
 	}
+	chunk_used = NODE_CHUNK;
+	free_nodes = NULL;
+	allocated_list = NULL;
+	freelist = NULL;
+	for (i = 0; i < NBINS; i++)
+		bins[i] = NULL;
+	for (i = 0; i < BINMAP_WORDS; i++)
+		binmap[i] = 0;
+	free(alloc_index);
+	alloc_index = NULL;
+	index_cap = index_count = 0;
+	free_root = NULL;
+	free_count = free_bytes = 0;
+	size_root = NULL;
 	//No need to worry about mem memory. "The mem region is 
 	//automatically unmapped when the process is terminated."
+	//A growable heap can reserve far more than it uses, though.
+	if (mem_reserved != 0) {
+		munmap(mem, mem_reserved);
+		mem = NULL;
+	}
+}
+
+int mem_shared_fd(void) {
+	return shared ? shared_fd : -1;
+}
+
+int mem_attach(int fd) {
+	struct stat st;
+	struct tagheap *h;
+	void *p;
+
+	if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+		fprintf(stderr, "mem_attach: %d is not a shared heap\n", fd);
+		return -1;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if ((h = tag_attach(p, st.st_size)) == NULL || (shared_fd = dup(fd)) == -1) {
+		fprintf(stderr, "mem_attach: %d is not a shared heap\n", fd);
+		munmap(p, st.st_size);
+		return -1;
+	}
+	//the same state mem_init_ex leaves for an SM_SHARED heap
+	mem = p;
+	mem_size = mem_initial = st.st_size;
+	mem_reserved = 0;
+	map_flags = 0;
+	policy = SM_FIRST_FIT;
+	memset(&counters, 0, sizeof(counters));
+	arena_first = arena_cur = NULL;
+	arena_used = 0;
+	allocated_list = NULL;
+	freelist = NULL;
+	threaded = 0;
+	aligned = 0;
+	slabs = 0;
+	theap = h;
+	shared = 1;
+	persistent = recovered = 0;
+	return 0;
+}
+
+size_t mem_offset(void *addr) {
+	if (mem == NULL || (char *)addr < (char *)mem || (char *)addr >= (char *)mem + mem_size)
+		return (size_t)-1;
+	return (char *)addr - (char *)mem;
+}
+
+void *mem_at(size_t offset) {
+	if (mem == NULL || offset >= mem_size)
+		return NULL;
+	return (char *)mem + offset;
 }
 
+int mem_set_root(int i, void *addr) {
+	size_t off = addr != NULL ? mem_offset(addr) : 0;
+	if (!shared || i < 0 || i >= SM_ROOTS || off == (size_t)-1)
+		return -1;
+	__atomic_store_n(&tag_roots(theap)[i], off, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *mem_get_root(int i) {
+	size_t off;
+	if (!shared || i < 0 || i >= SM_ROOTS)
+		return NULL;
+	off = __atomic_load_n(&tag_roots(theap)[i], __ATOMIC_ACQUIRE);
+	return off != 0 ? mem_at(off) : NULL;
+}
+
+int mem_recovered(void) {
+	return recovered;
+}
+
+int mem_sync(void) {
+	if (!persistent)
+		return -1;
+	return msync(mem, mem_size, MS_SYNC);
+}
+
+/* Visitor state used by mem_walk to show slab objects instead of pages */
+struct slab_visit {
+	void (*visit)(void *addr, size_t size, void *arg);
+	void *arg;
+};
+
+static void visit_slabs(void *addr, size_t size, void *arg) {
+	struct slab_visit *v = arg;
+	if (!slab_walk(addr, v->visit, v->arg))
+		v->visit(addr, size, v->arg);
+}
+
+/* Calls visit(addr, size, arg) for every allocated block (which is
+ * SM_WALK_ALLOCATED) or free block (SM_WALK_FREE). With the list layout
+ * this is the order of allocated_list and freelist. */
+void mem_walk(int which, void (*visit)(void *addr, size_t size, void *arg), void *arg) {
+	struct block *cur;
+	struct slab_visit v = { visit, arg };
+	if (slabs && which == SM_WALK_ALLOCATED) {
+		//each allocated object in a slab page is a block of its own
+		visit = visit_slabs;
+		arg = &v;
+	}
+	if (threaded) {
+		mt_walk(which, visit, arg);
+		return;
+	}
+	if (theap != NULL) {
+		lock_heap();
+		tag_walk(theap, which, visit, arg);
+		unlock_heap();
+		return;
+	}
+	for (cur = which == SM_WALK_ALLOCATED ? allocated_list : freelist; cur != NULL; cur = cur->next)
+		visit(cur->addr, cur->size, arg);
+}
+
+void mem_stats(struct smalloc_stats *st) {
+	struct sm_counters c;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	if (threaded) {
+		mt_stats(&c, &st->free_blocks, &st->free_bytes, &st->largest_free);
+	} else {
+		c = counters;
+		if (theap != NULL) {
+			lock_heap();
+			tag_stats(theap, &st->free_blocks, &st->free_bytes, &st->largest_free);
+			unlock_heap();
+		} else {
+			st->free_blocks = free_count;
+			st->free_bytes = free_bytes;
+			st->largest_free = subtree_max(free_root);
+		}
+	}
+	st->bytes_in_use = c.bytes;
+	st->blocks_in_use = c.blocks;
+	st->peak_bytes = c.peak;
+	st->allocs = c.allocs;
+	st->frees = c.frees;
+	for (i = 0; i < SM_HIST_BUCKETS; i++)
+		st->histogram[i] = c.hist[i];
+	if (st->free_bytes != 0)
+		st->fragmentation = 1 - (double)st->largest_free / st->free_bytes;
+}
+
+int mem_stats_json(char *buf, size_t len) {
+	struct smalloc_stats st;
+	size_t n;
+	int i;
+
+	mem_stats(&st);
+	n = snprintf(buf, len, "{\"bytes_in_use\":%zu,\"blocks_in_use\":%zu,\"peak_bytes\":%zu,"
+	             "\"allocs\":%zu,\"frees\":%zu,\"free_blocks\":%zu,\"free_bytes\":%zu,"
+	             "\"largest_free\":%zu,\"fragmentation\":%.4f,\"histogram\":[",
+	             st.bytes_in_use, st.blocks_in_use, st.peak_bytes, st.allocs, st.frees,
+	             st.free_blocks, st.free_bytes, st.largest_free, st.fragmentation);
+	for (i = 0; i < SM_HIST_BUCKETS; i++)
+		n += snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, "%s%zu",
+		              i ? "," : "", st.histogram[i]);
+	n += snprintf(n < len ? buf + n : NULL, n < len ? len - n : 0, "]}");
+	return n;
+}
@@ -3,11 +3,105 @@
  * variables that would require memory to be allocated.
  */
 
+#include <stddef.h>
+
 
 struct block {
     void *addr; /*start address of memory for this block */
-    int size;
+    size_t size;
     struct block *next;
+    struct block *prev; /* previous block in freelist or allocated_list */
+    struct block *bin_next; /* size-class list links (SM_SEGREGATED_FIT) */
+    struct block *bin_prev;
+    struct block *left; /* address-ordered tree of free blocks */
+    struct block *right;
+    size_t max_size; /* largest block in this subtree */
+    struct block *sleft; /* size-ordered tree of free blocks (SM_BEST_FIT) */
+    struct block *sright;
+    unsigned int prio;
+};
+
+/* Placement policies for mem_init_ex */
+#define SM_FIRST_FIT 0 /* lowest-addressed block that fits (mem_init default) */
+#define SM_SEGREGATED_FIT 1 /* per-size-class free lists, O(1) for small sizes */
+#define SM_NEXT_FIT 2 /* first fit starting where the last allocation ended */
+#define SM_BEST_FIT 3 /* smallest block that fits */
+#define SM_BUDDY 4 /* binary buddy system: power-of-two blocks, sizes are
+                    * rounded up to a power of two of at least 16 */
+
+/* Flags for mem_init_ex */
+#define SM_TAGGED 0x1 /* keep block headers/footers inside the region itself
+                       * instead of malloc'd struct blocks. Free lists are
+                       * always segregated by size in this layout; first
+                       * fit takes the head of the first class that fits,
+                       * best fit searches that class. SM_NEXT_FIT and
+                       * SM_BUDDY need the list layout */
+#define SM_THREADS 0x2 /* smalloc and sfree may be called from any thread.
+                        * Implies SM_TAGGED: the region is split into
+                        * arenas, each with its own lock, and every thread
+                        * caches small free blocks of its own */
+#define SM_GROW 0x4 /* map more memory when the heap runs out instead of
+                     * failing, up to opts.max_size bytes, and give free
+                     * memory back to the OS once a free block reaches
+                     * opts.trim_threshold bytes. Not with SM_THREADS */
+#define SM_ALIGNED 0x8 /* round list layout sizes up to 16 bytes, so every
+                        * block is 16-byte aligned like in the other layouts */
+#define SM_SLAB 0x10 /* serve requests of up to 256 bytes from page-sized
+                      * slabs of equal objects. Not with SM_THREADS */
+#define SM_HUGEPAGE 0x20 /* back the region with huge pages: hugetlbfs pages
+                          * if the system has some set aside, else a huge
+                          * page aligned region with MADV_HUGEPAGE. With
+                          * SM_SLAB, slabs are carved from huge pages of
+                          * their own so small objects share few of them */
+#define SM_POPULATE 0x40 /* fault the whole region in at mem_init_ex (and
+                          * each extension with SM_GROW), instead of one
+                          * page at a time on first use */
+#define SM_NUMA_LOCAL 0x80 /* place the region's pages on the NUMA node of
+                            * the thread that first touches them (mbind
+                            * MPOL_LOCAL), where the kernel supports it */
+#define SM_SHARED 0x100 /* put the heap in shared memory (a memfd), so a
+                         * forked child and its parent allocate from and
+                         * free into the same heap, and other processes can
+                         * map it with mem_attach. Implies SM_TAGGED. Not
+                         * with SM_THREADS, SM_GROW or SM_SLAB */
+#define SM_PERSIST 0x200 /* like SM_SHARED, with the heap in the file at
+                          * opts->path. An empty file is made into a heap
+                          * of size bytes; an existing heap is reopened as
+                          * it was left, whatever size says. See
+                          * mem_set_root */
+
+/* Allocator options passed to mem_init_ex */
+struct smalloc_opts {
+    int policy; /* one of the SM_*_FIT placement policies */
+    int flags; /* SM_* flags */
+    int arenas; /* SM_THREADS: number of arenas, 0 for one per CPU */
+    size_t max_size; /* SM_GROW: largest heap size, 0 for 64 GiB */
+    size_t trim_threshold; /* SM_GROW: 0 for 128 KiB */
+    const char *path; /* SM_PERSIST: the heap file, created if missing */
+};
+
+/* Buckets of smalloc_stats.histogram: bucket 0 counts blocks of up to 16
+ * bytes, bucket i those of 2^(i+3)+1 to 2^(i+4) bytes, and the last one
+ * everything larger than 256 KiB */
+#define SM_HIST_BUCKETS 16
+
+/* Heap statistics filled in by mem_stats. Sizes are usable sizes: what
+ * smalloc_usable_size returns for a block, and what mem_walk reports. */
+struct smalloc_stats {
+    size_t bytes_in_use; /* in the blocks smalloc handed out */
+    size_t blocks_in_use;
+    size_t peak_bytes; /* highest bytes_in_use since mem_init_ex. With
+                        * SM_THREADS, the highest any mem_stats call saw */
+    size_t allocs; /* successful smalloc and smemalign calls, including
+                    * those made by srealloc to move a block */
+    size_t frees; /* successful sfree calls, likewise */
+    size_t free_blocks; /* blocks on the free lists */
+    size_t free_bytes;
+    size_t largest_free;
+    double fragmentation; /* 1 - largest_free / free_bytes: 0 when all free
+                           * memory is one block, close to 1 when it is
+                           * scattered in small pieces */
+    size_t histogram[SM_HIST_BUCKETS]; /* blocks in use, by size */
 };
 
 /****************************************************************************/
@@ -15,19 +109,134 @@ struct block {
 
 /* Allocates size bytes of memory for the dynamically allocated memory 
  * algorithm to use */
-void mem_init(int size);
+void mem_init(size_t size);
+
+/* Same as mem_init, with the allocator options in opts (NULL for the
+ * defaults). Returns 0 on success and -1 on failure */
+int mem_init_ex(size_t size, const struct smalloc_opts *opts);
 
 /* Reserves nbytes of space from the memory region created by mem_init.  Returns
  * a pointer to the reserved memory. Returns NULL if memory cannot be allocated */    
-void *smalloc(unsigned int nbytes);
+void *smalloc(size_t nbytes);
+
+/* Reserves nbytes at an address that is a multiple of alignment (a power
+ * of two). Returns NULL if memory cannot be allocated */
+void *smemalign(size_t alignment, size_t nbytes);
+
+/* Changes the size of the reserved space at addr to nbytes, growing or
+ * shrinking it in place when the memory after it allows, else moving it.
+ * Returns the new address, or NULL (leaving addr alone) on failure */
+void *srealloc(void *addr, size_t nbytes);
 
 /* Free the reserved space starting at addr.  Returns 0 if successful 
  * -1 if the address cannot be found in the list of allocated blocks */
 int sfree(void *addr);
 
-/* Free any dynamically used memory in the allocated and free list */
+/* Allocates count blocks of nbytes each into out. With the list layout
+ * they are carved one after another out of a single free block, found
+ * with one search. Returns 0 on success, and -1 if they cannot all be
+ * allocated, in which case none are */
+int smalloc_bulk(size_t nbytes, size_t count, void **out);
+
+/* Frees the count blocks in ptrs, which is sorted by address on the way,
+ * so with the list layout their neighbours are found and merged in one
+ * pass over the free list. Returns 0 if all were freed, -1 if any of them
+ * was not an allocated block (the others are still freed) */
+int sfree_bulk(void **ptrs, size_t count);
+
+/* Free any dynamically used memory in the allocated and free list. The
+ * list nodes are given back a chunk of them at a time, without walking
+ * either list */
 void mem_clean();
 
+/* Which blocks mem_walk visits */
+#define SM_WALK_ALLOCATED 0
+#define SM_WALK_FREE 1
+
+/* Calls visit(addr, size, arg) for each allocated or free block, in the
+ * order print_allocated and print_free list them */
+void mem_walk(int which, void (*visit)(void *addr, size_t size, void *arg), void *arg);
+
+/* Returns the number of bytes that fit in the allocated block at addr,
+ * which is at least what was asked for, or 0 if addr is not one */
+size_t smalloc_usable_size(void *addr);
+
+/* Fills in st. The counters are kept up to date by every call, and the
+ * free list figures come from the free block indexes, so this is cheap
+ * enough to call often. */
+void mem_stats(struct smalloc_stats *st);
+
+/* Writes the statistics to buf as a single-line JSON object. Returns the
+ * length of the whole object, like snprintf: if that is len or more, the
+ * output was cut short. */
+int mem_stats_json(char *buf, size_t len);
+
+
+/* SM_SHARED: returns the file descriptor of the shared heap, to pass to
+ * another process (over a Unix socket), or -1 if the heap is not shared.
+ * Every process sharing a heap keeps its own mem_stats counters; the free
+ * block figures are those of the whole heap. */
+int mem_shared_fd(void);
+
+/* Maps the shared heap behind fd, from mem_shared_fd in another process,
+ * and makes it the heap smalloc uses, as mem_init_ex would. fd is left
+ * open for the caller. Returns 0 on success and -1 if fd is not a heap. */
+int mem_attach(int fd);
+
+/* The heap may be mapped at a different address in each process sharing
+ * it, but a block is at the same offset from its start in all of them.
+ * mem_offset returns the offset of addr, or (size_t)-1 if addr is not in
+ * the heap, and mem_at turns an offset back into an address (NULL if it
+ * is out of range). */
+size_t mem_offset(void *addr);
+void *mem_at(size_t offset);
+
+/* Number of root slots in a shared or persistent heap */
+#define SM_ROOTS 16
+
+/* A shared or persistent heap keeps SM_ROOTS root pointers, as offsets, so
+ * a process that opens or attaches to it can find the objects in it. The
+ * objects must refer to each other by offset too (mem_offset, mem_at), as
+ * the heap may be mapped elsewhere next time. mem_set_root returns -1 if
+ * the heap is neither, i is out of range or addr is not in the heap;
+ * mem_get_root returns NULL if the root was never set. */
+int mem_set_root(int i, void *addr);
+void *mem_get_root(int i);
+
+/* SM_PERSIST: every smalloc, sfree and srealloc is all or nothing. If the
+ * process dies, the next mem_init_ex on the file undoes the one it was in
+ * the middle of, and mem_recovered then returns 1 (0 after a clean
+ * mem_clean). Blocks allocated but not yet reachable from a root are
+ * leaked; mem_walk finds them. A crash of the whole machine is only
+ * covered up to the last mem_sync, which writes the heap to the file (and
+ * returns -1 on failure): changes after it may reach the disk in any
+ * order. */
+int mem_recovered(void);
+int mem_sync(void);
+
+
+/* Position in the arena, as returned by arena_mark */
+struct arena_pos {
+    void *chunk;
+    size_t used;
+};
+
+/* The arena hands out memory for objects that are all freed together.
+ * arena_alloc bumps a pointer through chunks of the heap (of 64 KiB, or
+ * larger for a larger request), and arena_release frees everything
+ * allocated since arena_mark returned mark in O(1), however many objects
+ * that is. The chunks themselves are kept for the next arena_alloc calls,
+ * until mem_clean. Not thread-safe. */
+struct arena_pos arena_mark(void);
+
+/* Returns nbytes of 16-byte aligned memory from the arena, or NULL. The
+ * memory cannot be passed to sfree or srealloc. */
+void *arena_alloc(size_t nbytes);
+
+/* Frees everything arena_alloc returned since mark was taken. Marks taken
+ * after mark are no longer valid. */
+void arena_release(struct arena_pos mark);
+
 
 /****************************************************************************/
 /* Implemented in testhelpers.c */
@@ -0,0 +1,223 @@
+#ifndef _SMALLOC_INT_H
+#define _SMALLOC_INT_H
+
+/* Declarations shared between the smalloc source files. Not part of the
+ * public interface in smalloc.h. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size classes used by the segregated free lists of both layouts. Classes
+ * are 16 bytes wide below SMALL_LIMIT and a power of two wide above it.
+ * A bitmap with one bit per non-empty bin finds the first usable class
+ * without a scan. */
+#define SMALL_BINS 32
+#define SMALL_LIMIT (SMALL_BINS * 16)
+#define NBINS (SMALL_BINS + 64)
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+#define BINMAP_WORDS ((NBINS + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+/* SM_GROW: the heap is extended in multiples of SM_GROW_CHUNK bytes, inside
+ * a reserved range of opts->max_size bytes (SM_GROW_MAX if 0). Free memory
+ * past opts->trim_threshold (SM_TRIM_THRESHOLD if 0) goes back to the OS. */
+#define SM_PAGE 4096UL
+#define SM_GROW_CHUNK (1UL << 20)
+#define SM_GROW_MAX (1UL << 36)
+#define SM_TRIM_THRESHOLD (128UL * 1024)
+
+/* SM_HUGEPAGE: huge page size (x86-64), the alignment of the region and
+ * the unit the heap grows by */
+#define SM_HUGE_PAGE (2UL << 20)
+
+/* Returns the index of the bin that holds free blocks of the given size */
+static inline int bin_index(unsigned long size) {
+	if (size < SMALL_LIMIT)
+		return size / 16;
+	//floor(log2(size)) is at least 9 here
+	return SMALL_BINS + (BITS_PER_WORD - 1 - __builtin_clzl(size)) - 9;
+}
+
+/* Returns the smallest block size that can be stored in bin i */
+static inline unsigned long bin_floor(int i) {
+	if (i < SMALL_BINS)
+		return i * 16;
+	return 1UL << (i - SMALL_BINS + 9);
+}
+
+/* Returns the first bin whose every block is at least nbytes long */
+static inline int bin_fit_index(unsigned long nbytes) {
+	int i = bin_index(nbytes);
+	return bin_floor(i) < nbytes ? i + 1 : i;
+}
+
+/* Returns the first bin at or after bin i that has its bit set in map, or -1 */
+static inline int bin_next_nonempty(const unsigned long *map, int i) {
+	int w = i / BITS_PER_WORD;
+	unsigned long word;
+	if (i >= NBINS)
+		return -1;
+	word = map[w] & (~0UL << (i % BITS_PER_WORD));
+	while (word == 0) {
+		if (++w == BINMAP_WORDS)
+			return -1;
+		word = map[w];
+	}
+	return w * BITS_PER_WORD + __builtin_ctzl(word);
+}
+
+/* Counters behind mem_stats. Each one is only ever changed by one thread
+ * (with SM_THREADS every thread has its own set), but may be read by
+ * another, hence the relaxed atomics: plain moves on x86-64. Counts may
+ * go below zero per thread, when blocks are freed by another thread. */
+struct sm_counters {
+	long bytes;
+	long blocks;
+	long peak;
+	long allocs;
+	long frees;
+	long hist[SM_HIST_BUCKETS];
+};
+
+static inline long counter_get(const long *c) {
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline void counter_add(long *c, long n) {
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Returns the smalloc_stats.histogram bucket for a block of size bytes */
+static inline int hist_bucket(size_t size) {
+	int i;
+	if (size <= 16)
+		return 0;
+	i = BITS_PER_WORD - 4 - __builtin_clzl(size - 1);
+	return i < SM_HIST_BUCKETS ? i : SM_HIST_BUCKETS - 1;
+}
+
+static inline void count_alloc(struct sm_counters *c, size_t size) {
+	counter_add(&c->bytes, size);
+	counter_add(&c->blocks, 1);
+	counter_add(&c->allocs, 1);
+	counter_add(&c->hist[hist_bucket(size)], 1);
+	if (c->bytes > c->peak)
+		counter_add(&c->peak, c->bytes - c->peak);
+}
+
+static inline void count_free(struct sm_counters *c, size_t size) {
+	counter_add(&c->bytes, -(long)size);
+	counter_add(&c->blocks, -1);
+	counter_add(&c->frees, 1);
+	counter_add(&c->hist[hist_bucket(size)], -1);
+}
+
+/****************************************************************************/
+/* Implemented in smalloc.c: smemalign and sfree without the counting, for
+ * memory the allocator uses itself (slab pages). Both set size to the
+ * usable size of the block. */
+
+void *heap_memalign(size_t alignment, size_t nbytes, size_t *size);
+int heap_free(void *addr, size_t *size);
+
+/****************************************************************************/
+/* Implemented in tagheap.c: the in-band boundary-tag layout (SM_TAGGED) */
+
+struct tagheap;
+
+/* Formats size bytes at region as an empty tagged heap using the given
+ * placement policy. Returns NULL if the region is too small to hold the
+ * heap header and one block. */
+struct tagheap *tag_init(void *region, unsigned long size, int policy);
+
+void *tag_malloc(struct tagheap *h, unsigned long nbytes);
+void *tag_memalign(struct tagheap *h, unsigned long alignment, unsigned long nbytes);
+
+/* Returns 0 on success, -1 if addr is not an allocated block of h */
+int tag_free(struct tagheap *h, void *addr);
+
+/* Returns 0 if the block at addr was resized in place, 1 if it cannot
+ * grow in place and -1 if addr is not an allocated block of h */
+int tag_resize(struct tagheap *h, void *addr, unsigned long nbytes);
+unsigned long tag_usable_size(struct tagheap *h, void *addr);
+
+/* Calls visit on every allocated (in address order) or free (in size-class
+ * order) block of h */
+void tag_walk(struct tagheap *h, int which,
+              void (*visit)(void *addr, size_t size, void *arg), void *arg);
+
+/* Used with SM_GROW; see tagheap.c */
+void tag_grow(struct tagheap *h, unsigned long size);
+unsigned long tag_trim(struct tagheap *h, unsigned long keep);
+void tag_set_trim(struct tagheap *h, unsigned long threshold);
+
+/* Adds the number and payload bytes of the free blocks of h to
+ * free_blocks and free_bytes, and raises largest to its largest payload */
+void tag_stats(struct tagheap *h, size_t *free_blocks, size_t *free_bytes, size_t *largest);
+
+/* Used with SM_SHARED and SM_PERSIST; see tagheap.c */
+void tag_share(struct tagheap *h);
+struct tagheap *tag_attach(void *region, unsigned long size);
+struct tagheap *tag_open(void *region, unsigned long size, int *recovered);
+void tag_commit(struct tagheap *h);
+void tag_close(struct tagheap *h);
+uint64_t *tag_roots(struct tagheap *h);
+
+/* Used by threads.c; see tagheap.c */
+unsigned long tag_claim(struct tagheap *h, void *addr);
+void tag_unclaim(struct tagheap *h, void *addr);
+void tag_push_remote(struct tagheap *h, void *addr);
+void tag_drain_remote(struct tagheap *h);
+void tag_lock(struct tagheap *h);
+void tag_unlock(struct tagheap *h);
+
+/****************************************************************************/
+/* Implemented in threads.c: arenas and thread caches (SM_THREADS) */
+
+/* Splits size bytes at region into narenas tagged heaps. Returns -1 if
+ * the slices are too small. */
+int mt_init(void *region, unsigned long size, int narenas, int policy);
+
+/* Like heap_malloc, heap_free and heap_memalign, these set size to the
+ * usable size of the block */
+void *mt_malloc(unsigned long nbytes, size_t *size);
+int mt_free(void *addr, size_t *size);
+void *mt_memalign(unsigned long alignment, unsigned long nbytes, size_t *size);
+int mt_resize(void *addr, unsigned long nbytes, unsigned long *old_size, unsigned long *new_size);
+unsigned long mt_usable_size(void *addr);
+
+/* The calling thread's counters */
+struct sm_counters *mt_counters(void);
+
+/* Sums the counters of every thread into c, and the free lists of every
+ * arena as tag_stats does */
+void mt_stats(struct sm_counters *c, size_t *free_blocks, size_t *free_bytes, size_t *largest);
+void mt_walk(int which, void (*visit)(void *addr, size_t size, void *arg), void *arg);
+void mt_clean(void);
+
+/****************************************************************************/
+/* Implemented in slab.c: small-object front end (SM_SLAB) */
+
+#define SLAB_MAX 256 /* largest request served from a slab */
+
+/* Sets up the page registry for size bytes at region, which is where the
+ * slab pages will come from. With a zone size other than 0, slab pages are
+ * carved from blocks of that size and alignment (huge pages). Returns -1
+ * if out of memory. */
+int slab_init(void *region, size_t size, size_t zone);
+/* Sets size to the object size of the class nbytes falls in */
+void *slab_alloc(size_t nbytes, size_t *size);
+
+/* Returns 0 on success, -1 if addr is in a slab but is not an allocated
+ * object, and 1 if addr is not in a slab at all. On success sets size to
+ * the object size. */
+int slab_free(void *addr, size_t *size);
+
+/* Returns the object size for an object in a slab, else 0 */
+size_t slab_usable_size(void *addr);
+
+/* Calls visit on each allocated object if page is a slab. Returns 1 if it
+ * was one, else 0. */
+int slab_walk(void *page, void (*visit)(void *addr, size_t size, void *arg), void *arg);
+void slab_clean(void);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "smalloc.h"
+
+
+#define SIZE (256 * 1024)
+#define COUNT 64
+#define THREADS 2
+
+/* Test for mem_stats and mem_stats_json.
+ * Test covers the following scenarios, for the list, tagged and slab
+ * layouts:
+ * - bytes and blocks in use, and the alloc and free counts, follow
+ *   smalloc, sfree and srealloc; the peak stays after the frees.
+ * - a failed sfree is not counted.
+ * - the free block count, free bytes and largest free block agree with
+ *   mem_walk.
+ * - fragmentation is 0 with one free block and goes up when the free
+ *   memory is scattered.
+ * - the size histogram puts blocks in the right buckets.
+ * - the JSON form, and its length when the buffer is too small.
+ * - with SM_THREADS, the counts of several threads add up.
+ */
+
+struct totals {
+    size_t blocks;
+    size_t bytes;
+    size_t largest;
+};
+
+static void count_block(void *addr, size_t size, void *arg) {
+    struct totals *t = arg;
+    t->blocks++;
+    t->bytes += size;
+    if (size > t->largest)
+        t->largest = size;
+}
+
+static int agrees_with_walk(void) {
+    struct smalloc_stats st;
+    struct totals t = {0, 0, 0};
+    mem_stats(&st);
+    mem_walk(SM_WALK_FREE, count_block, &t);
+    return st.free_blocks == t.blocks && st.free_bytes == t.bytes && st.largest_free == t.largest;
+}
+
+static void run(const char *name, int flags) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, flags };
+    struct smalloc_stats st;
+    char *ptrs[COUNT], *p, json[1024];
+    size_t used = 0;
+    int i, len;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    mem_stats(&st);
+    printf("%s: empty heap. Expected: 0 in use, 1 free block, fragmentation 0. Result: %zu in use, %zu free block, fragmentation %g\n",
+           name, st.bytes_in_use, st.free_blocks, st.fragmentation);
+
+    for (i = 0; i < COUNT; i++) {
+        ptrs[i] = smalloc(i % 2 ? 20 : 1000);
+        used += smalloc_usable_size(ptrs[i]);
+    }
+    mem_stats(&st);
+    printf("%s: %d blocks. Expected: %d blocks, %zu bytes, %d allocs. Result: %zu blocks, %zu bytes, %zu allocs\n",
+           name, COUNT, COUNT, used, COUNT, st.blocks_in_use, st.bytes_in_use, st.allocs);
+    printf("%s: Expected histogram: %d in bucket 1, %d in bucket 6. Result: %zu, %zu\n",
+           name, COUNT / 2, COUNT / 2, st.histogram[1], st.histogram[6]);
+
+    //free every other large block, so the free memory is in pieces
+    for (i = 0; i < COUNT; i += 4)
+        sfree(ptrs[i]);
+    printf("%s: freeing %p again. Expected: -1. Result: %d\n", name, ptrs[0], sfree(ptrs[0]));
+    mem_stats(&st);
+    printf("%s: Expected frees: %d. Result: %zu\n", name, COUNT / 4, st.frees);
+    printf("%s: Expected peak: %zu. Result: %zu\n", name, used, st.peak_bytes);
+    printf("%s: free lists agree with mem_walk. Expected: yes. Result: %s\n",
+           name, agrees_with_walk() ? "yes" : "no");
+    printf("%s: scattered free memory. Expected fragmentation above 0: yes. Result: %s\n",
+           name, st.fragmentation > 0 ? "yes" : "no");
+
+    //in place or moved, srealloc changes the bytes in use, not the blocks
+    used = st.bytes_in_use - smalloc_usable_size(ptrs[2]);
+    p = srealloc(ptrs[2], 400);
+    used += smalloc_usable_size(p);
+    mem_stats(&st);
+    printf("%s: shrinking to 400 bytes. Expected: %d blocks, %zu bytes. Result: %zu blocks, %zu bytes\n",
+           name, COUNT - COUNT / 4, used, st.blocks_in_use, st.bytes_in_use);
+    ptrs[2] = p;
+
+    for (i = 1; i < COUNT; i++) {
+        if (i % 4 != 0)
+            sfree(ptrs[i]);
+    }
+    mem_stats(&st);
+    printf("%s: all freed. Expected: 0 bytes, 0 blocks, fragmentation 0. Result: %zu bytes, %zu blocks, fragmentation %g\n",
+           name, st.bytes_in_use, st.blocks_in_use, st.fragmentation);
+    printf("%s: free lists agree with mem_walk. Expected: yes. Result: %s\n",
+           name, agrees_with_walk() ? "yes" : "no");
+
+    len = mem_stats_json(json, sizeof(json));
+    printf("%s: JSON has the histogram. Expected: yes. Result: %s\n", name,
+           len < (int)sizeof(json) && strstr(json, "\"histogram\":[0,") != NULL ? "yes" : "no");
+    printf("%s: JSON into 10 bytes. Expected length: %d. Result: %d\n",
+           name, len, mem_stats_json(json, 10));
+    mem_clean();
+}
+
+static void *churn(void *arg) {
+    char *ptrs[COUNT];
+    int i;
+    for (i = 0; i < COUNT; i++)
+        ptrs[i] = smalloc(100);
+    //leave half of them allocated
+    for (i = 0; i < COUNT / 2; i++)
+        sfree(ptrs[i]);
+    return NULL;
+}
+
+int main(void) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_THREADS, THREADS };
+    struct smalloc_stats st;
+    pthread_t threads[THREADS];
+    char json[1024];
+    int i;
+
+    run("list", 0);
+    run("tagged", SM_TAGGED);
+    run("slab", SM_SLAB);
+
+    if (mem_init_ex(4 * SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+    for (i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, churn, NULL);
+    for (i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    mem_stats(&st);
+    printf("threads: Expected: %d allocs, %d frees, %d blocks. Result: %zu allocs, %zu frees, %zu blocks\n",
+           THREADS * COUNT, THREADS * COUNT / 2, THREADS * COUNT / 2,
+           st.allocs, st.frees, st.blocks_in_use);
+    mem_stats_json(json, sizeof(json));
+    printf("threads: %s\n", json);
+    mem_clean();
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <time.h>
+#include "smalloc.h"
+
+
+#define SIZE (64 * 1024 * 1024)
+#define LIVE 100000
+#define OPS 400000
+
+/* Randomized test for smalloc and sfree with many live allocations.
+ * For every layout and policy, keeps up to LIVE blocks allocated while
+ * doing OPS random allocations and frees, then checks that:
+ * - srealloc kept the contents of the blocks it resized.
+ * - sfree succeeded for every live block, and failed with -1 for
+ *   addresses that are not (or no longer) allocated.
+ * - the free blocks never overlap, are in address order (list layout) and
+ *   no two of them are beside each other (they were all merged; buddies
+ *   only merge with their buddy, so this is not checked for SM_BUDDY).
+ * - freeing everything leaves the whole region as free space.
+ */
+
+/* What the walk over the free blocks checks */
+#define CHECK_NONE 0
+#define CHECK_ORDER 1 /* address order, no overlap */
+#define CHECK_MERGED 2 /* address order, and no two blocks beside each other */
+
+struct walk_state {
+    int check;
+    char *last_end;
+    long blocks;
+    long bytes;
+    int errors;
+};
+
+static void check_free_block(void *addr, size_t size, void *arg) {
+    struct walk_state *w = arg;
+    if (w->last_end != NULL && ((char *)addr < w->last_end ||
+        (w->check == CHECK_MERGED && (char *)addr == w->last_end)))
+        w->errors++; //out of order, overlapping or not merged
+    w->last_end = (char *)addr + size;
+    w->blocks++;
+    w->bytes += size;
+}
+
+static void count_block(void *addr, size_t size, void *arg) {
+    struct walk_state *w = arg;
+    w->blocks++;
+    w->bytes += size;
+}
+
+static void run(const char *name, struct smalloc_opts *opts, int check) {
+    static char *ptrs[LIVE];
+    int live = 0, i, errors = 0;
+    struct walk_state w = {check, NULL, 0, 0, 0};
+    clock_t start = clock();
+
+    if (mem_init_ex(SIZE, opts) == -1) {
+        printf("%s: mem_init_ex failed\n", name);
+        return;
+    }
+    srand(42);
+    for (i = 0; i < OPS; i++) {
+        if (live < LIVE && (live == 0 || rand() % 3 != 0)) {
+            //mostly small sizes with the odd large one
+            int size = rand() % 8 == 0 ? rand() % 4096 + 1 : rand() % 128 + 1;
+            if ((ptrs[live] = smalloc(size)) == NULL) {
+                errors++;
+                continue;
+            }
+            write_to_mem(size, ptrs[live], (char)i);
+            live++;
+        } else if (rand() % 4 == 0) {
+            //resize a block, which must keep its first byte
+            int j = rand() % live;
+            char first = ptrs[j][0];
+            char *p = srealloc(ptrs[j], rand() % 512 + 1);
+            if (p == NULL || p[0] != first)
+                errors++;
+            else
+                ptrs[j] = p;
+        } else {
+            int j = rand() % live;
+            if (sfree(ptrs[j]) != 0)
+                errors++;
+            //a second free of the same address must fail
+            if (sfree(ptrs[j]) != -1)
+                errors++;
+            ptrs[j] = ptrs[--live];
+        }
+    }
+    if (check != CHECK_NONE)
+        mem_walk(SM_WALK_FREE, check_free_block, &w);
+    errors += w.errors;
+
+    for (i = 0; i < live; i++) {
+        if (sfree(ptrs[i]) != 0)
+            errors++;
+    }
+    w.blocks = w.bytes = 0;
+    mem_walk(SM_WALK_ALLOCATED, count_block, &w);
+    printf("%s: %d ops in %.2fs, %d errors. Expected allocated blocks: 0. Result: %ld\n",
+           name, OPS, (double)(clock() - start) / CLOCKS_PER_SEC, errors, w.blocks);
+    w.blocks = w.bytes = 0;
+    mem_walk(SM_WALK_FREE, count_block, &w);
+    printf("%s: Expected free blocks: 1. Result: %ld\n", name, w.blocks);
+    mem_clean();
+}
+
+int main(void) {
+    struct smalloc_opts first_fit = { SM_FIRST_FIT, 0 };
+    struct smalloc_opts segregated = { SM_SEGREGATED_FIT, 0 };
+    struct smalloc_opts next_fit = { SM_NEXT_FIT, 0 };
+    struct smalloc_opts best_fit = { SM_BEST_FIT, 0 };
+    struct smalloc_opts buddy = { SM_BUDDY, 0 };
+    struct smalloc_opts aligned = { SM_FIRST_FIT, SM_ALIGNED };
+    struct smalloc_opts slab = { SM_FIRST_FIT, SM_SLAB };
+    struct smalloc_opts tagged = { SM_FIRST_FIT, SM_TAGGED };
+    struct smalloc_opts tagged_slab = { SM_FIRST_FIT, SM_TAGGED | SM_SLAB };
+    struct smalloc_opts tagged_best = { SM_BEST_FIT, SM_TAGGED };
+
+    run("first fit", &first_fit, CHECK_MERGED);
+    run("segregated fit", &segregated, CHECK_MERGED);
+    run("next fit", &next_fit, CHECK_MERGED);
+    run("best fit", &best_fit, CHECK_MERGED);
+    run("buddy", &buddy, CHECK_ORDER);
+    run("aligned first fit", &aligned, CHECK_MERGED);
+    run("slab first fit", &slab, CHECK_MERGED);
+    run("tagged", &tagged, CHECK_NONE);
+    run("tagged slab", &tagged_slab, CHECK_NONE);
+    run("tagged best fit", &tagged_best, CHECK_NONE);
+    return 0;
+}
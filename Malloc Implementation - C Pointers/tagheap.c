@@ -0,0 +1,690 @@
+/*
+ * In-band boundary-tag layout for smalloc (SM_TAGGED).
+ *
+ * All allocator metadata lives inside the mem_init region, so smalloc and
+ * sfree never call the system malloc. The region starts with a struct
+ * tagheap, followed by the blocks, and ends with a zero-sized allocated
+ * "epilogue" header that stops coalescing at the end of the heap.
+ *
+ * Every block starts with an 8-byte header holding its size (a multiple
+ * of 16, tags included), an ALLOC bit, a PREV_ALLOC bit describing the
+ * block physically before it, and a magic number used to reject unknown
+ * addresses in sfree. Free blocks also keep a copy of the header in their
+ * last 8 bytes (the footer) and the offsets of their neighbours in a
+ * size-class list right after the header:
+ *
+ *   allocated: [hdr][payload ...................]
+ *   free:      [hdr][next][prev][ ... ][footer]
+ *
+ * The footer of a free block sits right before the header of the next
+ * block, so sfree finds both physical neighbours in O(1). List links are
+ * offsets from the start of the heap, with 0 meaning "none".
+ *
+ * For SM_THREADS (threads.c) each arena is one tagged heap with its own
+ * lock. An allocated block that sits in a thread cache or on the arena's
+ * remote free stack has its CACHED bit set, so it cannot be freed twice.
+ * That bit and PREV_ALLOC can be changed by different threads, so those
+ * two are only ever updated atomically on allocated blocks.
+ *
+ * With SM_GROW the heap can be extended past its epilogue (tag_grow) and
+ * cut back when its last block is free and large (tag_trim). Whole pages
+ * inside a large free block are handed back with madvise when it is freed.
+ *
+ * Since nothing in the heap is a pointer, a heap in shared memory works
+ * wherever each process maps it (SM_SHARED). Its lock is then made
+ * process-shared and robust by tag_share.
+ *
+ * The same goes for a heap in a file (SM_PERSIST), which must also survive
+ * the process dying in the middle of an operation. tag_open turns on an
+ * undo log in the header: every word written before the next tag_commit
+ * (one smalloc or sfree) first has its old value saved there. The header
+ * is marked dirty while the heap is open. Opening a dirty heap undoes the
+ * interrupted operation, if any, and rebuilds the bins from the tags,
+ * which are all that is needed to find every block.
+ *
+ * A shared heap keeps the undo log too, since a process can die holding
+ * its lock. The next process to take the lock undoes the operation in the
+ * same way before going on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+#include "smalloc_int.h"
+
+#define TAGHEAP_MAGIC 0x736d616c6c6f6331ULL /* "smalloc1" */
+
+#define TAG_ALLOC 1ULL
+#define TAG_PREV_ALLOC 2ULL
+#define TAG_CACHED 4ULL
+#define TAG_MAGIC (0x5a11ULL << 48)
+#define TAG_MAGIC_MASK (0xffffULL << 48)
+#define TAG_SIZE_MASK (~TAG_MAGIC_MASK & ~15ULL)
+
+#define MIN_BLOCK 32 /* header, two links and footer */
+#define TAG_LOG 32 /* undo log entries, enough for the largest operation */
+
+struct tagheap {
+	uint64_t magic;
+	uint64_t size; /* bytes in the region, this header included */
+	uint64_t first; /* offset of the header of the first block */
+	uint64_t policy; /* SM_FIRST_FIT, SM_SEGREGATED_FIT or SM_BEST_FIT */
+	uint64_t bins[NBINS]; /* first free block of each size class */
+	unsigned long binmap[BINMAP_WORDS];
+	pthread_mutex_t lock; /* taken by threads.c around every operation */
+	uint64_t remote; /* blocks freed by other threads, linked through
+	                  * their first payload word */
+	uint64_t trim; /* free blocks this large give their pages back, 0 never */
+	uint64_t nfree; /* blocks in the bins, and their size, for tag_stats */
+	uint64_t free_size;
+	uint64_t roots[SM_ROOTS]; /* offsets, for mem_set_root */
+	uint64_t dirty; /* SM_PERSIST: open, and not closed by tag_close */
+	uint64_t logging; /* SM_SHARED, SM_PERSIST: save old values in log */
+	uint64_t nlog;
+	struct {
+		uint64_t off;
+		uint64_t old;
+	} log[TAG_LOG];
+};
+
+/* Tags are read and written as relaxed atomics (plain moves on x86-64):
+ * with SM_THREADS, sfree from another thread reads a block's tags while the
+ * owning arena may be updating the PREV_ALLOC bit or its neighbour. */
+static inline uint64_t get(struct tagheap *h, uint64_t off) {
+	return __atomic_load_n((uint64_t *)((char *)h + off), __ATOMIC_RELAXED);
+}
+
+/* Saves the word at off in the undo log before it is changed. A process
+ * that dies stops at some instruction with all the stores before it done,
+ * so only the compiler's ordering of the stores matters here. */
+static void log_old(struct tagheap *h, uint64_t off) {
+	uint64_t n = h->nlog;
+	if (n == TAG_LOG) {
+		fprintf(stderr, "smalloc: undo log overflow\n");
+		abort();
+	}
+	h->log[n].off = off;
+	h->log[n].old = *(uint64_t *)((char *)h + off);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	h->nlog = n + 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void put(struct tagheap *h, uint64_t off, uint64_t value) {
+	if (h->logging)
+		log_old(h, off);
+	__atomic_store_n((uint64_t *)((char *)h + off), value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t tag_size(uint64_t tag) {
+	return tag & TAG_SIZE_MASK;
+}
+
+/* Atomically sets or clears flag bits in the header of an allocated block */
+static inline uint64_t tag_or(struct tagheap *h, uint64_t off, uint64_t bits) {
+	if (h->logging)
+		log_old(h, off);
+	return __atomic_fetch_or((uint64_t *)((char *)h + off), bits, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t tag_and(struct tagheap *h, uint64_t off, uint64_t bits) {
+	if (h->logging)
+		log_old(h, off);
+	return __atomic_fetch_and((uint64_t *)((char *)h + off), bits, __ATOMIC_RELAXED);
+}
+
+/* Writes the header and footer of a free block. The block before a free
+ * block is always allocated, since neighbours are coalesced eagerly. */
+static void set_free(struct tagheap *h, uint64_t off, uint64_t size) {
+	put(h, off, TAG_MAGIC | size | TAG_PREV_ALLOC);
+	put(h, off + size - 8, TAG_MAGIC | size | TAG_PREV_ALLOC);
+}
+
+static void bin_push(struct tagheap *h, uint64_t off, uint64_t size) {
+	int i = bin_index(size);
+	put(h, off + 8, h->bins[i]);
+	put(h, off + 16, 0);
+	if (h->bins[i] != 0)
+		put(h, h->bins[i] + 16, off);
+	h->bins[i] = off;
+	h->binmap[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+	h->nfree++;
+	h->free_size += size;
+}
+
+static void bin_unlink(struct tagheap *h, uint64_t off, uint64_t size) {
+	int i = bin_index(size);
+	uint64_t next = get(h, off + 8);
+	uint64_t prev = get(h, off + 16);
+	if (prev != 0)
+		put(h, prev + 8, next);
+	else
+		h->bins[i] = next;
+	if (next != 0)
+		put(h, next + 16, prev);
+	if (h->bins[i] == 0)
+		h->binmap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+	h->nfree--;
+	h->free_size -= size;
+}
+
+struct tagheap *tag_init(void *region, unsigned long size, int policy) {
+	struct tagheap *h = region;
+	uint64_t first = ((sizeof(struct tagheap) + 15) & ~15UL) + 8;
+	int i;
+
+	size &= ~15UL;
+	if (size < first + MIN_BLOCK + 8)
+		return NULL;
+	h->magic = 0;
+	h->size = size;
+	h->first = first;
+	h->policy = policy;
+	h->remote = 0;
+	h->trim = 0;
+	h->nfree = 0;
+	h->free_size = 0;
+	h->dirty = 0;
+	h->logging = 0;
+	h->nlog = 0;
+	pthread_mutex_init(&h->lock, NULL);
+	for (i = 0; i < NBINS; i++)
+		h->bins[i] = 0;
+	for (i = 0; i < BINMAP_WORDS; i++)
+		h->binmap[i] = 0;
+	for (i = 0; i < SM_ROOTS; i++)
+		h->roots[i] = 0;
+	//one free block spanning the heap, then the epilogue
+	set_free(h, first, size - 8 - first);
+	bin_push(h, first, size - 8 - first);
+	put(h, size - 8, TAG_MAGIC | TAG_ALLOC);
+	//last, so a heap file is not taken for a heap until it is one
+	__atomic_store_n(&h->magic, TAGHEAP_MAGIC, __ATOMIC_RELEASE);
+	return h;
+}
+
+/* Puts every free block of h back in the bins, walking the blocks from the
+ * first to the epilogue. Returns -1 if the tags do not add up. */
+static int rebuild(struct tagheap *h) {
+	uint64_t off, tag, size;
+	int i;
+
+	h->nfree = 0;
+	h->free_size = 0;
+	h->remote = 0;
+	for (i = 0; i < NBINS; i++)
+		h->bins[i] = 0;
+	for (i = 0; i < BINMAP_WORDS; i++)
+		h->binmap[i] = 0;
+	for (off = h->first; off < h->size - 8; off += size) {
+		tag = get(h, off);
+		size = tag_size(tag);
+		if ((tag & TAG_MAGIC_MASK) != TAG_MAGIC || size < MIN_BLOCK || size > h->size - 8 - off)
+			return -1;
+		if (!(tag & TAG_ALLOC))
+			bin_push(h, off, size);
+	}
+	tag = get(h, off);
+	return off == h->size - 8 && (tag & ~TAG_PREV_ALLOC) == (TAG_MAGIC | TAG_ALLOC) ? 0 : -1;
+}
+
+/* Undoes the operation whose old values are in the log, if any, and
+ * rebuilds the bins, which it may have left half changed. Logging is off
+ * afterwards. Returns -1 if the tags do not add up. */
+static int undo(struct tagheap *h) {
+	uint64_t n;
+
+	//in reverse, so a word written twice gets its first old value
+	for (n = h->nlog; n > 0; n--)
+		*(uint64_t *)((char *)h + h->log[n - 1].off) = h->log[n - 1].old;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	h->nlog = 0;
+	h->logging = 0;
+	return rebuild(h);
+}
+
+/* Opens the heap in the file mapped at region for SM_PERSIST and turns on
+ * the undo log. If it was not closed with tag_close, the last operation is
+ * undone and the bins rebuilt, and recovered is set to 1. Returns NULL if
+ * there is no heap in size bytes at region, or it is damaged. */
+struct tagheap *tag_open(void *region, unsigned long size, int *recovered) {
+	struct tagheap *h = tag_attach(region, size);
+
+	*recovered = 0;
+	if (h == NULL)
+		return NULL;
+	if (h->dirty) {
+		if (undo(h) == -1)
+			return NULL;
+		*recovered = 1;
+	}
+	h->nlog = 0;
+	h->dirty = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	h->logging = 1;
+	return h;
+}
+
+/* Ends an operation: what it wrote can no longer be undone */
+void tag_commit(struct tagheap *h) {
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	h->nlog = 0;
+}
+
+/* Marks h as closed cleanly, after its last operation */
+void tag_close(struct tagheap *h) {
+	h->logging = 0;
+	h->dirty = 0;
+}
+
+uint64_t *tag_roots(struct tagheap *h) {
+	return h->roots;
+}
+
+/* Makes the lock of h work across the processes mapping it, and turns on
+ * the undo log. The lock is robust: if a process dies holding it, the next
+ * one to take it gets it anyway (see tag_lock). */
+void tag_share(struct tagheap *h) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_destroy(&h->lock);
+	pthread_mutex_init(&h->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	h->nlog = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	h->logging = 1;
+}
+
+/* Returns the heap tag_init set up at region, which another process may
+ * have mapped elsewhere, or NULL if there is none in size bytes */
+struct tagheap *tag_attach(void *region, unsigned long size) {
+	struct tagheap *h = region;
+	if (size < sizeof(struct tagheap) || h->magic != TAGHEAP_MAGIC || h->size > size)
+		return NULL;
+	return h;
+}
+
+/* Best fit: classes are ordered by size, so the smallest block that fits
+ * is in the first class holding any block that fits. Returns 0 if none. */
+static uint64_t best_fit(struct tagheap *h, uint64_t asize) {
+	uint64_t off, size, best, best_size;
+	int i;
+
+	for (i = bin_index(asize); i >= 0; i = bin_next_nonempty(h->binmap, i + 1)) {
+		best = 0;
+		best_size = 0;
+		for (off = h->bins[i]; off != 0; off = get(h, off + 8)) {
+			size = tag_size(get(h, off));
+			if (size >= asize && (best == 0 || size < best_size)) {
+				best = off;
+				best_size = size;
+				if (size == asize)
+					break;
+			}
+		}
+		if (best != 0)
+			return best;
+	}
+	return 0;
+}
+
+/* Returns the offset of a free block of at least asize bytes, or 0.
+ * Same segregated fit as the list layout: the head of the first class
+ * that is guaranteed to fit, else a search of asize's own class. */
+static uint64_t find_fit(struct tagheap *h, uint64_t asize) {
+	int i;
+	uint64_t off;
+	if (h->policy == SM_BEST_FIT)
+		return best_fit(h, asize);
+	if ((i = bin_next_nonempty(h->binmap, bin_fit_index(asize))) >= 0)
+		return h->bins[i];
+	for (off = h->bins[bin_index(asize)]; off != 0; off = get(h, off + 8)) {
+		if (tag_size(get(h, off)) >= asize)
+			return off;
+	}
+	return 0;
+}
+
+/* Returns the size of the block, tags included, that holds nbytes: room
+ * for the header, rounded so the next payload stays 16-byte aligned */
+static uint64_t block_size(unsigned long nbytes) {
+	uint64_t asize = (nbytes + 8 + 15) & ~15UL;
+	return asize < MIN_BLOCK ? MIN_BLOCK : asize;
+}
+
+/* Allocates the first asize bytes of the free block of size bytes at off,
+ * which is already out of its bin. prev is the block's PREV_ALLOC bit. */
+static void *take(struct tagheap *h, uint64_t off, uint64_t size, uint64_t asize,
+                  uint64_t prev) {
+	uint64_t rest = size - asize;
+	if (rest >= MIN_BLOCK) {
+		//split: the remainder stays free, so the next block's PREV_ALLOC
+		//bit is already clear
+		put(h, off, TAG_MAGIC | asize | TAG_ALLOC | prev);
+		set_free(h, off + asize, rest);
+		bin_push(h, off + asize, rest);
+	} else {
+		put(h, off, TAG_MAGIC | size | TAG_ALLOC | prev);
+		tag_or(h, off + size, TAG_PREV_ALLOC);
+	}
+	return (char *)h + off + 8;
+}
+
+void *tag_malloc(struct tagheap *h, unsigned long nbytes) {
+	uint64_t asize, off, size;
+
+	if (nbytes == 0 || nbytes > h->size)
+		return NULL;
+	asize = block_size(nbytes);
+	if ((off = find_fit(h, asize)) == 0)
+		return NULL;
+	size = tag_size(get(h, off));
+	bin_unlink(h, off, size);
+	return take(h, off, size, asize, TAG_PREV_ALLOC);
+}
+
+/* Like tag_malloc, with the payload aligned to alignment (a power of two).
+ * The part of the free block before the aligned payload stays free, so a
+ * block of alignment + MIN_BLOCK extra bytes is searched for. */
+void *tag_memalign(struct tagheap *h, unsigned long alignment, unsigned long nbytes) {
+	uint64_t asize, off, size, lead;
+
+	if (alignment <= 16)
+		return tag_malloc(h, nbytes);
+	if (nbytes == 0 || nbytes > h->size || alignment > h->size)
+		return NULL;
+	asize = block_size(nbytes);
+	if ((off = find_fit(h, asize + alignment + MIN_BLOCK)) == 0)
+		return NULL;
+	size = tag_size(get(h, off));
+	bin_unlink(h, off, size);
+	lead = -((uintptr_t)h + off + 8) & (alignment - 1);
+	if (lead == 0)
+		return take(h, off, size, asize, TAG_PREV_ALLOC);
+	//the leading fragment must be big enough to be a free block
+	if (lead < MIN_BLOCK)
+		lead += alignment;
+	set_free(h, off, lead);
+	bin_push(h, off, lead);
+	return take(h, off + lead, size - lead, asize, 0);
+}
+
+/* Returns the header offset of the allocated block whose payload starts
+ * at addr, or 0 if addr is not one. Checks the tags of the block and of
+ * the one after it, so stray pointers are rejected instead of corrupting
+ * the heap. */
+static uint64_t lookup(struct tagheap *h, void *addr) {
+	uint64_t off, tag, size, next;
+
+	if ((char *)addr < (char *)h + h->first + 8 || (char *)addr >= (char *)h + h->size)
+		return 0;
+	off = (char *)addr - (char *)h - 8;
+	if ((off & 15) != 8)
+		return 0;
+	tag = get(h, off);
+	size = tag_size(tag);
+	if ((tag & TAG_MAGIC_MASK) != TAG_MAGIC || !(tag & TAG_ALLOC) || (tag & TAG_CACHED) ||
+	    size < MIN_BLOCK || size > h->size - 8 - off)
+		return 0;
+	next = get(h, off + size);
+	if ((next & TAG_MAGIC_MASK) != TAG_MAGIC || !(next & TAG_PREV_ALLOC))
+		return 0;
+	return off;
+}
+
+/* Gives the whole pages of [lo, hi) that lie inside the free block at off
+ * back to the OS. Its header, links and footer stay mapped. */
+static void release_pages(struct tagheap *h, uint64_t off, uint64_t size,
+                          uint64_t lo, uint64_t hi) {
+	if (lo < off + 24)
+		lo = off + 24;
+	if (hi > off + size - 8)
+		hi = off + size - 8;
+	lo = (lo + SM_PAGE - 1) & ~(SM_PAGE - 1);
+	hi &= ~(SM_PAGE - 1);
+	if (hi > lo)
+		madvise((char *)h + lo, hi - lo, MADV_DONTNEED);
+}
+
+int tag_free(struct tagheap *h, void *addr) {
+	uint64_t off, size, next_tag, prev_size, lo, hi;
+
+	if ((off = lookup(h, addr)) == 0)
+		return -1;
+	size = tag_size(get(h, off));
+	lo = off;
+	hi = off + size;
+
+	//coalesce with the block before, found through its footer. Headers
+	//that end up inside the merged block are wiped, so a second sfree of
+	//the same address cannot pass lookup()
+	if (!(get(h, off) & TAG_PREV_ALLOC)) {
+		prev_size = tag_size(get(h, off - 8));
+		put(h, off, 0);
+		off -= prev_size;
+		bin_unlink(h, off, prev_size);
+		size += prev_size;
+	}
+	//coalesce with the block after
+	next_tag = get(h, off + size);
+	if (!(next_tag & TAG_ALLOC)) {
+		bin_unlink(h, off + size, tag_size(next_tag));
+		put(h, off + size, 0);
+		size += tag_size(next_tag);
+	}
+	set_free(h, off, size);
+	bin_push(h, off, size);
+	tag_and(h, off + size, ~TAG_PREV_ALLOC);
+	if (h->trim != 0 && size >= h->trim)
+		release_pages(h, off, size, lo, hi);
+	return 0;
+}
+
+/* Resizes the allocated block at addr in place so it holds nbytes.
+ * Shrinking frees the tail of the block; growing takes the start of the
+ * free block right after it, as sfree would merge them. Returns 0 on
+ * success, 1 if the block cannot grow in place and -1 if addr is not an
+ * allocated block of h. */
+int tag_resize(struct tagheap *h, void *addr, unsigned long nbytes) {
+	uint64_t off, tag, size, asize, next, rest;
+
+	if ((off = lookup(h, addr)) == 0)
+		return -1;
+	tag = get(h, off);
+	size = tag_size(tag);
+	if (nbytes == 0 || nbytes > h->size)
+		return 1;
+	asize = block_size(nbytes);
+	if (asize <= size) {
+		if ((rest = size - asize) >= MIN_BLOCK) {
+			//make the tail a block of its own and free it, so it
+			//coalesces with the block after it
+			put(h, off, (tag & ~TAG_SIZE_MASK) | asize);
+			put(h, off + asize, TAG_MAGIC | rest | TAG_ALLOC | TAG_PREV_ALLOC);
+			tag_free(h, (char *)h + off + asize + 8);
+		}
+		return 0;
+	}
+	next = get(h, off + size);
+	if ((next & TAG_ALLOC) || size + tag_size(next) < asize)
+		return 1;
+	bin_unlink(h, off + size, tag_size(next));
+	put(h, off + size, 0);
+	size += tag_size(next);
+	if ((rest = size - asize) >= MIN_BLOCK) {
+		put(h, off, (tag & ~TAG_SIZE_MASK) | asize);
+		set_free(h, off + asize, rest);
+		bin_push(h, off + asize, rest);
+	} else {
+		put(h, off, (tag & ~TAG_SIZE_MASK) | size);
+		tag_or(h, off + size, TAG_PREV_ALLOC);
+	}
+	return 0;
+}
+
+/* Returns the payload size of the allocated block at addr, or 0 if addr is
+ * not an allocated block of h */
+unsigned long tag_usable_size(struct tagheap *h, void *addr) {
+	uint64_t off = lookup(h, addr);
+	return off != 0 ? tag_size(get(h, off)) - 8 : 0;
+}
+
+/* Extends h to size bytes. The memory up to size must already be mapped,
+ * and size must be at least MIN_BLOCK past the current end. The old
+ * epilogue becomes the header of a free block, merged with the last block
+ * if that one is free. */
+void tag_grow(struct tagheap *h, unsigned long size) {
+	uint64_t off = h->size - 8, bsize, prev_size;
+
+	size &= ~15UL;
+	bsize = size - h->size;
+	if (!(get(h, off) & TAG_PREV_ALLOC)) {
+		prev_size = tag_size(get(h, off - 8));
+		off -= prev_size;
+		bin_unlink(h, off, prev_size);
+		bsize += prev_size;
+	}
+	h->size = size;
+	set_free(h, off, bsize);
+	bin_push(h, off, bsize);
+	put(h, size - 8, TAG_MAGIC | TAG_ALLOC);
+}
+
+/* Cuts h back when its last block is free and at least h->trim bytes,
+ * to a page boundary but never below keep bytes. Returns the new size;
+ * the caller unmaps the memory past it. */
+unsigned long tag_trim(struct tagheap *h, unsigned long keep) {
+	uint64_t end = h->size - 8, off, size, new_size;
+
+	if (h->trim == 0 || (get(h, end) & TAG_PREV_ALLOC))
+		return h->size;
+	size = tag_size(get(h, end - 8));
+	if (size < h->trim)
+		return h->size;
+	off = end - size;
+	//keep room for the block's tags and the epilogue
+	new_size = (off + MIN_BLOCK + 8 + SM_PAGE - 1) & ~(SM_PAGE - 1);
+	if (new_size < keep)
+		new_size = keep;
+	if (new_size >= h->size)
+		return h->size;
+	bin_unlink(h, off, size);
+	size = new_size - 8 - off;
+	set_free(h, off, size);
+	bin_push(h, off, size);
+	put(h, new_size - 8, TAG_MAGIC | TAG_ALLOC);
+	h->size = new_size;
+	return new_size;
+}
+
+/* Free blocks of at least threshold bytes give their pages back to the OS,
+ * and tag_trim cuts the heap back once its last block is that large */
+void tag_set_trim(struct tagheap *h, unsigned long threshold) {
+	h->trim = threshold;
+}
+
+/* The largest free block is in the last non-empty bin, so only that bin
+ * is searched */
+void tag_stats(struct tagheap *h, size_t *free_blocks, size_t *free_bytes, size_t *largest) {
+	uint64_t off, size;
+	int w, i;
+
+	*free_blocks += h->nfree;
+	*free_bytes += h->free_size - 8 * h->nfree;
+	for (w = BINMAP_WORDS - 1; w >= 0 && h->binmap[w] == 0; w--)
+		;
+	if (w < 0)
+		return;
+	i = w * BITS_PER_WORD + BITS_PER_WORD - 1 - __builtin_clzl(h->binmap[w]);
+	for (off = h->bins[i]; off != 0; off = get(h, off + 8)) {
+		size = tag_size(get(h, off)) - 8;
+		if (size > *largest)
+			*largest = size;
+	}
+}
+
+/* Sets the CACHED bit of the allocated block at addr without taking the
+ * lock. Returns the size of the block, tags included, or 0 if addr is not
+ * an allocated block of h or is already cached. */
+unsigned long tag_claim(struct tagheap *h, void *addr) {
+	uint64_t off, tag;
+
+	if ((off = lookup(h, addr)) == 0)
+		return 0;
+	tag = tag_or(h, off, TAG_CACHED);
+	if (tag & TAG_CACHED) //lost a race with another sfree of addr
+		return 0;
+	return tag_size(tag);
+}
+
+/* Clears the CACHED bit, when a cached block is handed out again or is
+ * about to go back to the heap through tag_free */
+void tag_unclaim(struct tagheap *h, void *addr) {
+	tag_and(h, (char *)addr - (char *)h - 8, ~TAG_CACHED);
+}
+
+/* Pushes a claimed block on the remote free stack of h. Safe to call
+ * without the lock from any thread; the stack is only ever emptied as a
+ * whole, so there is no ABA problem. */
+void tag_push_remote(struct tagheap *h, void *addr) {
+	uint64_t off = (char *)addr - (char *)h;
+	uint64_t head = __atomic_load_n(&h->remote, __ATOMIC_RELAXED);
+	do {
+		*(uint64_t *)addr = head;
+	} while (!__atomic_compare_exchange_n(&h->remote, &head, off, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Frees every block on the remote free stack. Called with the lock held. */
+void tag_drain_remote(struct tagheap *h) {
+	uint64_t off = __atomic_exchange_n(&h->remote, 0, __ATOMIC_ACQUIRE);
+	uint64_t next;
+	while (off != 0) {
+		next = get(h, off);
+		tag_unclaim(h, (char *)h + off);
+		tag_free(h, (char *)h + off);
+		off = next;
+	}
+}
+
+void tag_lock(struct tagheap *h) {
+	//EOWNERDEAD: a process sharing h died holding the lock, maybe halfway
+	//through an operation. It is undone before anyone else sees the heap.
+	if (pthread_mutex_lock(&h->lock) == EOWNERDEAD) {
+		if (undo(h) == -1) {
+			fprintf(stderr, "smalloc: shared heap damaged\n");
+			abort();
+		}
+		h->logging = 1;
+		pthread_mutex_consistent(&h->lock);
+	}
+}
+
+void tag_unlock(struct tagheap *h) {
+	pthread_mutex_unlock(&h->lock);
+}
+
+void tag_walk(struct tagheap *h, int which,
+              void (*visit)(void *addr, size_t size, void *arg), void *arg) {
+	uint64_t off, tag;
+	int i;
+
+	if (which == SM_WALK_ALLOCATED) {
+		for (off = h->first; tag_size(tag = get(h, off)) != 0; off += tag_size(tag)) {
+			if (tag & TAG_ALLOC)
+				visit((char *)h + off + 8, tag_size(tag) - 8, arg);
+		}
+		return;
+	}
+	for (i = 0; i < NBINS; i++) {
+		for (off = h->bins[i]; off != 0; off = get(h, off + 8))
+			visit((char *)h + off + 8, tag_size(get(h, off)) - 8, arg);
+	}
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "smalloc.h"
+
+
+#define SIZE 4096
+
+/* Test for the SM_TAGGED layout, where block headers and footers live in
+ * the mem_init region.
+ * Test covers the following scenarios:
+ * - every payload is 16-byte aligned and sized up to hold its header.
+ * - freeing a block between two allocated blocks (no coalescing).
+ * - freeing the blocks on either side, which coalesces all three in O(1)
+ *   through the boundary tags.
+ * - sfree of addresses that were never returned by smalloc, and of a block
+ *   that is already free, fails with -1.
+ * - Releasing all allocated memory leaves a single free block.
+ */
+int main(void) {
+
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_TAGGED };
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+
+    char *ptrs[5];
+    int i;
+
+    /* 10 bytes and 24 bytes both need a 32 byte block (24 byte payload),
+     * 40 bytes needs a 48 byte block. */
+    int sizes[5] = {10, 24, 40, 10, 100};
+    for (i = 0; i < 5; i++) {
+        ptrs[i] = smalloc(sizes[i]);
+        write_to_mem(sizes[i], ptrs[i], i);
+        printf("allocating %d bytes at %p, 16-byte aligned: %s\n", sizes[i],
+               ptrs[i], ((unsigned long)ptrs[i] % 16) == 0 ? "yes" : "no");
+    }
+    printf("List of allocated blocks:\n");
+    print_allocated();
+    printf("List of free blocks:\n");
+    print_free();
+
+    /* 2nd block has allocated neighbours: a new 24 byte free block */
+    printf("freeing %p result = %d\n", ptrs[1], sfree(ptrs[1]));
+    printf("List of free blocks:\n");
+    print_free();
+
+    /* 1st and 3rd blocks merge with the 2nd: one 112 byte block (104 byte payload) */
+    printf("freeing %p result = %d\n", ptrs[0], sfree(ptrs[0]));
+    printf("freeing %p result = %d\n", ptrs[2], sfree(ptrs[2]));
+    printf("List of free blocks:\n");
+    print_free();
+
+    /* Expected: -1 for each */
+    printf("freeing %p (already free) result = %d\n", ptrs[2], sfree(ptrs[2]));
+    printf("freeing %p (inside a block) result = %d\n", ptrs[4] + 16, sfree(ptrs[4] + 16));
+    printf("freeing %p (outside the heap) result = %d\n", (void *)&opts, sfree(&opts));
+
+    /* Reuses the coalesced block at the start of the heap. Expected: %p == ptrs[0] */
+    char *p = smalloc(100);
+    printf("allocating 100 bytes. Expected: %p. Result: %p\n", ptrs[0], p);
+
+    /* Larger than the heap. Expected: NULL */
+    printf("allocating %d bytes. Expected: NULL. Result: %p\n", SIZE, smalloc(SIZE));
+
+    printf("freeing %p result = %d\n", p, sfree(p));
+    printf("freeing %p result = %d\n", ptrs[3], sfree(ptrs[3]));
+    printf("freeing %p result = %d\n", ptrs[4], sfree(ptrs[4]));
+    /* Expected: no allocated blocks, one free block */
+    printf("List of allocated blocks:\n");
+    print_allocated();
+    printf("List of free blocks:\n");
+    print_free();
+
+    mem_clean();
+    /* Each print-out should be blank.*/
+    printf("List of allocated blocks:\n");
+    print_allocated();
+    printf("List of free blocks:\n");
+    print_free();
+    return 0;
+}
@@ -6,25 +6,20 @@
 #include "smalloc.h"
 
 /* Functions to print the datastructures used by smalloc */
-extern void *mem;
-extern struct block *allocated_list;
-extern struct block *freelist;
 
-/* Prints each element of the list using the format string given below:*/
-void print_list(struct block *list) {
-    while (list != NULL){
-        printf("    [addr: %p, size: %d]\n", list->addr, list->size);
-        list = list->next;
-    }
-    printf("\n");
+/* Prints each block visited by mem_walk using the format string given below:*/
+static void print_block(void *addr, size_t size, void *arg) {
+    printf("    [addr: %p, size: %zu]\n", addr, size);
 }
 
 void print_allocated() {
-    print_list(allocated_list);
+    mem_walk(SM_WALK_ALLOCATED, print_block, NULL);
+    printf("\n");
 }
 
 void print_free() {
-    print_list(freelist);
+    mem_walk(SM_WALK_FREE, print_block, NULL);
+    printf("\n");
 }
 
 /* write value size times to memory starting at ptr */
@@ -35,31 +30,31 @@ void write_to_mem(int size, char *ptr, char value) {
     }
 }
 
-/* Prints the contents of allocated memory. Each byte is printed as two
+/* Prints the contents of one allocated block. Each byte is printed as two
  * hexadecimal digits. */
-void print_mem() {
-    struct block *cur = allocated_list;
-    
-    while(cur != NULL) {
-        printf("%p: size = %d\n", cur->addr, cur->size);
-        
-        /* print 16 bytes per line */
-        int i, j;
-        for(i = 0; i < cur->size / 8; i++){
-            if((i)%2 == 0){
-                printf("%5d:  ", i * 8);
-            } else {
-                printf("  ");
-            }
-            for(j = 0; j < 8; j++) {
-                printf("%02x ", *((char *)cur->addr + ((i*8) + j)));
-            }
-            if((i+1) % 2 == 0 && ((i+1) * 8) != cur->size){
-                printf("\n");
-            }
+static void print_block_mem(void *addr, size_t size, void *arg) {
+    printf("%p: size = %zu\n", addr, size);
+
+    /* print 16 bytes per line */
+    int i, j;
+    for(i = 0; i < size / 8; i++){
+        if((i)%2 == 0){
+            printf("%5d:  ", i * 8);
+        } else {
+            printf("  ");
+        }
+        for(j = 0; j < 8; j++) {
+            printf("%02x ", *((char *)addr + ((i*8) + j)));
+        }
+        if((i+1) % 2 == 0 && ((i+1) * 8) != size){
+            printf("\n");
         }
-        printf("\n");
-        cur =cur->next;
     }
     printf("\n");
 }
+
+/* Prints the contents of allocated memory. */
+void print_mem() {
+    mem_walk(SM_WALK_ALLOCATED, print_block_mem, NULL);
+    printf("\n");
+}
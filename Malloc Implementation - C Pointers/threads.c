@@ -0,0 +1,388 @@
+/*
+ * Thread-safe front end for smalloc (SM_THREADS).
+ *
+ * The region is split into equal slices, each formatted as a tagged heap
+ * (tagheap.c) with its own lock: an arena. Threads are spread over the
+ * arenas round-robin the first time they allocate, so with at least as
+ * many arenas as threads no two threads ever contend for a lock.
+ *
+ * On top of that every thread keeps a small cache of free blocks per size
+ * class (block sizes up to TCACHE_MAX_BLOCK). Small allocations and frees
+ * of blocks from the thread's own arena only touch the cache; the cache
+ * is refilled and drained TCACHE_BATCH blocks at a time under one lock.
+ *
+ * A block freed by a thread whose arena does not own it is pushed on the
+ * owning arena's remote free stack with a single compare-and-swap, and the
+ * owner gives it back to its heap the next time it takes its lock.
+ *
+ * The mem_stats counters are per thread too, so counting does not make
+ * threads share a cache line. mt_stats sums them over a list of every
+ * thread's cache; threads that exit leave their counts behind in retired.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "smalloc.h"
+#include "smalloc_int.h"
+
+#define MAX_ARENAS 64
+#define TCACHE_MAX_BLOCK 512 /* largest block size, tags included, cached */
+#define TCACHE_CLASSES (TCACHE_MAX_BLOCK / 16 - 1) /* 32, 48, ... 512 */
+#define TCACHE_BATCH 16 /* blocks moved per refill or flush */
+#define TCACHE_LIMIT (4 * TCACHE_BATCH) /* blocks per class before a flush */
+
+static struct tagheap *arenas[MAX_ARENAS];
+static int narenas;
+static char *base; /* start of the region */
+static unsigned long slice; /* bytes per arena */
+static unsigned int next_arena;
+
+/* Bumped by mt_init and mt_clean, so thread caches left over from an
+ * earlier heap are dropped instead of being used */
+static unsigned long generation;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+struct tcache {
+	unsigned long generation;
+	struct tagheap *home; /* arena this thread allocates from */
+	int registered; /* flush at thread exit is set up */
+	void *head[TCACHE_CLASSES]; /* linked through their first word */
+	int count[TCACHE_CLASSES];
+	struct sm_counters counters;
+	struct tcache *next; /* in the list of all caches */
+	struct tcache *prev;
+};
+
+static __thread struct tcache tcache;
+
+/* Every registered cache, and the counts of threads that exited since
+ * mt_init. The lock also covers resetting a cache's counters. */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tcache *caches;
+static struct sm_counters retired;
+static long peak; /* highest total mt_stats has seen */
+
+/* Returns the block size, tags included, that tag_malloc uses for nbytes */
+static unsigned long block_size(unsigned long nbytes) {
+	unsigned long size = (nbytes + 8 + 15) & ~15UL;
+	return size < 32 ? 32 : size;
+}
+
+static int class_of(unsigned long size) {
+	return size / 16 - 2;
+}
+
+/* Returns the arena whose slice holds addr, or NULL */
+static struct tagheap *owner(void *addr) {
+	unsigned long i;
+	if ((char *)addr < base)
+		return NULL;
+	i = ((char *)addr - base) / slice;
+	return i < narenas ? arenas[i] : NULL;
+}
+
+/* Gives n cached blocks of class c back to the thread's arena */
+static void flush(struct tcache *tc, int c, int n) {
+	void *p;
+	tag_lock(tc->home);
+	while (n-- > 0 && (p = tc->head[c]) != NULL) {
+		tc->head[c] = *(void **)p;
+		tc->count[c]--;
+		tag_unclaim(tc->home, p);
+		tag_free(tc->home, p);
+	}
+	tag_unlock(tc->home);
+}
+
+/* pthread_key destructor: empties the cache of an exiting thread */
+static void tcache_exit(void *arg) {
+	struct tcache *tc = arg;
+	int c, i;
+
+	pthread_mutex_lock(&caches_lock);
+	if (tc->next != NULL)
+		tc->next->prev = tc->prev;
+	if (tc->prev != NULL)
+		tc->prev->next = tc->next;
+	else
+		caches = tc->next;
+	if (tc->generation == generation) {
+		retired.bytes += tc->counters.bytes;
+		retired.blocks += tc->counters.blocks;
+		retired.allocs += tc->counters.allocs;
+		retired.frees += tc->counters.frees;
+		for (i = 0; i < SM_HIST_BUCKETS; i++)
+			retired.hist[i] += tc->counters.hist[i];
+	}
+	pthread_mutex_unlock(&caches_lock);
+	if (tc->generation != generation)
+		return;
+	for (c = 0; c < TCACHE_CLASSES; c++) {
+		if (tc->count[c] > 0)
+			flush(tc, c, tc->count[c]);
+	}
+}
+
+static void tcache_key_init(void) {
+	pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/* Returns the calling thread's cache, setting it up on first use */
+static struct tcache *get_tcache(void) {
+	struct tcache *tc = &tcache;
+	int c;
+
+	if (tc->generation == generation)
+		return tc;
+	pthread_mutex_lock(&caches_lock);
+	tc->generation = generation;
+	memset(&tc->counters, 0, sizeof(tc->counters));
+	if (!tc->registered) {
+		tc->prev = NULL;
+		tc->next = caches;
+		if (caches != NULL)
+			caches->prev = tc;
+		caches = tc;
+	}
+	pthread_mutex_unlock(&caches_lock);
+	tc->home = arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % narenas];
+	for (c = 0; c < TCACHE_CLASSES; c++) {
+		tc->head[c] = NULL;
+		tc->count[c] = 0;
+	}
+	if (!tc->registered) {
+		pthread_once(&tcache_once, tcache_key_init);
+		pthread_setspecific(tcache_key, tc);
+		tc->registered = 1;
+	}
+	return tc;
+}
+
+/* Allocates from arena h under its lock, after taking back the blocks
+ * other threads freed into it */
+static void *locked_malloc(struct tagheap *h, unsigned long nbytes) {
+	void *p;
+	tag_lock(h);
+	tag_drain_remote(h);
+	p = tag_malloc(h, nbytes);
+	tag_unlock(h);
+	return p;
+}
+
+/* Tries every arena but the thread's own, for when that one is full */
+static void *steal(struct tcache *tc, unsigned long nbytes) {
+	void *p;
+	int i;
+	for (i = 0; i < narenas; i++) {
+		if (arenas[i] != tc->home && (p = locked_malloc(arenas[i], nbytes)) != NULL)
+			return p;
+	}
+	return NULL;
+}
+
+/* Takes up to TCACHE_BATCH blocks of class c from the home arena under one
+ * lock. Returns one of them and caches the rest. */
+static void *refill(struct tcache *tc, int c) {
+	unsigned long nbytes = (c + 2) * 16 - 8;
+	void *p, *result;
+	int n;
+
+	tag_lock(tc->home);
+	tag_drain_remote(tc->home);
+	result = tag_malloc(tc->home, nbytes);
+	for (n = 1; result != NULL && n < TCACHE_BATCH; n++) {
+		if ((p = tag_malloc(tc->home, nbytes)) == NULL)
+			break;
+		tag_claim(tc->home, p);
+		*(void **)p = tc->head[c];
+		tc->head[c] = p;
+		tc->count[c]++;
+	}
+	tag_unlock(tc->home);
+	return result;
+}
+
+int mt_init(void *region, unsigned long size, int n, int policy) {
+	int i;
+
+	if (n <= 0 || n > MAX_ARENAS)
+		return -1;
+	//page-aligned slices, so arenas do not share pages
+	slice = (size / n) & ~(SM_PAGE - 1);
+	for (i = 0; i < n; i++) {
+		if ((arenas[i] = tag_init((char *)region + i * slice, slice, policy)) == NULL)
+			return -1;
+	}
+	base = region;
+	narenas = n;
+	pthread_mutex_lock(&caches_lock);
+	generation++;
+	memset(&retired, 0, sizeof(retired));
+	peak = 0;
+	pthread_mutex_unlock(&caches_lock);
+	return 0;
+}
+
+void *mt_malloc(unsigned long nbytes, size_t *size) {
+	struct tcache *tc;
+	unsigned long bsize;
+	void *p;
+	int c;
+
+	if (nbytes == 0)
+		return NULL;
+	tc = get_tcache();
+	bsize = block_size(nbytes);
+	if (bsize <= TCACHE_MAX_BLOCK) {
+		c = class_of(bsize);
+		if ((p = tc->head[c]) != NULL) {
+			tc->head[c] = *(void **)p;
+			tc->count[c]--;
+			tag_unclaim(tc->home, p);
+			*size = tag_usable_size(tc->home, p);
+			return p;
+		}
+		p = refill(tc, c);
+	} else {
+		p = locked_malloc(tc->home, nbytes);
+	}
+	if (p == NULL)
+		p = steal(tc, nbytes);
+	if (p != NULL)
+		*size = mt_usable_size(p);
+	return p;
+}
+
+int mt_free(void *addr, size_t *size) {
+	struct tagheap *h = owner(addr);
+	struct tcache *tc;
+	unsigned long bsize;
+	int c;
+
+	//marks the block as cached first, so a second sfree of addr fails
+	if (h == NULL || (bsize = tag_claim(h, addr)) == 0)
+		return -1;
+	*size = bsize - 8;
+	tc = get_tcache();
+	if (h != tc->home) {
+		tag_push_remote(h, addr);
+		return 0;
+	}
+	if (bsize > TCACHE_MAX_BLOCK) {
+		tag_lock(h);
+		tag_unclaim(h, addr);
+		tag_free(h, addr);
+		tag_unlock(h);
+		return 0;
+	}
+	c = class_of(bsize);
+	*(void **)addr = tc->head[c];
+	tc->head[c] = addr;
+	if (++tc->count[c] > TCACHE_LIMIT)
+		flush(tc, c, TCACHE_BATCH);
+	return 0;
+}
+
+/* Aligned blocks bypass the thread cache */
+void *mt_memalign(unsigned long alignment, unsigned long nbytes, size_t *size) {
+	struct tcache *tc;
+	void *p;
+	int i;
+
+	if (alignment <= 16)
+		return mt_malloc(nbytes, size);
+	tc = get_tcache();
+	tag_lock(tc->home);
+	tag_drain_remote(tc->home);
+	if ((p = tag_memalign(tc->home, alignment, nbytes)) != NULL)
+		*size = tag_usable_size(tc->home, p);
+	tag_unlock(tc->home);
+	for (i = 0; p == NULL && i < narenas; i++) {
+		if (arenas[i] != tc->home) {
+			tag_lock(arenas[i]);
+			if ((p = tag_memalign(arenas[i], alignment, nbytes)) != NULL)
+				*size = tag_usable_size(arenas[i], p);
+			tag_unlock(arenas[i]);
+		}
+	}
+	return p;
+}
+
+/* Resizes the block at addr in place under the lock of the arena that
+ * owns it, whichever thread that is. Same return values as tag_resize;
+ * old_size is set to the block's payload size before the call, and on
+ * success new_size to the one after. */
+int mt_resize(void *addr, unsigned long nbytes, unsigned long *old_size, unsigned long *new_size) {
+	struct tagheap *h = owner(addr);
+	int result;
+
+	if (h == NULL)
+		return -1;
+	tag_lock(h);
+	*old_size = *new_size = tag_usable_size(h, addr);
+	if ((result = tag_resize(h, addr, nbytes)) == 0)
+		*new_size = tag_usable_size(h, addr);
+	tag_unlock(h);
+	return result;
+}
+
+unsigned long mt_usable_size(void *addr) {
+	struct tagheap *h = owner(addr);
+	return h != NULL ? tag_usable_size(h, addr) : 0;
+}
+
+struct sm_counters *mt_counters(void) {
+	return &get_tcache()->counters;
+}
+
+/* Other threads keep counting while this runs, so the sums are only as
+ * exact as a snapshot can be */
+void mt_stats(struct sm_counters *c, size_t *free_blocks, size_t *free_bytes, size_t *largest) {
+	struct tcache *tc;
+	int i;
+
+	pthread_mutex_lock(&caches_lock);
+	*c = retired;
+	for (tc = caches; tc != NULL; tc = tc->next) {
+		if (tc->generation != generation)
+			continue;
+		c->bytes += counter_get(&tc->counters.bytes);
+		c->blocks += counter_get(&tc->counters.blocks);
+		c->allocs += counter_get(&tc->counters.allocs);
+		c->frees += counter_get(&tc->counters.frees);
+		for (i = 0; i < SM_HIST_BUCKETS; i++)
+			c->hist[i] += counter_get(&tc->counters.hist[i]);
+	}
+	if (c->bytes > peak)
+		peak = c->bytes;
+	c->peak = peak;
+	pthread_mutex_unlock(&caches_lock);
+	for (i = 0; i < narenas; i++) {
+		tag_lock(arenas[i]);
+		tag_stats(arenas[i], free_blocks, free_bytes, largest);
+		tag_unlock(arenas[i]);
+	}
+}
+
+/* Walks every arena in turn. Blocks in thread caches count as allocated;
+ * blocks other threads freed are given back first. */
+void mt_walk(int which, void (*visit)(void *addr, size_t size, void *arg), void *arg) {
+	int i;
+	for (i = 0; i < narenas; i++) {
+		tag_lock(arenas[i]);
+		tag_drain_remote(arenas[i]);
+		tag_walk(arenas[i], which, visit, arg);
+		tag_unlock(arenas[i]);
+	}
+}
+
+/* Forgets the arenas. Must only be called once no other thread uses the
+ * heap; their caches are dropped lazily through the generation count. */
+void mt_clean(void) {
+	narenas = 0;
+	base = NULL;
+	generation++;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "smalloc.h"
+
+
+#define SIZE (64 * 1024 * 1024)
+#define ARENAS 4
+#define OPS 200000
+#define LIVE 1000
+#define HANDOFF 100000
+
+/* Test for SM_THREADS.
+ * Test covers the following scenarios:
+ * - 1, 2 and 4 threads allocating and freeing on their own at the same
+ *   time, with the throughput of each run.
+ * - a producer thread allocating blocks that a consumer thread frees, so
+ *   every free goes to another thread's arena.
+ * - sfree of a block that is already free, and of an address outside the
+ *   region, fails with -1 (also when the block sits in a thread cache).
+ * - once the threads are done, every arena is back to a single free block:
+ *   the caches of exited threads and the blocks other threads freed were
+ *   all given back.
+ */
+
+struct worker {
+    pthread_t thread;
+    int seed;
+    int errors;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Random allocations and frees, keeping up to LIVE blocks */
+static void *churn(void *arg) {
+    struct worker *w = arg;
+    char *ptrs[LIVE];
+    unsigned int seed = w->seed;
+    int live = 0, i;
+
+    for (i = 0; i < OPS; i++) {
+        if (live < LIVE && (live == 0 || rand_r(&seed) % 2 == 0)) {
+            int size = rand_r(&seed) % 16 == 0 ? rand_r(&seed) % 2048 + 1 : rand_r(&seed) % 128 + 1;
+            if ((ptrs[live] = smalloc(size)) == NULL) {
+                w->errors++;
+                continue;
+            }
+            write_to_mem(size, ptrs[live], (char)i);
+            live++;
+        } else {
+            int j = rand_r(&seed) % live;
+            if (sfree(ptrs[j]) != 0)
+                w->errors++;
+            //a second free of the same address must fail
+            if (sfree(ptrs[j]) != -1)
+                w->errors++;
+            ptrs[j] = ptrs[--live];
+        }
+    }
+    while (live > 0) {
+        if (sfree(ptrs[--live]) != 0)
+            w->errors++;
+    }
+    return NULL;
+}
+
+/* Single-producer single-consumer ring of blocks to free */
+#define RING 256
+static char *ring[RING];
+static unsigned int ring_head, ring_tail;
+
+static void *producer(void *arg) {
+    struct worker *w = arg;
+    int i;
+    for (i = 0; i < HANDOFF; i++) {
+        char *p = smalloc(i % 200 + 1);
+        if (p == NULL) {
+            w->errors++;
+            continue;
+        }
+        write_to_mem(i % 200 + 1, p, (char)i);
+        while (ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING)
+            sched_yield();
+        ring[ring_head % RING] = p;
+        __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    }
+    //a NULL tells the consumer to stop
+    while (ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING)
+        sched_yield();
+    ring[ring_head % RING] = NULL;
+    __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    struct worker *w = arg;
+    char *p;
+    //allocate once, so this thread has an arena of its own
+    sfree(smalloc(1));
+    do {
+        while (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == ring_tail)
+            sched_yield();
+        p = ring[ring_tail % RING];
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+        if (p != NULL && sfree(p) != 0)
+            w->errors++;
+    } while (p != NULL);
+    return NULL;
+}
+
+static void count_block(void *addr, size_t size, void *arg) {
+    long *count = arg;
+    count[0]++;
+    count[1] += size;
+}
+
+static void report(const char *name) {
+    long allocated[2] = {0, 0}, free_blocks[2] = {0, 0};
+    mem_walk(SM_WALK_ALLOCATED, count_block, allocated);
+    mem_walk(SM_WALK_FREE, count_block, free_blocks);
+    printf("%s: Expected allocated blocks: 0. Result: %ld\n", name, allocated[0]);
+    printf("%s: Expected free blocks: %d. Result: %ld\n", name, ARENAS, free_blocks[0]);
+}
+
+static void run_churn(int nthreads) {
+    struct worker w[ARENAS];
+    char name[32];
+    double start = now();
+    int i, errors = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        w[i].seed = i + 1;
+        w[i].errors = 0;
+        pthread_create(&w[i].thread, NULL, churn, &w[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(w[i].thread, NULL);
+        errors += w[i].errors;
+    }
+    sprintf(name, "%d thread%s", nthreads, nthreads > 1 ? "s" : "");
+    printf("%s: %d ops in %.2fs (%.0f ops/s), %d errors\n", name, nthreads * OPS,
+           now() - start, nthreads * OPS / (now() - start), errors);
+    report(name);
+}
+
+int main(void) {
+    struct smalloc_opts opts = { SM_FIRST_FIT, SM_THREADS, ARENAS };
+    struct worker prod = {0}, cons = {0};
+    int dummy;
+
+    if (mem_init_ex(SIZE, &opts) == -1) {
+        fprintf(stderr, "mem_init_ex failed\n");
+        return 1;
+    }
+
+    run_churn(1);
+    run_churn(2);
+    run_churn(4);
+
+    pthread_create(&prod.thread, NULL, producer, &prod);
+    pthread_create(&cons.thread, NULL, consumer, &cons);
+    pthread_join(prod.thread, NULL);
+    pthread_join(cons.thread, NULL);
+    printf("producer/consumer: %d blocks freed by another thread, %d errors\n",
+           HANDOFF, prod.errors + cons.errors);
+    report("producer/consumer");
+
+    /* Not in the region at all */
+    printf("freeing a stack address. Expected: -1. Result: %d\n", sfree(&dummy));
+
+    mem_clean();
+    return 0;
+}
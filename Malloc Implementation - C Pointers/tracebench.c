@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "smalloc.h"
+
+
+/* Trace-driven benchmark for smalloc, and glibc malloc for comparison.
+ *
+ *   tracebench gen uniform|powerlaw|phases EVENTS [SEED] > TRACE
+ *   tracebench run TRACE [ALLOCATOR ...]
+ *
+ * "make bench" builds it with optimization and runs it on one trace of
+ * each kind.
+ *
+ * A trace is a text file with one event per line:
+ *
+ *   a ID SIZE    allocate SIZE bytes as block ID
+ *   r ID SIZE    resize block ID to SIZE bytes
+ *   f ID         free block ID
+ *
+ * IDs are small integers that can be reused once a block is freed, and
+ * every block is freed by the end of the trace. Lines starting with # are
+ * comments.
+ *
+ * "run" replays the trace once per allocator, each in a child process of
+ * its own so they do not share memory. ALLOCATOR is one of first,
+ * segregated, next, best, buddy, aligned, tagged, slab and glibc; the
+ * default is first, segregated, tagged, slab and glibc. The smalloc heaps
+ * all use SM_GROW, so a trace never runs out of memory.
+ *
+ * For each allocator it prints the ops per second (counting only the time
+ * spent in the calls, as timed one by one), latency percentiles, the peak footprint (growth of
+ * the resident set size), the overhead (footprint over the peak of the
+ * bytes asked for) and, for smalloc, the fragmentation mem_stats reported
+ * when the bytes asked for peaked.
+ */
+
+#define INIT_SIZE (1 << 20)
+
+struct event {
+    char op; /* 'a', 'r' or 'f' */
+    unsigned int id;
+    size_t size;
+};
+
+struct trace {
+    struct event *events;
+    size_t count;
+    unsigned int ids; /* highest ID + 1 */
+};
+
+struct config {
+    const char *name;
+    int policy;
+    int flags;
+};
+
+static const struct config configs[] = {
+    {"first", SM_FIRST_FIT, 0},
+    {"segregated", SM_SEGREGATED_FIT, 0},
+    {"next", SM_NEXT_FIT, 0},
+    {"best", SM_BEST_FIT, 0},
+    {"buddy", SM_BUDDY, 0},
+    {"aligned", SM_FIRST_FIT, SM_ALIGNED},
+    {"tagged", SM_FIRST_FIT, SM_TAGGED},
+    {"slab", SM_FIRST_FIT, SM_SLAB},
+    {"glibc", -1, 0},
+};
+#define NCONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+static const char *default_configs[] = {"first", "segregated", "tagged", "slab", "glibc"};
+
+/****************************************************************************/
+/* Trace generators */
+
+/* xorshift64*, so traces are the same on every machine for a seed */
+static unsigned long long rng_state;
+
+static unsigned long long rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1) */
+static double unit(void) {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t uniform_size(size_t lo, size_t hi) {
+    return lo + rng() % (hi - lo + 1);
+}
+
+/* Pareto distributed with the given minimum and shape, capped at max:
+ * mostly small values, with a long tail of large ones */
+static size_t pareto(double min, double alpha, size_t max) {
+    double x = min / pow(1 - unit(), 1 / alpha);
+    return x > max ? max : (size_t)x;
+}
+
+/* Live blocks of the generator, and a min-heap of them by time of death */
+struct live {
+    unsigned long death;
+    unsigned int id;
+};
+
+static struct live *heap;
+static size_t heap_len;
+static unsigned int *free_ids;
+static size_t free_ids_len;
+static unsigned int next_id;
+
+static void heap_push(unsigned long death, unsigned int id) {
+    size_t i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].death > death) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i].death = death;
+    heap[i].id = id;
+}
+
+static struct live heap_pop(void) {
+    struct live top = heap[0], last = heap[--heap_len];
+    size_t i = 0, c;
+    while ((c = 2 * i + 1) < heap_len) {
+        if (c + 1 < heap_len && heap[c + 1].death < heap[c].death)
+            c++;
+        if (heap[c].death >= last.death)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static unsigned int new_id(void) {
+    return free_ids_len > 0 ? free_ids[--free_ids_len] : next_id++;
+}
+
+/* Writes events until count are out. Every block gets a size and a
+ * lifetime (in events) from the generator's distributions. Blocks die in
+ * order of their time of death; one in sixteen live blocks is resized
+ * along the way, and whatever is still live at the end is freed. */
+static void generate(const char *kind, unsigned long count) {
+    unsigned long t;
+    struct live dead;
+    size_t size, lifetime;
+    unsigned int id;
+    int phase;
+
+    heap = malloc(count * sizeof(*heap));
+    free_ids = malloc(count * sizeof(*free_ids));
+    if (heap == NULL || free_ids == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    printf("# %s trace, %lu events\n", kind, count);
+    for (t = 0; t < count; t++) {
+        if (heap_len > 0 && (heap[0].death <= t || count - t <= heap_len)) {
+            dead = heap_pop();
+            printf("f %u\n", dead.id);
+            free_ids[free_ids_len++] = dead.id;
+            continue;
+        }
+        if (heap_len > 0 && rng() % 16 == 0) {
+            //resize a random live block; its time of death stays
+            id = heap[rng() % heap_len].id;
+            printf("r %u %zu\n", id, uniform_size(1, 8192));
+            continue;
+        }
+        if (strcmp(kind, "uniform") == 0) {
+            size = uniform_size(1, 4096);
+            lifetime = uniform_size(1, 20000);
+        } else if (strcmp(kind, "powerlaw") == 0) {
+            size = pareto(16, 1.2, 1 << 20);
+            lifetime = pareto(10, 0.8, count);
+        } else {
+            //phases of 10000 events: many small short-lived blocks, then
+            //fewer large long-lived ones, then a mix of both
+            phase = t / 10000 % 3;
+            if (phase == 0 || (phase == 2 && rng() % 2)) {
+                size = uniform_size(8, 128);
+                lifetime = uniform_size(1, 500);
+            } else {
+                size = uniform_size(1024, 65536);
+                lifetime = uniform_size(5000, 50000);
+            }
+        }
+        id = new_id();
+        printf("a %u %zu\n", id, size);
+        heap_push(t + lifetime, id);
+    }
+    free(heap);
+    free(free_ids);
+}
+
+/****************************************************************************/
+/* Replay */
+
+static int load(const char *path, struct trace *tr) {
+    FILE *f = fopen(path, "r");
+    char line[128];
+    size_t cap = 1024;
+    struct event e;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    tr->count = 0;
+    tr->ids = 0;
+    tr->events = malloc(cap * sizeof(struct event));
+    while (tr->events != NULL && fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        e.size = 0;
+        if (sscanf(line, "%c %u %zu", &e.op, &e.id, &e.size) < 2 ||
+            (e.op != 'a' && e.op != 'r' && e.op != 'f')) {
+            fprintf(stderr, "%s: bad event: %s", path, line);
+            fclose(f);
+            return -1;
+        }
+        if (e.id >= tr->ids)
+            tr->ids = e.id + 1;
+        if (tr->count == cap) {
+            cap *= 2;
+            tr->events = realloc(tr->events, cap * sizeof(struct event));
+        }
+        if (tr->events != NULL)
+            tr->events[tr->count++] = e;
+    }
+    fclose(f);
+    if (tr->events == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads a field of /proc/self/status, in bytes */
+static long proc_status(const char *field) {
+    FILE *f = fopen("/proc/self/status", "r");
+    char line[128];
+    long kb = 0;
+    size_t n = strlen(field);
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, n) == 0 && line[n] == ':') {
+            kb = atol(line + n + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+/* Resets the peak resident set size (VmHWM) to the current one */
+static void reset_peak_rss(void) {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+static long long nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int by_value(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Writes a byte to every page of the block, as a program using it would,
+ * so the footprint is the memory the allocator really needs */
+static void touch(char *p, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i += 4096)
+        p[i] = 1;
+    if (size > 0)
+        p[size - 1] = 1;
+}
+
+/* Replays tr against config c and prints one line of results. Returns 0,
+ * or -1 if an allocation failed. */
+static int replay(const struct trace *tr, const struct config *c) {
+    struct smalloc_opts opts = { c->policy, c->flags | SM_GROW };
+    void **ptrs = calloc(tr->ids, sizeof(void *));
+    size_t *sizes = calloc(tr->ids, sizeof(size_t));
+    unsigned int *lat = malloc(tr->count * sizeof(unsigned int));
+    int smalloc_run = c->policy >= 0;
+    size_t i, live = 0, peak_live = 0;
+    double frag = -1;
+    long long t0, total = 0;
+    long base_rss, footprint;
+    struct smalloc_stats st;
+    struct event *e;
+    void *p;
+
+    if (ptrs == NULL || sizes == NULL || lat == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    if (smalloc_run && mem_init_ex(INIT_SIZE, &opts) == -1)
+        return -1;
+    reset_peak_rss();
+    base_rss = proc_status("VmRSS");
+    for (i = 0; i < tr->count; i++) {
+        e = &tr->events[i];
+        t0 = nsec();
+        switch (e->op) {
+        case 'a':
+            p = smalloc_run ? smalloc(e->size) : malloc(e->size);
+            break;
+        case 'r':
+            p = smalloc_run ? srealloc(ptrs[e->id], e->size) : realloc(ptrs[e->id], e->size);
+            break;
+        default:
+            if (smalloc_run)
+                sfree(ptrs[e->id]);
+            else
+                free(ptrs[e->id]);
+            p = NULL;
+        }
+        lat[i] = nsec() - t0;
+        total += lat[i];
+        if (p == NULL && e->op != 'f' && e->size != 0) {
+            fprintf(stderr, "%s: event %zu: out of memory\n", c->name, i);
+            return -1;
+        }
+        live -= sizes[e->id];
+        sizes[e->id] = e->op == 'f' ? 0 : e->size;
+        live += sizes[e->id];
+        if (e->op != 'f') {
+            ptrs[e->id] = p;
+            if (p != NULL)
+                touch(p, e->size);
+        }
+        if (live > peak_live) {
+            peak_live = live;
+            if (smalloc_run) {
+                mem_stats(&st);
+                frag = st.fragmentation;
+            }
+        }
+    }
+    footprint = proc_status("VmHWM") - base_rss;
+    qsort(lat, tr->count, sizeof(unsigned int), by_value);
+    printf("%-11s %10.0f %6u %6u %6u %7u %9u %9.1f %8.2f ", c->name, tr->count / (total / 1e9),
+           lat[tr->count / 2], lat[tr->count * 9 / 10], lat[tr->count * 99 / 100],
+           lat[tr->count * 999 / 1000], lat[tr->count - 1], footprint / 1048576.0,
+           peak_live ? (double)footprint / peak_live : 0);
+    if (frag >= 0)
+        printf("%9.3f\n", frag);
+    else
+        printf("%9s\n", "-");
+    if (smalloc_run)
+        mem_clean();
+    free(ptrs);
+    free(sizes);
+    free(lat);
+    return 0;
+}
+
+static const struct config *find_config(const char *name) {
+    size_t i;
+    for (i = 0; i < NCONFIGS; i++) {
+        if (strcmp(configs[i].name, name) == 0)
+            return &configs[i];
+    }
+    return NULL;
+}
+
+static int run(const char *path, int n, const char **names) {
+    struct trace tr;
+    const struct config *c;
+    int i, status, failed = 0;
+    pid_t pid;
+
+    if (load(path, &tr) == -1)
+        return 1;
+    printf("%s: %zu events\n", path, tr.count);
+    printf("%-11s %10s %6s %6s %6s %7s %9s %9s %8s %9s\n", "allocator", "ops/s",
+           "p50ns", "p90ns", "p99ns", "p99.9ns", "max ns", "peak MiB", "overhead", "frag");
+    fflush(stdout);
+    for (i = 0; i < n; i++) {
+        if ((c = find_config(names[i])) == NULL) {
+            fprintf(stderr, "unknown allocator %s\n", names[i]);
+            failed = 1;
+            continue;
+        }
+        if ((pid = fork()) == -1) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0)
+            exit(replay(&tr, c) == 0 ? 0 : 1);
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    free(tr.events);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 4 && strcmp(argv[1], "gen") == 0 &&
+        (strcmp(argv[2], "uniform") == 0 || strcmp(argv[2], "powerlaw") == 0 ||
+         strcmp(argv[2], "phases") == 0)) {
+        rng_state = argc > 4 ? strtoull(argv[4], NULL, 10) | 1 : 88172645463325252ULL;
+        generate(argv[2], strtoul(argv[3], NULL, 10));
+        return 0;
+    }
+    if (argc >= 3 && strcmp(argv[1], "run") == 0) {
+        if (argc == 3)
+            return run(argv[2], sizeof(default_configs) / sizeof(default_configs[0]),
+                       default_configs);
+        return run(argv[2], argc - 3, (const char **)argv + 3);
+    }
+    fprintf(stderr, "usage: %s gen uniform|powerlaw|phases EVENTS [SEED]\n"
+                    "       %s run TRACE [ALLOCATOR ...]\n", argv[0], argv[0]);
+    return 1;
+}